@@ -0,0 +1,401 @@
+#include "arena.hpp"
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <lz4.h>
+
+void* Arena::allocate(size_t size, size_t align) {
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(cursor) + align - 1) & ~(uintptr_t)(align - 1);
+    if (!cursor || aligned + size > reinterpret_cast<uintptr_t>(limit)) {
+        size_t capacity = std::max(blockSize, size + align);
+        blocks.emplace_back(new uint8_t[capacity]);
+        cursor = blocks.back().get();
+        limit = cursor + capacity;
+        aligned = (reinterpret_cast<uintptr_t>(cursor) + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    cursor = reinterpret_cast<uint8_t*>(aligned + size);
+    used += size;
+    return reinterpret_cast<void*>(aligned);
+}
+
+void Node::setString(const char* data, size_t length, Arena& arena) {
+    type = ValueType::String;
+    if (length <= kInlineCapacity) {
+        inlined = 1;
+        aux = static_cast<uint16_t>(length);
+        std::memcpy(reinterpret_cast<char*>(this) + offsetof(Node, size), data, length);
+        return;
+    }
+    if (length > UINT32_MAX) throw std::runtime_error("String too large for Node");
+    char* copy = arena.allocateArray<char>(length);
+    std::memcpy(copy, data, length);
+    inlined = 0;
+    size = static_cast<uint32_t>(length);
+    str = copy;
+}
+
+const Node* NodeDocument::find(const Node& object, std::string_view target) const {
+    if (object.type != ValueType::Object) throw std::runtime_error("Not an Object");
+    long low = 0;
+    long high = static_cast<long>(object.size) - 1;
+    while (low <= high) {
+        long mid = low + (high - low) / 2;
+        int cmp = key(object.fields[mid].key).compare(target);
+        if (cmp == 0) return &object.fields[mid].value;
+        if (cmp < 0) low = mid + 1;
+        else high = mid - 1;
+    }
+    return nullptr;
+}
+
+Value NodeDocument::toValue(const Node& node) const {
+    switch (node.type) {
+        case ValueType::Null: return Value();
+        case ValueType::String: return Value(std::string(node.asString()));
+        case ValueType::Integer: return Value(node.integer);
+        case ValueType::Float: return Value(node.real);
+        case ValueType::Boolean: return Value(node.boolean);
+        case ValueType::Byte: return Value(node.byte);
+        case ValueType::Custom:
+            return Custom(node.aux, std::vector<uint8_t>(node.bytes, node.bytes + node.size)).toValue();
+        case ValueType::Object: {
+            Object obj;
+            obj.fields.reserve(node.size);
+            for (uint32_t i = 0; i < node.size; i++) {
+                obj.fields.emplace_back(std::string(key(node.fields[i].key)), toValue(node.fields[i].value));
+            }
+            return obj.toValue();
+        }
+        case ValueType::List: {
+            List l;
+            l.elements.reserve(node.size);
+            for (uint32_t i = 0; i < node.size; i++) {
+                l.add(toValue(node.elements[i]));
+            }
+            return l.toValue();
+        }
+        case ValueType::Reference: return Reference(node.reference).toValue();
+    }
+    return Value();
+}
+
+const uint8_t* NodeBuilder::readNBytesPtr(size_t n, size_t& offset) {
+    if (offset + n > fileSize) {
+        throw std::runtime_error("EOF: Attempted to read past end of file.");
+    }
+    const uint8_t* ptr = fileData + offset;
+    offset += n;
+    return ptr;
+}
+
+uint8_t NodeBuilder::readByte(size_t& offset) {
+    if (offset >= fileSize) throw std::runtime_error("EOF: Attempted to read a single byte past end of file.");
+    return fileData[offset++];
+}
+
+uint64_t NodeBuilder::readVarNumber(size_t& offset) {
+    uint8_t size_byte = readByte(offset);
+    if (size_byte < 128) return static_cast<uint64_t>(size_byte);
+
+    size_t len = size_byte & 0x7F;
+    const uint8_t* arr = readNBytesPtr(len, offset);
+    uint64_t result = 0;
+    if (len > sizeof(uint64_t)) len = sizeof(uint64_t);
+    std::memcpy(&result, arr, len);
+    return result;
+}
+
+void NodeBuilder::buildValue(size_t& offset, long parentId, Node& out) {
+    const uint8_t* value = fileData + offset;
+    uint8_t byte = readByte(offset);
+
+    if ((byte & 0x80) == 0) {
+        size_t strSize = byte & 0x7F;
+        if (strSize == 0x7F) {
+            size_t compressedSize = readVarNumber(offset);
+            size_t originalSize = readVarNumber(offset);
+            const uint8_t* comp_ptr = readNBytesPtr(compressedSize, offset);
+            char* text = arena.allocateArray<char>(originalSize);
+            inflateStored(comp_ptr, compressedSize, reinterpret_cast<uint8_t*>(text), originalSize);
+            out.type = ValueType::String;
+            out.size = static_cast<uint32_t>(originalSize);
+            out.str = text;
+        } else {
+            const uint8_t* str_ptr = readNBytesPtr(strSize, offset);
+            out.setString(reinterpret_cast<const char*>(str_ptr), strSize, arena);
+        }
+        return;
+    }
+
+    if (((byte & 0xE0) >> 5) == 0x04 || ((byte & 0xE0) >> 5) == 0x05) {
+        uint64_t id = byte & 0x1F;
+        if (id == 0x1F) id = readVarNumber(offset);
+        if (followReferences) {
+            buildEntity(id, out);
+        } else {
+            out.type = ValueType::Reference;
+            out.reference = id;
+            references.push_back({&out, parentId});
+        }
+        return;
+    }
+
+    if (isTimestampAt(value)) {
+        std::string text = formatTimestamp(readTimestamp(readNBytesPtr(kTimestampSize - 1, offset)));
+        out.setString(text.data(), text.size(), arena);
+        return;
+    }
+    switch (byte & 0xF0) {
+        case 0xC0: out.type = ValueType::Integer; out.integer = byte & 0x0F; return;
+        case 0xD0: out.type = ValueType::Integer; out.integer = -int64_t(byte & 0x0F); return;
+        case 0xE0: {
+            uint64_t id = byte & 0x0F;
+            if (id == 0x0F) id = readVarNumber(offset);
+            size_t sz = customSizeMap.at(id);
+            const uint8_t* d = readNBytesPtr(sz, offset);
+            uint8_t* copy = arena.allocateArray<uint8_t>(sz);
+            std::memcpy(copy, d, sz);
+            out.type = ValueType::Custom;
+            out.aux = static_cast<uint16_t>(id);
+            out.size = static_cast<uint32_t>(sz);
+            out.bytes = copy;
+            return;
+        }
+        case 0xF0: {
+            uint8_t subType = byte & 0x0F;
+            switch (subType) {
+                case 0x0C: out.type = ValueType::Null; return;
+                case 0x0D: out.type = ValueType::Byte; out.byte = readByte(offset); return;
+                case 0x0E: out.type = ValueType::Boolean; out.boolean = false; return;
+                case 0x0F: out.type = ValueType::Boolean; out.boolean = true; return;
+            }
+
+            if (subType <= 0x07) {
+                size_t len = 1 << (subType & 0x03);
+                const uint8_t* data = readNBytesPtr(len, offset);
+                int64_t val = 0;
+                std::memcpy(&val, data, len);
+                if (subType & 0x04) val = -val;
+                out.type = ValueType::Integer;
+                out.integer = val;
+                return;
+            }
+
+            if (byte == kValueString) {
+                uint64_t id = readVarNumber(offset);
+                std::string_view str = sections.valueString(id);
+                if (str.size() <= Node::kInlineCapacity) {
+                    out.setString(str.data(), str.size(), arena);
+                    return;
+                }
+                if (valueStrings.empty()) valueStrings.resize(sections.valueStrings.size(), nullptr);
+                if (!valueStrings[id]) {
+                    char* copy = arena.allocateArray<char>(str.size());
+                    std::memcpy(copy, str.data(), str.size());
+                    valueStrings[id] = copy;
+                }
+                out.type = ValueType::String;
+                out.size = static_cast<uint32_t>(str.size());
+                out.str = valueStrings[id];
+                return;
+            }
+
+            if (byte == kSharedString) {
+                size_t storedSize = readVarNumber(offset);
+                size_t originalSize = readVarNumber(offset);
+                const uint8_t* stored = readNBytesPtr(storedSize, offset);
+                char* text = arena.allocateArray<char>(originalSize);
+                inflateStored(stored, storedSize, reinterpret_cast<uint8_t*>(text), originalSize, sections.sharedStrings);
+                out.type = ValueType::String;
+                out.size = static_cast<uint32_t>(originalSize);
+                out.str = text;
+                return;
+            }
+
+            if (subType == 0x08) {
+                const uint8_t* data = readNBytesPtr(4, offset);
+                float fval;
+                std::memcpy(&fval, data, sizeof(float));
+                out.type = ValueType::Float;
+                out.real = fval;
+                return;
+            }
+
+            if (subType == 0x09) {
+                const uint8_t* data = readNBytesPtr(8, offset);
+                double dval;
+                std::memcpy(&dval, data, sizeof(double));
+                out.type = ValueType::Float;
+                out.real = dval;
+                return;
+            }
+            throw std::runtime_error("Unhandled F0 subtype");
+        }
+    }
+    throw std::runtime_error("Unknown type byte");
+}
+
+// Fills node from a packed list element or packed column cell; timestamp text is
+// copied into arena.
+template <typename T>
+static void setPackedElement(Node& node, const T& element, Arena& arena) {
+    if constexpr (std::is_same_v<T, int64_t>) {
+        node.type = ValueType::Integer;
+        node.integer = element;
+    } else if constexpr (std::is_same_v<T, double>) {
+        node.type = ValueType::Float;
+        node.real = element;
+    } else if constexpr (std::is_same_v<T, std::string>) {
+        node.setString(element.data(), element.size(), arena);
+    } else {
+        node.type = ValueType::Boolean;
+        node.boolean = element;
+    }
+}
+
+void NodeBuilder::buildEntity(long id, Node& out) {
+    if (enterEntity) enterEntity(id);
+    size_t offset = entityTable.at(id) + baseOffset;
+    uint8_t byte = readByte(offset);
+    bool isList = (byte & 0x80) != 0;
+    uint64_t count = byte & 0x7F;
+    if (count == 0x7F) count = readVarNumber(offset);
+    if (count > UINT32_MAX) throw std::runtime_error("Entity too large for Node");
+
+    uint8_t offsetSize = readByte(offset);
+    out.size = static_cast<uint32_t>(count);
+
+    if (isList && isPacked(offsetSize)) {
+        const uint8_t* packed = readNBytesPtr(packedDataSize(offsetSize, count), offset);
+        Node* elements = arena.allocateArray<Node>(count);
+        uint64_t i = 0;
+        forEachPacked(offsetSize, packed, count, [&](auto element) {
+            setPackedElement(*new (&elements[i++]) Node(), element, arena);
+        });
+        out.type = ValueType::List;
+        out.elements = elements;
+        return;
+    }
+
+    if (isList && isColumnar(offsetSize)) {
+        ColumnarList columns(fileData + offset, fileData + fileSize, count);
+        std::vector<ColumnarColumn> parsed;
+        std::vector<uint32_t> widths(count, 0);
+        for (size_t j = 0; j < columns.keys.size(); j++) {
+            if (columns.keys[j] >= dictionarySize) throw std::runtime_error("Invalid key index");
+            parsed.push_back(columns.column(j));
+            for (uint64_t row = 0; row < count; row++) widths[row] += parsed.back().present(row);
+        }
+
+        Node* elements = arena.allocateArray<Node>(count);
+        for (uint64_t row = 0; row < count; row++) {
+            Node* record = new (&elements[row]) Node();
+            record->type = ValueType::Object;
+            record->fields = arena.allocateArray<NodeField>(widths[row]);
+            widths[row] = 0;
+        }
+
+        // Each record's fields fill up in column (that is, key) order.
+        for (size_t j = 0; j < parsed.size(); j++) {
+            const ColumnarColumn& column = parsed[j];
+            auto next = [&](uint64_t row) -> Node& {
+                NodeField* field = new (&elements[row].fields[widths[row]++]) NodeField();
+                elements[row].size = widths[row];
+                field->key = static_cast<uint32_t>(columns.keys[j]);
+                return field->value;
+            };
+            if (column.typed()) {
+                forEachPackedCell(column, count, [&](uint64_t row, auto element) { setPackedElement(next(row), element, arena); });
+                continue;
+            }
+            for (uint64_t row = 0; row < count; row++) {
+                if (!column.present(row)) continue;
+                size_t cell = column.valueAt(row) - fileData;
+                buildValue(cell, id, next(row));
+            }
+        }
+        out.type = ValueType::List;
+        out.elements = elements;
+        return;
+    }
+
+    if (!isList && isShaped(offsetSize)) {
+        const auto& keys = shapeKeys(shapes, readVarNumber(offset), count);
+        if (hasImpliedOffsets(offsetSize)) readVarNumber(offset);
+        else offset += shapedOffsetWidth(offsetSize) * count;
+        NodeField* fields = arena.allocateArray<NodeField>(count);
+        for (uint64_t i = 0; i < count; i++) {
+            new (&fields[i]) NodeField();
+            fields[i].key = static_cast<uint32_t>(keys[i]);
+            buildValue(offset, id, fields[i].value);
+        }
+        out.type = ValueType::Object;
+        out.fields = fields;
+        return;
+    }
+
+    offset += offsetSize * count;
+    if (isList) {
+        Node* elements = arena.allocateArray<Node>(count);
+        for (uint64_t i = 0; i < count; i++) {
+            new (&elements[i]) Node();
+            buildValue(offset, id, elements[i]);
+        }
+        out.type = ValueType::List;
+        out.elements = elements;
+    } else {
+        NodeField* fields = arena.allocateArray<NodeField>(count);
+        for (uint64_t i = 0; i < count; i++) {
+            new (&fields[i]) NodeField();
+            uint64_t keyIdx = readVarNumber(offset);
+            if (keyIdx >= dictionarySize) throw std::runtime_error("Invalid key index");
+            fields[i].key = static_cast<uint32_t>(keyIdx);
+            buildValue(offset, id, fields[i].value);
+        }
+        out.type = ValueType::Object;
+        out.fields = fields;
+    }
+}
+
+void NodeBuilder::buildRecord(long listId, uint64_t row, Node& out) {
+    if (enterEntity) enterEntity(listId);
+    size_t offset = entityTable.at(listId) + baseOffset;
+    uint8_t byte = readByte(offset);
+    uint64_t count = byte & 0x7F;
+    if (count == 0x7F) count = readVarNumber(offset);
+    if ((byte & 0x80) == 0 || !isColumnar(readByte(offset))) throw std::runtime_error("Not a columnar list");
+    if (row >= count) throw std::runtime_error("List index out of range");
+
+    ColumnarList columns(fileData + offset, fileData + fileSize, count);
+    std::vector<std::pair<uint64_t, ColumnarColumn>> present;
+    for (size_t j = 0; j < columns.keys.size(); j++) {
+        if (columns.keys[j] >= dictionarySize) throw std::runtime_error("Invalid key index");
+        ColumnarColumn column = columns.column(j);
+        if (column.present(row)) present.emplace_back(columns.keys[j], column);
+    }
+
+    NodeField* fields = arena.allocateArray<NodeField>(present.size());
+    for (size_t i = 0; i < present.size(); i++) {
+        new (&fields[i]) NodeField();
+        fields[i].key = static_cast<uint32_t>(present[i].first);
+        const ColumnarColumn& column = present[i].second;
+        if (column.typed()) {
+            switch (packedKind(column.type)) {
+                case kPackedInteger: setPackedElement(fields[i].value, packedInteger(column.data, packedWidth(column.type), row), arena); break;
+                case kPackedFloat: setPackedElement(fields[i].value, packedFloat(column.data, packedWidth(column.type), row), arena); break;
+                case kPackedTimestamp:
+                    setPackedElement(fields[i].value, formatTimestamp(packedTimestamp(column.data, packedWidth(column.type), row)), arena);
+                    break;
+                default: setPackedElement(fields[i].value, packedBoolean(column.data, row), arena); break;
+            }
+            continue;
+        }
+        size_t cell = column.valueAt(row) - fileData;
+        buildValue(cell, listId, fields[i].value);
+    }
+    out.type = ValueType::Object;
+    out.size = static_cast<uint32_t>(present.size());
+    out.fields = fields;
+}
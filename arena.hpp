@@ -0,0 +1,138 @@
+#pragma once
+
+#include "datastruct.hpp"
+#include "chaos_format.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+
+// Bump allocator backing a decoded NodeDocument. Memory is only released all at
+// once, when the arena is destroyed.
+class Arena {
+public:
+    explicit Arena(size_t blockSize = 1 << 20) : cursor(nullptr), limit(nullptr), blockSize(blockSize), used(0) {}
+    Arena(Arena&&) = default;
+    Arena& operator=(Arena&&) = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+    template <typename T>
+    T* allocateArray(size_t n) {
+        return static_cast<T*>(allocate(sizeof(T) * n, alignof(T)));
+    }
+
+    size_t bytesUsed() const { return used; }
+
+private:
+    std::vector<std::unique_ptr<uint8_t[]>> blocks;
+    uint8_t* cursor;
+    uint8_t* limit;
+    size_t blockSize;
+    size_t used;
+};
+
+struct NodeField;
+
+// Compact 16-byte counterpart of Value. Children and string bytes live in an Arena,
+// object keys are dictionary indices, and strings of up to kInlineCapacity bytes are
+// stored inside the node itself.
+struct Node {
+    static constexpr size_t kInlineCapacity = 12;
+
+    ValueType type = ValueType::Null;
+    uint8_t inlined = 0;
+    uint16_t aux = 0;       // inline string length, or Custom id
+    uint32_t size = 0;      // string length, element / field count, or Custom byte count
+    union {
+        int64_t integer = 0;
+        double real;
+        bool boolean;
+        uint8_t byte;
+        const char* str;
+        const uint8_t* bytes;
+        Node* elements;
+        NodeField* fields;
+        long reference;
+    };
+
+    void setString(const char* data, size_t length, Arena& arena);
+
+    std::string_view asString() const {
+        if (inlined) return std::string_view(reinterpret_cast<const char*>(this) + offsetof(Node, size), aux);
+        return std::string_view(str, size);
+    }
+};
+
+struct NodeField {
+    uint32_t key;
+    Node value;
+};
+
+static_assert(sizeof(Node) == 16, "Node must stay 16 bytes");
+
+// A decoded tree in Node form. Owns the arenas (one per decoding thread) and a copy
+// of the file's key dictionary that NodeField::key indexes into.
+struct NodeDocument {
+    std::vector<Arena> arenas;
+    std::vector<std::string> dictionary;
+    Node root;
+
+    std::string_view key(uint32_t keyIdx) const { return dictionary.at(keyIdx); }
+    const Node* find(const Node& object, std::string_view key) const;
+
+    Value toValue() const { return toValue(root); }
+    Value toValue(const Node& node) const;
+};
+
+// Builds Nodes straight from the encoded entity region of a loaded CHAOS file. Shared
+// by MMapDecoder, MMapDecoderParallel and MMapDecoderSelective. With followReferences
+// off, entity references are emitted as Reference nodes and recorded so the caller
+// can link them afterwards.
+class NodeBuilder {
+public:
+    NodeBuilder(const uint8_t* fileData, size_t fileSize, size_t baseOffset,
+                const std::vector<long>& entityTable, const ShapeList& shapes, size_t dictionarySize,
+                const IndexSections& sections, const std::unordered_map<uint8_t, size_t>& customSizeMap,
+                Arena& arena, bool followReferences)
+        : fileData(fileData), fileSize(fileSize), baseOffset(baseOffset),
+          entityTable(entityTable), shapes(shapes), dictionarySize(dictionarySize),
+          sections(sections), customSizeMap(customSizeMap), arena(arena), followReferences(followReferences) {}
+
+    void buildEntity(long id, Node& out);
+    // Builds one record of columnar list listId as an Object node.
+    void buildRecord(long listId, uint64_t row, Node& out);
+    void buildValue(size_t& offset, long parentId, Node& out);
+
+    // Reference nodes left unresolved by buildEntity, with the ID of the entity holding them.
+    std::vector<std::pair<Node*, long>> references;
+
+    // Called with an entity's ID before the entity is read, if set. Readers of
+    // block-compressed files inflate the blocks it spans here.
+    std::function<void(long)> enterEntity;
+
+private:
+    const uint8_t* fileData;
+    size_t fileSize;
+    size_t baseOffset;
+    const std::vector<long>& entityTable;
+    const ShapeList& shapes;
+    size_t dictionarySize;
+    const IndexSections& sections;
+    // Arena copies of the value strings this builder has met, by ID; a string is copied
+    // once and its nodes share the copy.
+    std::vector<const char*> valueStrings;
+    const std::unordered_map<uint8_t, size_t>& customSizeMap;
+    Arena& arena;
+    bool followReferences;
+
+    const uint8_t* readNBytesPtr(size_t n, size_t& offset);
+    uint8_t readByte(size_t& offset);
+    uint64_t readVarNumber(size_t& offset);
+};
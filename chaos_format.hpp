@@ -0,0 +1,1057 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <thread>
+#include <exception>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <lz4.h>
+
+// CHAOS files come in two layouts that share the same index encoding (entity count,
+// dictionary, offset width byte, entity offset table, shape table, optional sections):
+//
+//   v1 (Header):  varint index size | index | data
+//   v2 (Trailer): kTrailerFormatByte | data | index | index size (8 bytes LE) | kTrailerMagic
+//
+// v2 lets encoders write entities out in one pass and finish with the index. A v1
+// file starts with a varint whose first byte is below 0x80 or in 0x81..0x88, so
+// kTrailerFormatByte never starts one. Entity offsets are relative to the data region.
+// A v2 file whose data region is block-compressed starts with kBlockedFormatByte
+// instead (see BlockTable).
+enum class FileLayout { Header, Trailer };
+
+constexpr uint8_t kTrailerFormatByte = 0xC2;
+constexpr uint8_t kBlockedFormatByte = 0xC3;
+constexpr char kTrailerMagic[4] = {'C', 'H', 'S', '2'};
+constexpr size_t kTrailerDataOffset = 1;
+constexpr size_t kTrailerTailSize = sizeof(uint64_t) + sizeof(kTrailerMagic);
+
+// Returns true for a v2 file and sets indexOffset to where its index starts. For v1
+// files it returns false and leaves indexOffset alone.
+inline bool findTrailer(const uint8_t* fileData, size_t fileSize, size_t& indexOffset) {
+    if (fileSize == 0 || (fileData[0] != kTrailerFormatByte && fileData[0] != kBlockedFormatByte)) return false;
+    if (fileSize < kTrailerDataOffset + kTrailerTailSize ||
+        std::memcmp(fileData + fileSize - sizeof(kTrailerMagic), kTrailerMagic, sizeof(kTrailerMagic)) != 0) {
+        throw std::runtime_error("Invalid CHAOS trailer");
+    }
+
+    uint64_t indexSize = 0;
+    std::memcpy(&indexSize, fileData + fileSize - kTrailerTailSize, sizeof(uint64_t));
+    if (indexSize > fileSize - kTrailerDataOffset - kTrailerTailSize) {
+        throw std::runtime_error("Invalid CHAOS trailer");
+    }
+    indexOffset = fileSize - kTrailerTailSize - indexSize;
+    return true;
+}
+
+// Long strings, a dictionary of 255 bytes or more and the blocks of a block-compressed
+// region are stored LZ4-compressed, or as is when that would not shrink them (or the
+// encoder's tier is "none"); a stored size equal to the original size marks the latter.
+// Expands storedSize bytes at src into the originalSize bytes at out. Strings written
+// against the file's shared strings (see kSharedString) pass those as dictionary.
+inline void inflateStored(const uint8_t* src, size_t storedSize, uint8_t* out, size_t originalSize,
+                          std::string_view dictionary = {}) {
+    if (storedSize == originalSize) {
+        std::memcpy(out, src, originalSize);
+        return;
+    }
+    const char* in = reinterpret_cast<const char*>(src);
+    char* dst = reinterpret_cast<char*>(out);
+    int n = dictionary.empty()
+        ? LZ4_decompress_safe(in, dst, static_cast<int>(storedSize), static_cast<int>(originalSize))
+        : LZ4_decompress_safe_usingDict(in, dst, static_cast<int>(storedSize), static_cast<int>(originalSize),
+                                        dictionary.data(), static_cast<int>(dictionary.size()));
+    if (n < 0 || static_cast<size_t>(n) != originalSize) throw std::runtime_error("LZ4 decompression failed");
+}
+
+// Shared strings. An encoder may store sample text drawn from a document's strings
+// once, in the index (see IndexSections), and write any string that compresses well
+// against it as
+//
+//   kSharedString, varint stored size, varint length, LZ4 block using the shared strings
+//
+// Each such string still decompresses on its own, so values stay randomly accessible.
+// LZ4 only looks back 64 KiB, which bounds the useful size of the shared strings.
+constexpr uint8_t kSharedString = 0xFA;
+constexpr size_t kMaxSharedStrings = 64 << 10;
+
+// Value strings. String values that recur often enough are stored once, in the
+// index's value dictionary (see IndexSections), and written as
+//
+//   kValueString, varint ID
+//
+// so equal values have equal IDs. The dictionary lists its strings like the key
+// dictionary does: varint length, then the bytes, in ID order.
+constexpr uint8_t kValueString = 0xFB;
+
+// Timestamps. Strings holding an ISO-8601 date and time, "YYYY-MM-DDTHH:MM:SS" with
+// up to six fraction digits and an optional trailing "Z", are written as
+//
+//   kTimestamp, format byte, int64 microseconds since the epoch
+//
+// Every other tag byte is taken, so kTimestamp reuses the small negative integer of
+// magnitude zero, which no encoder writes (zero is 0xC0). Readers must test
+// isTimestampAt() before reading 0xD0..0xDF as small integers. The format byte records
+// the fraction digits, the "Z" and a ' ' in place of the 'T', so decoders give back
+// exactly the text that was encoded. Times carry no zone offset and are counted as
+// UTC, in the proleptic Gregorian calendar.
+constexpr uint8_t kTimestamp = 0xD0;
+constexpr uint8_t kTimestampDigits = 0x07;
+constexpr uint8_t kTimestampZulu = 0x08;
+constexpr uint8_t kTimestampSpace = 0x10;
+constexpr size_t kTimestampSize = 10;
+
+struct Timestamp {
+    int64_t micros = 0;
+    uint8_t format = 0;
+};
+
+inline unsigned timestampDigits(uint8_t format) { return std::min<unsigned>(format & kTimestampDigits, 6); }
+
+// Microseconds per step of the last fraction digit; every value of a format is a multiple.
+inline int64_t timestampUnit(uint8_t format) {
+    static constexpr int64_t units[] = {1000000, 100000, 10000, 1000, 100, 10, 1};
+    return units[timestampDigits(format)];
+}
+
+// Days from 1970-01-01 to the given date, and back.
+inline int64_t daysFromCivil(int64_t year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    unsigned yearOfEra = static_cast<unsigned>(year - era * 400);
+    unsigned dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + static_cast<int64_t>(dayOfEra) - 719468;
+}
+
+inline void civilFromDays(int64_t days, int64_t& year, unsigned& month, unsigned& day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned dayOfEra = static_cast<unsigned>(days - era * 146097);
+    unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    unsigned dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    unsigned shifted = (5 * dayOfYear + 2) / 153;
+    day = dayOfYear - (153 * shifted + 2) / 5 + 1;
+    month = shifted < 10 ? shifted + 3 : shifted - 9;
+    year = static_cast<int64_t>(yearOfEra) + era * 400 + (month <= 2);
+}
+
+// Parses str as a timestamp in the form described above. Anything else, including
+// out-of-range fields such as a 30th of February, is left a string.
+inline bool parseTimestamp(std::string_view str, Timestamp& out) {
+    if (str.size() < 19 || str.size() > 27) return false;
+    auto number = [&](size_t at, size_t length, unsigned& value) {
+        value = 0;
+        for (size_t i = at; i < at + length; ++i) {
+            if (str[i] < '0' || str[i] > '9') return false;
+            value = value * 10 + static_cast<unsigned>(str[i] - '0');
+        }
+        return true;
+    };
+    unsigned year, month, day, hour, minute, second;
+    if (!number(0, 4, year) || str[4] != '-' || !number(5, 2, month) || str[7] != '-' || !number(8, 2, day) ||
+        (str[10] != 'T' && str[10] != ' ') || !number(11, 2, hour) || str[13] != ':' || !number(14, 2, minute) ||
+        str[16] != ':' || !number(17, 2, second)) {
+        return false;
+    }
+    static constexpr unsigned monthDays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+    if (month < 1 || month > 12 || day < 1 || day > monthDays[month - 1] + (month == 2 && leap) ||
+        hour > 23 || minute > 59 || second > 59) {
+        return false;
+    }
+
+    uint8_t format = str[10] == ' ' ? kTimestampSpace : 0;
+    unsigned fraction = 0;
+    size_t at = 19;
+    if (at < str.size() && str[at] == '.') {
+        size_t digits = 0;
+        while (at + 1 + digits < str.size() && str[at + 1 + digits] >= '0' && str[at + 1 + digits] <= '9') digits++;
+        if (digits == 0 || digits > 6) return false;
+        number(at + 1, digits, fraction);
+        for (size_t i = digits; i < 6; ++i) fraction *= 10;
+        format |= static_cast<uint8_t>(digits);
+        at += 1 + digits;
+    }
+    if (at < str.size() && str[at] == 'Z') {
+        format |= kTimestampZulu;
+        at++;
+    }
+    if (at != str.size()) return false;
+
+    int64_t seconds = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    out.micros = seconds * 1000000 + fraction;
+    out.format = format;
+    return true;
+}
+
+// The text t was parsed from.
+inline std::string formatTimestamp(const Timestamp& t) {
+    int64_t days = t.micros / 86400000000;
+    int64_t micros = t.micros % 86400000000;
+    if (micros < 0) {
+        days--;
+        micros += 86400000000;
+    }
+    int64_t year;
+    unsigned month, day;
+    civilFromDays(days, year, month, day);
+
+    char text[32];
+    char* p = text;
+    auto put = [&](int64_t value, int width) {
+        for (int i = width - 1; i >= 0; --i, value /= 10) p[i] = static_cast<char>('0' + value % 10);
+        p += width;
+    };
+    if (year < 0 || year > 9999) throw std::runtime_error("Invalid timestamp");
+    put(year, 4);
+    *p++ = '-';
+    put(month, 2);
+    *p++ = '-';
+    put(day, 2);
+    *p++ = (t.format & kTimestampSpace) ? ' ' : 'T';
+    put(micros / 3600000000, 2);
+    *p++ = ':';
+    put(micros / 60000000 % 60, 2);
+    *p++ = ':';
+    put(micros / 1000000 % 60, 2);
+    if (unsigned digits = timestampDigits(t.format)) {
+        *p++ = '.';
+        put(micros % 1000000 / timestampUnit(t.format), static_cast<int>(digits));
+    }
+    if (t.format & kTimestampZulu) *p++ = 'Z';
+    return std::string(text, p);
+}
+
+// Appends str as a timestamp value and returns true if it is one.
+inline bool encodeTimestamp(std::string_view str, std::vector<uint8_t>& out) {
+    Timestamp t;
+    if (!parseTimestamp(str, t)) return false;
+    out.push_back(kTimestamp);
+    out.push_back(t.format);
+    const uint8_t* micros = reinterpret_cast<const uint8_t*>(&t.micros);
+    out.insert(out.end(), micros, micros + sizeof(int64_t));
+    return true;
+}
+
+// Whether the encoded value starting at value is a timestamp.
+inline bool isTimestampAt(const uint8_t* value) { return value[0] == kTimestamp; }
+
+// p points at the format byte that follows kTimestamp.
+inline Timestamp readTimestamp(const uint8_t* p) {
+    Timestamp t;
+    t.format = p[0];
+    std::memcpy(&t.micros, p + 1, sizeof(int64_t));
+    return t;
+}
+
+// Packed lists. A list whose elements are all integers, all floats, all booleans or
+// all timestamps of one format can be written without an offset table: the byte that
+// otherwise holds the offset width is kPackedFlag | kind | width, followed by count
+// fixed-width little-endian elements. Integers are two's complement of width 1, 2, 4
+// or 8; floats are float32 or float64; booleans take one bit each, lowest bit first.
+// Timestamps start with their format byte and the smallest of them as an int64 base;
+// each element is then its distance from the base, in units of the format's last
+// fraction digit, as an unsigned integer of width 1 to 8. Offset widths never exceed
+// 8, so the flag cannot clash with an ordinary list.
+constexpr uint8_t kPackedFlag = 0x80;
+constexpr uint8_t kPackedInteger = 0x00;
+constexpr uint8_t kPackedFloat = 0x10;
+constexpr uint8_t kPackedBoolean = 0x20;
+constexpr uint8_t kPackedTimestamp = 0x30;
+constexpr size_t kPackedTimestampHeader = 1 + sizeof(int64_t);
+
+// Columnar lists (below) also set kPackedFlag, with a kind no packed list uses.
+constexpr uint8_t kColumnarTag = 0xB0;
+
+inline bool isPacked(uint8_t offsetByte) { return (offsetByte & kPackedFlag) != 0 && offsetByte != kColumnarTag; }
+inline bool isColumnar(uint8_t offsetByte) { return offsetByte == kColumnarTag; }
+inline uint8_t packedKind(uint8_t tag) { return tag & 0x70; }
+inline uint8_t packedWidth(uint8_t tag) { return tag & 0x0F; }
+
+// Bytes taken by count elements, validating the tag on the way.
+inline size_t packedDataSize(uint8_t tag, uint64_t count) {
+    uint8_t width = packedWidth(tag);
+    switch (packedKind(tag)) {
+        case kPackedInteger:
+            if (width == 1 || width == 2 || width == 4 || width == 8) return count * width;
+            break;
+        case kPackedFloat:
+            if (width == 4 || width == 8) return count * width;
+            break;
+        case kPackedBoolean:
+            return (count + 7) / 8;
+        case kPackedTimestamp:
+            if (width >= 1 && width <= 8) return kPackedTimestampHeader + count * width;
+            break;
+    }
+    throw std::runtime_error("Invalid packed list tag");
+}
+
+inline int64_t packedInteger(const uint8_t* data, uint8_t width, uint64_t i) {
+    switch (width) {
+        case 1: { int8_t v; std::memcpy(&v, data + i, 1); return v; }
+        case 2: { int16_t v; std::memcpy(&v, data + i * 2, 2); return v; }
+        case 4: { int32_t v; std::memcpy(&v, data + i * 4, 4); return v; }
+    }
+    int64_t v;
+    std::memcpy(&v, data + i * 8, 8);
+    return v;
+}
+
+inline double packedFloat(const uint8_t* data, uint8_t width, uint64_t i) {
+    if (width == 4) {
+        float v;
+        std::memcpy(&v, data + i * 4, 4);
+        return v;
+    }
+    double v;
+    std::memcpy(&v, data + i * 8, 8);
+    return v;
+}
+
+inline bool packedBoolean(const uint8_t* data, uint64_t i) {
+    return (data[i >> 3] >> (i & 7)) & 1;
+}
+
+inline Timestamp packedTimestamp(const uint8_t* data, uint8_t width, uint64_t i) {
+    Timestamp t;
+    t.format = data[0];
+    std::memcpy(&t.micros, data + 1, sizeof(int64_t));
+    uint64_t offset = 0;
+    std::memcpy(&offset, data + kPackedTimestampHeader + i * width, width);
+    t.micros += static_cast<int64_t>(offset) * timestampUnit(t.format);
+    return t;
+}
+
+// Whole-array conversions for decoders that materialize every element. Same-width
+// elements are a single memcpy; narrower ones widen in a loop the compiler vectorizes.
+template <typename Narrow, typename Wide>
+inline void widenPacked(const uint8_t* data, uint64_t count, Wide* out) {
+    if (sizeof(Narrow) == sizeof(Wide)) {
+        std::memcpy(out, data, count * sizeof(Wide));
+        return;
+    }
+    const Narrow* in = reinterpret_cast<const Narrow*>(data);
+    for (uint64_t i = 0; i < count; ++i) out[i] = static_cast<Wide>(in[i]);
+}
+
+inline void unpackIntegers(const uint8_t* data, uint8_t width, uint64_t count, int64_t* out) {
+    switch (width) {
+        case 1: return widenPacked<int8_t>(data, count, out);
+        case 2: return widenPacked<int16_t>(data, count, out);
+        case 4: return widenPacked<int32_t>(data, count, out);
+        default: return widenPacked<int64_t>(data, count, out);
+    }
+}
+
+inline void unpackFloats(const uint8_t* data, uint8_t width, uint64_t count, double* out) {
+    if (width == 4) return widenPacked<float>(data, count, out);
+    widenPacked<double>(data, count, out);
+}
+
+// Calls f with every element of a packed list, as int64_t, double or bool, or for
+// timestamps as the std::string they were encoded from.
+template <typename F>
+inline void forEachPacked(uint8_t tag, const uint8_t* data, uint64_t count, F&& f) {
+    uint8_t width = packedWidth(tag);
+    switch (packedKind(tag)) {
+        case kPackedInteger:
+            for (uint64_t i = 0; i < count; ++i) f(packedInteger(data, width, i));
+            break;
+        case kPackedFloat:
+            for (uint64_t i = 0; i < count; ++i) f(packedFloat(data, width, i));
+            break;
+        case kPackedTimestamp:
+            for (uint64_t i = 0; i < count; ++i) f(formatTimestamp(packedTimestamp(data, width, i)));
+            break;
+        default:
+            for (uint64_t i = 0; i < count; ++i) f(packedBoolean(data, i));
+            break;
+    }
+}
+
+// Encoder side: looks at a list's encoded elements (data, split at offsets) and, if
+// every one is an integer, every one a float, every one a boolean or every one a
+// timestamp of the same format, produces the packed tag and element bytes. Floats
+// stay float32 unless one of them was written as a double. Integer and timestamp
+// lists are only packed when that is smaller than unpackedSize, the bytes the offset
+// table and element data take.
+inline bool packList(const std::vector<long>& offsets, const std::vector<uint8_t>& data, size_t unpackedSize,
+                     uint8_t& tag, std::vector<uint8_t>& out) {
+    size_t count = offsets.size();
+    if (count == 0) return false;
+
+    uint8_t first = data[offsets[0]];
+    uint8_t kind = first >= 0xFE ? kPackedBoolean : (first == 0xF8 || first == 0xF9) ? kPackedFloat
+                 : isTimestampAt(data.data() + offsets[0]) ? kPackedTimestamp : kPackedInteger;
+    uint8_t format = kind == kPackedTimestamp ? data[offsets[0] + 1] : 0;
+    std::vector<int64_t> integers;
+    std::vector<double> floats;
+    bool narrow = true;
+    out.clear();
+    if (kind == kPackedBoolean) out.assign((count + 7) / 8, 0);
+
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* p = data.data() + offsets[i];
+        uint8_t byte = *p;
+        if (kind == kPackedInteger) {
+            int64_t v;
+            if (isTimestampAt(p)) return false;
+            if ((byte & 0xF0) == 0xC0) v = byte & 0x0F;
+            else if ((byte & 0xF0) == 0xD0) v = -int64_t(byte & 0x0F);
+            else if (byte >= 0xF0 && byte <= 0xF7) {
+                uint64_t magnitude = 0;
+                std::memcpy(&magnitude, p + 1, size_t(1) << (byte & 0x03));
+                v = (byte & 0x04) ? -int64_t(magnitude) : int64_t(magnitude);
+            } else {
+                return false;
+            }
+            integers.push_back(v);
+        } else if (kind == kPackedFloat) {
+            if (byte == 0xF8) {
+                float f;
+                std::memcpy(&f, p + 1, 4);
+                floats.push_back(f);
+            } else if (byte == 0xF9) {
+                double d;
+                std::memcpy(&d, p + 1, 8);
+                floats.push_back(d);
+                narrow = false;
+            } else {
+                return false;
+            }
+        } else if (kind == kPackedTimestamp) {
+            if (!isTimestampAt(p) || p[1] != format) return false;
+            integers.push_back(readTimestamp(p + 1).micros);
+        } else {
+            if (byte < 0xFE) return false;
+            if (byte == 0xFF) out[i >> 3] |= uint8_t(1) << (i & 7);
+        }
+    }
+
+    if (kind == kPackedBoolean) {
+        tag = kPackedFlag | kPackedBoolean;
+        return true;
+    }
+    if (kind == kPackedFloat) {
+        uint8_t width = narrow ? 4 : 8;
+        tag = kPackedFlag | kPackedFloat | width;
+        out.resize(count * width);
+        for (size_t i = 0; i < count; ++i) {
+            if (narrow) {
+                float f = static_cast<float>(floats[i]);
+                std::memcpy(out.data() + i * 4, &f, 4);
+            } else {
+                std::memcpy(out.data() + i * 8, &floats[i], 8);
+            }
+        }
+        return true;
+    }
+
+    auto [low, high] = std::minmax_element(integers.begin(), integers.end());
+    if (kind == kPackedTimestamp) {
+        int64_t base = *low;
+        int64_t unit = timestampUnit(format);
+        uint64_t span = static_cast<uint64_t>(*high - base) / unit;
+        uint8_t width = 1;
+        while (width < 8 && (span >> (8 * width)) != 0) width++;
+        if (kPackedTimestampHeader + count * width >= unpackedSize) return false;
+        tag = kPackedFlag | kPackedTimestamp | width;
+        out.resize(kPackedTimestampHeader + count * width);
+        out[0] = format;
+        std::memcpy(out.data() + 1, &base, sizeof(int64_t));
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t offset = static_cast<uint64_t>(integers[i] - base) / unit;
+            std::memcpy(out.data() + kPackedTimestampHeader + i * width, &offset, width);
+        }
+        return true;
+    }
+
+    uint8_t width = 8;
+    if (*low >= INT8_MIN && *high <= INT8_MAX) width = 1;
+    else if (*low >= INT16_MIN && *high <= INT16_MAX) width = 2;
+    else if (*low >= INT32_MIN && *high <= INT32_MAX) width = 4;
+    if (count * width >= unpackedSize) return false;
+    tag = kPackedFlag | kPackedInteger | width;
+    out.resize(count * width);
+    for (size_t i = 0; i < count; ++i) std::memcpy(out.data() + i * width, &integers[i], width);
+    return true;
+}
+
+// Object shapes. The key list of every non-empty object is stored once, in a shape
+// table that follows the entity offset table in the index:
+//
+//   varint shape count, then per shape: varint field count, that many key IDs
+//
+// An object then keeps its usual count prefix but holds only its values:
+//
+//   kShapedFlag | offset width,    varint shape ID, offset table, values
+//   kShapedFlag | kImpliedOffsets, varint shape ID, varint stride, values
+//
+// Field i has key shapes[shape][i]. The second form is used when every value takes
+// the same number of bytes, so value i starts at i * stride. Files written before
+// shapes existed end their index at the entity offset table.
+constexpr uint8_t kShapedFlag = 0x80;
+constexpr uint8_t kImpliedOffsets = 0x40;
+
+using ShapeList = std::vector<std::vector<uint64_t>>;
+
+inline bool isShaped(uint8_t offsetByte) { return (offsetByte & kShapedFlag) != 0; }
+inline bool hasImpliedOffsets(uint8_t offsetByte) { return (offsetByte & kImpliedOffsets) != 0; }
+inline uint8_t shapedOffsetWidth(uint8_t offsetByte) { return offsetByte & 0x0F; }
+
+// Key IDs of a shaped object, checked against the object's own field count.
+inline const std::vector<uint64_t>& shapeKeys(const ShapeList& shapes, uint64_t shapeId, uint64_t count) {
+    if (shapeId >= shapes.size() || shapes[shapeId].size() != count) throw std::runtime_error("Invalid shape index");
+    return shapes[shapeId];
+}
+
+inline void appendVarint(uint64_t number, std::vector<uint8_t>& out) {
+    if (number < 128) {
+        out.push_back(static_cast<uint8_t>(number));
+        return;
+    }
+    uint8_t bytes = 0;
+    for (uint64_t n = number; n > 0; n >>= 8) bytes++;
+    out.push_back(0x80 | bytes);
+    for (uint8_t i = 0; i < bytes; ++i) out.push_back(static_cast<uint8_t>(number >> (i * 8)));
+}
+
+inline uint64_t readVarint(const uint8_t*& p, const uint8_t* end) {
+    if (p >= end) throw std::runtime_error("EOF: Attempted to read past end of file.");
+    uint8_t sizeByte = *p++;
+    if (sizeByte < 128) return sizeByte;
+    size_t len = sizeByte & 0x7F;
+    if (static_cast<size_t>(end - p) < len) throw std::runtime_error("EOF: Attempted to read past end of file.");
+    uint64_t result = 0;
+    std::memcpy(&result, p, len > sizeof(uint64_t) ? sizeof(uint64_t) : len);
+    p += len;
+    return result;
+}
+
+// Parses the shape table at p, leaving p just past it; empty for files without one.
+inline ShapeList readShapeTable(const uint8_t*& p, const uint8_t* end, size_t dictionarySize) {
+    ShapeList shapes;
+    if (p >= end) return shapes;
+    uint64_t count = readVarint(p, end);
+    if (count > static_cast<uint64_t>(end - p)) throw std::runtime_error("Invalid shape table");
+    shapes.resize(count);
+    for (auto& shape : shapes) {
+        uint64_t fields = readVarint(p, end);
+        if (fields > static_cast<uint64_t>(end - p)) throw std::runtime_error("Invalid shape table");
+        shape.resize(fields);
+        for (auto& key : shape) {
+            key = readVarint(p, end);
+            if (key >= dictionarySize) throw std::runtime_error("Invalid key index");
+        }
+    }
+    return shapes;
+}
+
+// Sections an index may close with, after its shape table. Each is a section tag and
+// a payload in stored form (varint stored size, varint size, stored bytes); readers
+// skip tags they do not know, and files without a section decode as before.
+constexpr uint8_t kSharedStringsSection = 0x01;
+constexpr uint8_t kValueStringsSection = 0x02;
+
+struct IndexSections {
+    std::string sharedStrings;
+    // The value dictionary as stored, and a view of each string by ID.
+    std::string valueStringData;
+    std::vector<std::string_view> valueStrings;
+
+    // The views point into valueStringData, so sections stay where they were read.
+    IndexSections() = default;
+    IndexSections(const IndexSections&) = delete;
+    IndexSections& operator=(const IndexSections&) = delete;
+
+    std::string_view valueString(uint64_t id) const {
+        if (id >= valueStrings.size()) throw std::runtime_error("Invalid value string index");
+        return valueStrings[id];
+    }
+
+    // Parses the sections at p, up to the end of the index.
+    void read(const uint8_t* p, const uint8_t* end) {
+        while (p < end) {
+            uint8_t tag = *p++;
+            uint64_t storedSize = readVarint(p, end);
+            uint64_t size = readVarint(p, end);
+            if (storedSize > static_cast<uint64_t>(end - p) || storedSize > size) throw std::runtime_error("Invalid index section");
+            if (tag == kSharedStringsSection) {
+                if (size > kMaxSharedStrings) throw std::runtime_error("Invalid shared strings");
+                sharedStrings.resize(size);
+                inflateStored(p, storedSize, reinterpret_cast<uint8_t*>(sharedStrings.data()), size);
+            } else if (tag == kValueStringsSection) {
+                valueStringData.resize(size);
+                inflateStored(p, storedSize, reinterpret_cast<uint8_t*>(valueStringData.data()), size);
+                splitValueStrings();
+            }
+            p += storedSize;
+        }
+    }
+
+private:
+    void splitValueStrings() {
+        valueStrings.clear();
+        const uint8_t* q = reinterpret_cast<const uint8_t*>(valueStringData.data());
+        const uint8_t* end = q + valueStringData.size();
+        while (q < end) {
+            uint64_t length = readVarint(q, end);
+            if (length > static_cast<uint64_t>(end - q)) throw std::runtime_error("Invalid value dictionary");
+            valueStrings.emplace_back(reinterpret_cast<const char*>(q), length);
+            q += length;
+        }
+    }
+};
+
+// Encoder side of object shapes: interns key lists and writes objects in shaped form.
+class ShapeTable {
+public:
+    // Takes an object's encoded fields (key varint then value, starting at each of
+    // offsets within data) and appends everything after the count prefix in shaped form.
+    void writeObject(const std::vector<long>& offsets, const uint8_t* data, size_t dataSize, std::vector<uint8_t>& out) {
+        size_t count = offsets.size();
+        keyBytes.clear();
+        valueBegin.resize(count);
+        valueEnd.resize(count);
+        size_t valuesSize = 0;
+        bool sameWidth = true;
+        for (size_t i = 0; i < count; ++i) {
+            const uint8_t* p = data + offsets[i];
+            const uint8_t* end = data + (i + 1 < count ? offsets[i + 1] : dataSize);
+            readVarint(p, end);
+            keyBytes.append(reinterpret_cast<const char*>(data + offsets[i]), p - (data + offsets[i]));
+            valueBegin[i] = p - data;
+            valueEnd[i] = end - data;
+            valuesSize += valueEnd[i] - valueBegin[i];
+            sameWidth = sameWidth && valueEnd[i] - valueBegin[i] == valueEnd[0] - valueBegin[0];
+        }
+
+        auto [it, added] = ids.try_emplace(keyBytes, shapes.size());
+        if (added) {
+            shapes.emplace_back();
+            const uint8_t* p = reinterpret_cast<const uint8_t*>(keyBytes.data());
+            const uint8_t* end = p + keyBytes.size();
+            while (p < end) shapes.back().push_back(readVarint(p, end));
+        }
+
+        if (sameWidth) {
+            out.push_back(kShapedFlag | kImpliedOffsets);
+            appendVarint(it->second, out);
+            appendVarint(count ? valueEnd[0] - valueBegin[0] : 0, out);
+        } else {
+            uint8_t width = valuesSize <= UINT8_MAX ? 1 : valuesSize <= UINT16_MAX ? 2 : valuesSize <= UINT32_MAX ? 4 : 8;
+            out.push_back(kShapedFlag | width);
+            appendVarint(it->second, out);
+            uint64_t offset = 0;
+            for (size_t i = 0; i < count; ++i) {
+                for (uint8_t b = 0; b < width; ++b) out.push_back(static_cast<uint8_t>(offset >> (b * 8)));
+                offset += valueEnd[i] - valueBegin[i];
+            }
+        }
+        for (size_t i = 0; i < count; ++i) out.insert(out.end(), data + valueBegin[i], data + valueEnd[i]);
+    }
+
+    void writeTable(std::vector<uint8_t>& out) const {
+        appendVarint(shapes.size(), out);
+        for (const auto& shape : shapes) {
+            appendVarint(shape.size(), out);
+            for (uint64_t key : shape) appendVarint(key, out);
+        }
+    }
+
+    void clear() {
+        ids.clear();
+        shapes.clear();
+    }
+
+private:
+    std::unordered_map<std::string, uint64_t> ids;  // keyed by the key varints, back to back
+    ShapeList shapes;
+    std::string keyBytes;
+    std::vector<size_t> valueBegin;
+    std::vector<size_t> valueEnd;
+};
+
+// Columnar lists. A list of objects that mostly share one shape can be stored column
+// by column instead of one entity per record. The tag byte is kColumnarTag, then
+//
+//   varint column count, that many key IDs in key order, column offset width byte,
+//   one offset per column (from the end of the offset table), the columns
+//
+// and each column is
+//
+//   presence: 0 when every row has the field, else 1 and a bitmap of one bit per row
+//   a packed tag and one fixed-width value per row, laid out as in a packed list, or
+//   kColumnValues, offset width byte, one offset per row, encoded values back to back
+//
+// Rows without the field hold a zero, false or empty placeholder, or in a timestamp
+// column the first row's timestamp. Records are not entities of their own; lists and
+// objects inside them are ordinary references.
+constexpr uint8_t kColumnValues = 0x01;
+
+struct ColumnarColumn {
+    const uint8_t* presence = nullptr;  // null when every row has the field
+    uint8_t type = 0;                   // packed tag, or kColumnValues
+    uint8_t offsetWidth = 0;
+    const uint8_t* data = nullptr;      // packed values, or the row offset table
+    const uint8_t* values = nullptr;
+
+    bool typed() const { return type != kColumnValues; }
+    bool present(uint64_t row) const { return !presence || packedBoolean(presence, row); }
+
+    // Start of row's encoded value in a kColumnValues column.
+    const uint8_t* valueAt(uint64_t row) const {
+        uint64_t offset = 0;
+        std::memcpy(&offset, data + row * offsetWidth, offsetWidth);
+        return values + offset;
+    }
+};
+
+// Calls f(row, element) for every row of a packed column that has the field, the
+// element being an int64_t, double, bool or timestamp text as in forEachPacked.
+template <typename F>
+inline void forEachPackedCell(const ColumnarColumn& column, uint64_t rows, F&& f) {
+    uint64_t row = 0;
+    forEachPacked(column.type, column.data, rows, [&](auto element) {
+        if (column.present(row)) f(row, element);
+        row++;
+    });
+}
+
+// Parsed header of a columnar list; p points just past its tag, end bounds the reads.
+class ColumnarList {
+public:
+    ColumnarList() = default;
+
+    ColumnarList(const uint8_t* p, const uint8_t* end, uint64_t rows) : rows(rows), end(end) {
+        uint64_t count = readVarint(p, end);
+        if (count > static_cast<uint64_t>(end - p)) throw std::runtime_error("Invalid columnar list");
+        keys.resize(count);
+        for (auto& key : keys) key = readVarint(p, end);
+        if (p >= end) throw std::runtime_error("EOF: Attempted to read past end of file.");
+        offsetWidth = *p++;
+        if (offsetWidth == 0 || offsetWidth > 8 || count * offsetWidth > static_cast<uint64_t>(end - p)) {
+            throw std::runtime_error("Invalid columnar list");
+        }
+        offsets = p;
+        region = p + count * offsetWidth;
+    }
+
+    uint64_t rows = 0;
+    std::vector<uint64_t> keys;
+
+    ColumnarColumn column(size_t j) const {
+        uint64_t offset = 0;
+        std::memcpy(&offset, offsets + j * offsetWidth, offsetWidth);
+        if (offset >= static_cast<uint64_t>(end - region)) throw std::runtime_error("EOF: Attempted to read past end of file.");
+        return readColumn(region + offset, end, rows);
+    }
+
+    // Parses the column starting at p.
+    static ColumnarColumn readColumn(const uint8_t* p, const uint8_t* end, uint64_t rows) {
+        ColumnarColumn c;
+        size_t bitmapSize = (rows + 7) / 8;
+        if (p >= end) throw std::runtime_error("EOF: Attempted to read past end of file.");
+        if (*p++ != 0) {
+            if (bitmapSize > static_cast<size_t>(end - p)) throw std::runtime_error("EOF: Attempted to read past end of file.");
+            c.presence = p;
+            p += bitmapSize;
+        }
+        if (p >= end) throw std::runtime_error("EOF: Attempted to read past end of file.");
+        c.type = *p++;
+        if (c.typed()) {
+            if (!isPacked(c.type) || packedDataSize(c.type, rows) > static_cast<size_t>(end - p)) {
+                throw std::runtime_error("Invalid columnar list");
+            }
+            c.data = p;
+            return c;
+        }
+        if (p >= end) throw std::runtime_error("EOF: Attempted to read past end of file.");
+        c.offsetWidth = *p++;
+        if (c.offsetWidth == 0 || c.offsetWidth > 8 || rows * c.offsetWidth > static_cast<uint64_t>(end - p)) {
+            throw std::runtime_error("Invalid columnar list");
+        }
+        c.data = p;
+        c.values = p + rows * c.offsetWidth;
+        return c;
+    }
+
+    // Allocation-free walk for readers that do not keep a parsed header: calls
+    // f(key, column) for each column in key order until f returns false.
+    template <typename F>
+    static void forEachColumn(const uint8_t* p, const uint8_t* end, uint64_t rows, F&& f) {
+        uint64_t count = readVarint(p, end);
+        const uint8_t* keyBytes = p;
+        for (uint64_t j = 0; j < count; ++j) readVarint(p, end);
+        if (p >= end) throw std::runtime_error("EOF: Attempted to read past end of file.");
+        uint8_t width = *p++;
+        if (width == 0 || width > 8 || count * width > static_cast<uint64_t>(end - p)) {
+            throw std::runtime_error("Invalid columnar list");
+        }
+        const uint8_t* columns = p + count * width;
+        for (uint64_t j = 0; j < count; ++j) {
+            uint64_t key = readVarint(keyBytes, end);
+            uint64_t offset = 0;
+            std::memcpy(&offset, p + j * width, width);
+            if (offset >= static_cast<uint64_t>(end - columns)) throw std::runtime_error("EOF: Attempted to read past end of file.");
+            if (!f(key, readColumn(columns + offset, end, rows))) return;
+        }
+    }
+
+private:
+    const uint8_t* end = nullptr;
+    uint8_t offsetWidth = 0;
+    const uint8_t* offsets = nullptr;
+    const uint8_t* region = nullptr;
+};
+
+// Block-compressed data regions. The uncompressed region is cut into blockSize-byte
+// blocks (the last one may be shorter), each compressed on its own (see inflateStored)
+// and stored back to back. The index of such a file opens with the block table:
+// varint blockSize, varint uncompressed region size, an offset width byte, then the
+// end of each stored block relative to the data region. Entity offsets keep counting
+// uncompressed bytes, so a reader that inflates block i to i * blockSize can use them
+// unchanged.
+constexpr size_t kDefaultBlockSize = 64 << 10;
+
+struct BlockTable {
+    size_t blockSize = 0;
+    size_t dataSize = 0;
+    std::vector<uint64_t> ends;
+
+    size_t count() const { return ends.size(); }
+    size_t rawSize(size_t block) const { return std::min(blockSize, dataSize - block * blockSize); }
+    uint64_t storedBegin(size_t block) const { return block ? ends[block - 1] : 0; }
+
+    void write(std::vector<uint8_t>& out) const {
+        appendVarint(blockSize, out);
+        appendVarint(dataSize, out);
+        uint8_t width = 1;
+        while (width < 8 && (ends.empty() ? 0 : ends.back()) >> (width * 8)) width++;
+        out.push_back(width);
+        for (uint64_t end : ends) {
+            for (uint8_t i = 0; i < width; ++i) out.push_back(static_cast<uint8_t>(end >> (i * 8)));
+        }
+    }
+
+    // Parses the table at p, checking it against a stored region of regionSize bytes.
+    static BlockTable read(const uint8_t*& p, const uint8_t* end, size_t regionSize) {
+        BlockTable table;
+        table.blockSize = readVarint(p, end);
+        table.dataSize = readVarint(p, end);
+        if (p >= end) throw std::runtime_error("EOF: Attempted to read past end of file.");
+        uint8_t width = *p++;
+        if (table.blockSize == 0 || width == 0 || width > 8) throw std::runtime_error("Invalid block table");
+        size_t count = (table.dataSize + table.blockSize - 1) / table.blockSize;
+        if (count > static_cast<size_t>(end - p) / width) throw std::runtime_error("Invalid block table");
+        table.ends.resize(count);
+        for (size_t i = 0; i < count; ++i, p += width) {
+            std::memcpy(&table.ends[i], p, width);
+            if (table.ends[i] < table.storedBegin(i) || table.ends[i] > regionSize) throw std::runtime_error("Invalid block table");
+        }
+        return table;
+    }
+
+    // Decompresses block i of region to out, which has room for rawSize(i) bytes.
+    void inflate(const uint8_t* region, size_t block, uint8_t* out) const {
+        inflateStored(region + storedBegin(block), ends[block] - storedBegin(block), out, rawSize(block));
+    }
+
+    // Decompresses blocks [first, last) into image, block i at i * blockSize, split
+    // over up to threads workers (0 = every hardware thread).
+    void inflate(const uint8_t* region, size_t first, size_t last, uint8_t* image, unsigned threads = 0) const {
+        static constexpr size_t kMinBlocksPerThread = 8;
+        size_t workers = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        workers = std::max<size_t>(1, std::min(workers, (last - first) / kMinBlocksPerThread));
+
+        std::vector<std::exception_ptr> errors(workers);
+        auto run = [&](size_t w) {
+            try {
+                size_t from = first + (last - first) * w / workers;
+                size_t to = first + (last - first) * (w + 1) / workers;
+                for (size_t i = from; i < to; ++i) inflate(region, i, image + i * blockSize);
+            } catch (...) {
+                errors[w] = std::current_exception();
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t w = 1; w < workers; ++w) pool.emplace_back(run, w);
+        run(0);
+        for (auto& t : pool) t.join();
+        for (auto& error : errors) {
+            if (error) std::rethrow_exception(error);
+        }
+    }
+};
+
+// Decompressed blocks of a block-compressed file, private to one reader. Blocks are
+// inflated into a sparse anonymous mapping at their uncompressed offsets, so entity
+// offsets index it directly and an entity that straddles blocks stays contiguous.
+// Blocks never touched take no memory; trim() releases the least recently used ones
+// beyond the capacity, and is only called between queries, so pointers taken during
+// a query stay valid until it ends.
+class BlockCache {
+public:
+    static constexpr size_t kDefaultCapacity = 32 << 20;
+
+    BlockCache() = default;
+    BlockCache(BlockCache&& other) noexcept { *this = std::move(other); }
+    BlockCache& operator=(BlockCache&& other) noexcept {
+        std::swap(table, other.table);
+        std::swap(region, other.region);
+        std::swap(image, other.image);
+        std::swap(stamps, other.stamps);
+        std::swap(clock, other.clock);
+        std::swap(resident, other.resident);
+        std::swap(capacity, other.capacity);
+        return *this;
+    }
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    ~BlockCache() {
+        if (image) munmap(image, table->dataSize);
+    }
+
+    // Serves the blocks of blockTable stored at blockRegion; a null table stands for a
+    // file that is not block-compressed.
+    void attach(const BlockTable* blockTable, const uint8_t* blockRegion) {
+        if (image) munmap(image, table->dataSize);
+        image = nullptr;
+        table = blockTable;
+        region = blockRegion;
+        stamps.assign(table ? table->count() : 0, 0);
+        resident = 0;
+        if (!table || table->dataSize == 0) return;
+        void* mapped = mmap(nullptr, table->dataSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mapped == MAP_FAILED) throw std::runtime_error("mmap failed");
+        image = static_cast<uint8_t*>(mapped);
+    }
+
+    const uint8_t* data() const { return image; }
+
+    // Bytes of decompressed blocks kept between queries.
+    void setCapacity(size_t bytes) { capacity = bytes; }
+
+    // Makes the uncompressed bytes [begin, end) readable.
+    void ensure(size_t begin, size_t end) {
+        const BlockTable& blocks = *table;
+        if (begin >= end) return;
+        for (size_t i = begin / blocks.blockSize, last = (end - 1) / blocks.blockSize; i <= last; ++i) {
+            if (!stamps[i]) {
+                blocks.inflate(region, i, image + i * blocks.blockSize);
+                resident++;
+            }
+            stamps[i] = clock;
+        }
+    }
+
+    // Makes the whole region readable, inflating the missing blocks in parallel.
+    void ensureAll() {
+        const BlockTable& blocks = *table;
+        for (size_t i = 0; i < blocks.count();) {
+            if (stamps[i]) {
+                stamps[i++] = clock;
+                continue;
+            }
+            size_t run = i;
+            while (run < blocks.count() && !stamps[run]) stamps[run++] = clock;
+            blocks.inflate(region, i, run, image);
+            resident += run - i;
+            i = run;
+        }
+    }
+
+    // Ends the current query: drops the least recently used blocks past the capacity.
+    void trim() {
+        clock++;
+        if (!image) return;
+        const BlockTable& blocks = *table;
+        if (resident * blocks.blockSize <= capacity) return;
+
+        std::vector<std::pair<uint64_t, size_t>> used;
+        for (size_t i = 0; i < stamps.size(); ++i) {
+            if (stamps[i]) used.push_back({stamps[i], i});
+        }
+        size_t keep = capacity / blocks.blockSize;
+        std::nth_element(used.begin(), used.begin() + (used.size() - keep), used.end());
+        for (size_t k = 0; k < used.size() - keep; ++k) stamps[used[k].second] = 0;
+
+        // Only whole pages can be handed back. When blocks are not page-aligned, a page
+        // the block shares with a block still inflated stays mapped.
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        auto inflated = [&](size_t from, size_t to) {
+            for (size_t i = from; i < to; ++i) {
+                if (stamps[i]) return true;
+            }
+            return false;
+        };
+        for (size_t k = 0; k < used.size() - keep; ++k) {
+            size_t i = used[k].second;
+            size_t first = i * blocks.blockSize;
+            size_t last = first + blocks.rawSize(i);
+            size_t begin = first / page * page;
+            size_t end = (last + page - 1) / page * page;
+            if (inflated(begin / blocks.blockSize, i)) begin = (first + page - 1) / page * page;
+            if (inflated(i + 1, std::min(blocks.count(), (end + blocks.blockSize - 1) / blocks.blockSize))) {
+                end = last / page * page;
+            }
+            if (begin < end) madvise(image + begin, end - begin, MADV_DONTNEED);
+        }
+        resident = keep;
+    }
+
+private:
+    const BlockTable* table = nullptr;
+    const uint8_t* region = nullptr;
+    uint8_t* image = nullptr;
+    // Query clock at each block's last use; 0 while the block is not inflated.
+    std::vector<uint64_t> stamps;
+    uint64_t clock = 1;
+    size_t resident = 0;
+    size_t capacity = kDefaultCapacity;
+};
+
+// For readers that walk the whole file: if the mapping at fileData is block-compressed,
+// replaces it with an anonymous mapping of the equivalent plain v2 file, inflating the
+// blocks in parallel. Either way fileData / fileSize stay a pair for munmap.
+inline void inflateBlockedFile(uint8_t*& fileData, size_t& fileSize) {
+    size_t indexOffset = 0;
+    if (!findTrailer(fileData, fileSize, indexOffset) || fileData[0] != kBlockedFormatByte) return;
+
+    const uint8_t* p = fileData + indexOffset;
+    const uint8_t* indexEnd = fileData + fileSize - kTrailerTailSize;
+    BlockTable blocks = BlockTable::read(p, indexEnd, indexOffset - kTrailerDataOffset);
+    uint64_t indexSize = indexEnd - p;
+
+    size_t plainSize = kTrailerDataOffset + blocks.dataSize + indexSize + kTrailerTailSize;
+    void* mapped = mmap(nullptr, plainSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) throw std::runtime_error("mmap failed");
+    uint8_t* plain = static_cast<uint8_t*>(mapped);
+    try {
+        blocks.inflate(fileData + kTrailerDataOffset, 0, blocks.count(), plain + kTrailerDataOffset);
+    } catch (...) {
+        munmap(plain, plainSize);
+        throw;
+    }
+    plain[0] = kTrailerFormatByte;
+    uint8_t* tail = plain + kTrailerDataOffset + blocks.dataSize;
+    std::memcpy(tail, p, indexSize);
+    std::memcpy(tail + indexSize, &indexSize, sizeof(indexSize));
+    std::memcpy(tail + indexSize + sizeof(indexSize), kTrailerMagic, sizeof(kTrailerMagic));
+
+    munmap(fileData, fileSize);
+    fileData = plain;
+    fileSize = plainSize;
+}
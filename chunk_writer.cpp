@@ -0,0 +1,106 @@
+#include "chunk_writer.hpp"
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+
+ChunkWriter::~ChunkWriter() {
+    discard();
+}
+
+// Drops a half-written output: the spool file, or the target itself for Trailer files.
+void ChunkWriter::discard() {
+    if (data.is_open()) {
+        data.close();
+        std::remove(dataPath.c_str());
+    }
+}
+
+void ChunkWriter::open(const std::string& filename, FileLayout fileLayout, size_t fileBlockSize,
+                       const CompressionTier& fileBlockTier) {
+    discard();
+    if (fileBlockSize && fileLayout != FileLayout::Trailer) {
+        throw std::runtime_error("Block compression needs the v2 layout");
+    }
+    layout = fileLayout;
+    blockSize = fileBlockSize;
+    blockTier = fileBlockTier;
+    pending.clear();
+    blocks = BlockTable();
+    blocks.blockSize = blockSize;
+    target = filename;
+    dataPath = layout == FileLayout::Trailer ? filename : filename + ".data";
+    written = 0;
+    data.open(dataPath, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    if (!data) throw std::runtime_error("Cannot open output file: " + dataPath);
+    if (layout == FileLayout::Trailer) data.put(static_cast<char>(blockSize ? kBlockedFormatByte : kTrailerFormatByte));
+}
+
+void ChunkWriter::write(const uint8_t* bytes, size_t size) {
+    if (blockSize) {
+        written += size;
+        size_t used = 0;
+        if (!pending.empty()) {
+            used = std::min(size, blockSize - pending.size());
+            pending.insert(pending.end(), bytes, bytes + used);
+            if (pending.size() < blockSize) return;
+            writeBlock(pending.data(), blockSize);
+            pending.clear();
+        }
+        for (; size - used >= blockSize; used += blockSize) writeBlock(bytes + used, blockSize);
+        pending.assign(bytes + used, bytes + size);
+        return;
+    }
+    data.write(reinterpret_cast<const char*>(bytes), size);
+    if (!data) throw std::runtime_error("Write failed: " + dataPath);
+    written += size;
+}
+
+void ChunkWriter::writeBlock(const uint8_t* block, size_t size) {
+    compressed.clear();
+    size_t stored = blockTier.compress(block, size, compressed);
+    data.write(reinterpret_cast<const char*>(compressed.data()), stored);
+    if (!data) throw std::runtime_error("Write failed: " + dataPath);
+    blocks.ends.push_back(blocks.storedBegin(blocks.count()) + stored);
+}
+
+void ChunkWriter::flushIfFull(std::vector<uint8_t>& chunk) {
+    if (chunk.size() < kFlushBytes) return;
+    write(chunk);
+    chunk.clear();
+}
+
+void ChunkWriter::finish(const std::vector<uint8_t>& index, const std::vector<uint8_t>& indexSize) {
+    if (layout == FileLayout::Trailer) {
+        uint64_t tailSize = index.size();
+        if (blockSize) {
+            if (!pending.empty()) writeBlock(pending.data(), pending.size());
+            pending.clear();
+            blocks.dataSize = written;
+            std::vector<uint8_t> table;
+            blocks.write(table);
+            data.write(reinterpret_cast<const char*>(table.data()), table.size());
+            tailSize += table.size();
+        }
+        data.write(reinterpret_cast<const char*>(index.data()), index.size());
+        data.write(reinterpret_cast<const char*>(&tailSize), sizeof(tailSize));
+        data.write(kTrailerMagic, sizeof(kTrailerMagic));
+        data.close();
+        if (!data) throw std::runtime_error("Write failed: " + target);
+        return;
+    }
+
+    std::ofstream fout(target, std::ios::binary);
+    if (!fout) throw std::runtime_error("Cannot open output file: " + target);
+    fout.write(reinterpret_cast<const char*>(indexSize.data()), indexSize.size());
+    fout.write(reinterpret_cast<const char*>(index.data()), index.size());
+
+    data.flush();
+    data.seekg(0);
+    std::unique_ptr<char[]> buffer(new char[kFlushBytes]);
+    while (data) {
+        data.read(buffer.get(), kFlushBytes);
+        fout.write(buffer.get(), data.gcount());
+    }
+    if (!fout) throw std::runtime_error("Write failed: " + target);
+    discard();
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "chaos_format.hpp"
+#include "compression.hpp"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+
+// Streams an encoder's data region to disk while entities are still being produced,
+// so the whole region never sits in memory at once. With the Trailer layout the data
+// goes straight into the target file and finish() appends the index. The Header
+// layout needs the index in front of the data, so the region is spooled to a sibling
+// "<filename>.data" file and copied in behind the index by finish().
+//
+// With a block size set (Trailer layout only) the region is written block-compressed:
+// writes collect into a pending block, each full block is compressed at the block tier
+// on its way out, and finish() puts the BlockTable in front of the index.
+class ChunkWriter {
+public:
+    static constexpr size_t kFlushBytes = 1 << 20;
+
+    ChunkWriter() : layout(FileLayout::Trailer), written(0), blockSize(0) {}
+    ~ChunkWriter();
+    ChunkWriter(const ChunkWriter&) = delete;
+    ChunkWriter& operator=(const ChunkWriter&) = delete;
+
+    // blockSize 0 writes the data region uncompressed.
+    void open(const std::string& filename, FileLayout layout, size_t blockSize = 0,
+              const CompressionTier& blockTier = CompressionTier::fast());
+    void write(const uint8_t* data, size_t size);
+    void write(const std::vector<uint8_t>& chunk) { write(chunk.data(), chunk.size()); }
+
+    // Writes chunk out and empties it once it has grown past kFlushBytes.
+    void flushIfFull(std::vector<uint8_t>& chunk);
+
+    // Bytes of data region written so far; the offset the next chunk will land at.
+    uint64_t size() const { return written; }
+
+    // Writes the index (entity count through offset table) in the layout's position.
+    // indexSize is index.size() as a CHAOS varint, only used by the Header layout.
+    void finish(const std::vector<uint8_t>& index, const std::vector<uint8_t>& indexSize);
+
+private:
+    FileLayout layout;
+    std::string target;
+    std::string dataPath;
+    std::fstream data;
+    uint64_t written;
+
+    size_t blockSize;
+    CompressionTier blockTier;
+    std::vector<uint8_t> pending;
+    std::vector<uint8_t> compressed;
+    BlockTable blocks;
+
+    void writeBlock(const uint8_t* block, size_t size);
+    void discard();
+};
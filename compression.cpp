@@ -0,0 +1,339 @@
+#include "compression.hpp"
+#include <lz4.h>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+CompressionTier CompressionTier::parse(const std::string& spec) {
+    std::string method = spec.substr(0, spec.find(':'));
+    bool hasLevel = method.size() < spec.size();
+    int level = 0;
+    if (hasLevel) {
+        try {
+            size_t used = 0;
+            level = std::stoi(spec.substr(method.size() + 1), &used);
+            if (used != spec.size() - method.size() - 1) throw std::invalid_argument(spec);
+        } catch (const std::exception&) {
+            throw std::runtime_error("Invalid compression tier: " + spec);
+        }
+    }
+    if (method == "none" && !hasLevel) return none();
+    if (method == "fast") return fast(hasLevel ? level : 1);
+    if (method == "hc") return hc(hasLevel ? level : LZ4HC_CLEVEL_MAX);
+    throw std::runtime_error("Invalid compression tier: " + spec + ". Use none, fast[:acceleration] or hc[:level].");
+}
+
+std::string CompressionTier::name() const {
+    switch (method) {
+        case Method::None: return "none";
+        case Method::Fast: return "fast:" + std::to_string(level);
+        case Method::HC: return "hc:" + std::to_string(level);
+    }
+    return "unknown";
+}
+
+size_t CompressionTier::compress(const uint8_t* input, size_t size, std::vector<uint8_t>& out) const {
+    size_t start = out.size();
+    if (method != Method::None && size > 0) {
+        int bound = LZ4_compressBound(static_cast<int>(size));
+        out.resize(start + bound);
+        const char* src = reinterpret_cast<const char*>(input);
+        char* dst = reinterpret_cast<char*>(out.data() + start);
+        int stored = method == Method::Fast
+            ? LZ4_compress_fast(src, dst, static_cast<int>(size), bound, level)
+            : LZ4_compress_HC(src, dst, static_cast<int>(size), bound, level);
+        if (stored <= 0) throw std::runtime_error("LZ4 compression failed");
+        if (static_cast<size_t>(stored) < size) {
+            out.resize(start + stored);
+            return stored;
+        }
+        out.resize(start);
+    }
+    out.insert(out.end(), input, input + size);
+    return size;
+}
+
+void CompressionTier::appendString(std::string_view str, std::vector<uint8_t>& out) const {
+    std::vector<uint8_t> stored;
+    compress(reinterpret_cast<const uint8_t*>(str.data()), str.size(), stored);
+    appendVarint(stored.size(), out);
+    appendVarint(str.size(), out);
+    out.insert(out.end(), stored.begin(), stored.end());
+}
+
+// Timestamps are written as such ahead of either dictionary, so neither samples them.
+static bool isTimestamp(std::string_view str) {
+    Timestamp t;
+    return parseTimestamp(str, t);
+}
+
+// Calls f on every string value under root, entities in the pre-order the encoders
+// number them in and each entity's strings in field / element order.
+template <typename F>
+static void forEachString(const Value& root, F&& f) {
+    std::vector<const Value*> stack{&root};
+    auto visit = [&](const Value& v) {
+        if (v.type() == ValueType::String) {
+            f(std::get<std::string>(v.data));
+        } else if (v.type() == ValueType::List || v.type() == ValueType::Object) {
+            return true;
+        }
+        return false;
+    };
+    if (!visit(root)) return;
+    while (!stack.empty()) {
+        const Value* v = stack.back();
+        stack.pop_back();
+        size_t firstChild = stack.size();
+        if (v->type() == ValueType::List) {
+            for (const auto& element : std::get<List>(v->data).elements) {
+                if (visit(element)) stack.push_back(&element);
+            }
+        } else {
+            for (const auto& field : std::get<Object>(v->data).fields) {
+                if (visit(field.second)) stack.push_back(&field.second);
+            }
+        }
+        std::reverse(stack.begin() + firstChild, stack.end());
+    }
+}
+
+SharedStrings::SharedStrings() : loaded(LZ4_createStream()) {
+    if (!loaded) throw std::runtime_error("LZ4 stream allocation failed");
+}
+
+SharedStrings::~SharedStrings() {
+    LZ4_freeStream(loaded);
+}
+
+void SharedStrings::clear() {
+    text.clear();
+    uses = 0;
+}
+
+void SharedStrings::collect(const Value& root, size_t size, const CompressionTier& tier, const ValueStrings& values, bool timestamps) {
+    // Enough strings to tell recurring values apart, however large the document.
+    static constexpr size_t kSampleStrings = 1 << 16;
+    clear();
+    size = std::min(size, kMaxSharedStrings);
+    if (size == 0 || tier.method == CompressionTier::Method::None) return;
+    acceleration = tier.method == CompressionTier::Method::Fast ? tier.level : 1;
+
+    std::vector<const std::string*> strings;
+    forEachString(root, [&](const std::string& s) {
+        if (s.size() >= kMinLength && !values.contains(s) && !(timestamps && isTimestamp(s))) strings.push_back(&s);
+    });
+    if (strings.empty()) return;
+
+    // Every step-th string, each scored by the bytes its copies would cover.
+    size_t step = std::max<size_t>(1, strings.size() / kSampleStrings);
+    std::unordered_map<std::string_view, size_t> counts;
+    for (size_t i = 0; i < strings.size(); i += step) counts[*strings[i]]++;
+    std::vector<std::pair<std::string_view, size_t>> ranked(counts.begin(), counts.end());
+    std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+        size_t scoreA = a.first.size() * a.second, scoreB = b.first.size() * b.second;
+        return scoreA != scoreB ? scoreA > scoreB : a.first < b.first;
+    });
+
+    // Best samples go last: where several share a hash, LZ4 keeps the latest.
+    std::vector<std::string_view> picked;
+    size_t total = 0;
+    for (const auto& entry : ranked) {
+        if (total + entry.first.size() > size) continue;
+        picked.push_back(entry.first);
+        total += entry.first.size();
+    }
+    text.reserve(total);
+    for (auto it = picked.rbegin(); it != picked.rend(); ++it) text.append(*it);
+
+    LZ4_initStream(loaded, sizeof(*loaded));
+    LZ4_loadDict(loaded, text.data(), static_cast<int>(text.size()));
+}
+
+bool SharedStrings::compress(std::string_view str, size_t plainSize, std::vector<uint8_t>& out) const {
+    if (text.empty() || str.size() < kMinLength) return false;
+
+    // Compressing records the string in the stream, so each one starts from a fresh
+    // copy of the loaded samples.
+    thread_local LZ4_stream_t working;
+    thread_local std::vector<char> stored;
+    std::memcpy(&working, loaded, sizeof(working));
+    int bound = LZ4_compressBound(static_cast<int>(str.size()));
+    stored.resize(bound);
+    int storedSize = LZ4_compress_fast_continue(&working, str.data(), stored.data(), static_cast<int>(str.size()), bound, acceleration);
+    if (storedSize <= 0 || static_cast<size_t>(storedSize) >= str.size()) return false;
+
+    size_t start = out.size();
+    out.push_back(kSharedString);
+    appendVarint(storedSize, out);
+    appendVarint(str.size(), out);
+    if (out.size() - start + storedSize >= plainSize) {
+        out.resize(start);
+        return false;
+    }
+    out.insert(out.end(), stored.begin(), stored.begin() + storedSize);
+    uses++;
+    return true;
+}
+
+void ValueStrings::clear() {
+    list.clear();
+    ids.clear();
+}
+
+void ValueStrings::collect(const Value& root, size_t maxCount, bool timestamps) {
+    // Past this many distinct values the document is not low-cardinality; later
+    // newcomers are no longer counted.
+    static constexpr size_t kMaxTracked = 1 << 20;
+    clear();
+    if (maxCount == 0) return;
+
+    std::unordered_map<std::string_view, uint64_t> counts;
+    forEachString(root, [&](const std::string& s) {
+        if (s.size() < 2 || s.size() >= CompressionStage::kLongString || (timestamps && isTimestamp(s))) return;
+        auto it = counts.find(s);
+        if (it != counts.end()) it->second++;
+        else if (counts.size() < kMaxTracked) counts.emplace(s, 1);
+    });
+
+    std::vector<std::pair<std::string_view, uint64_t>> ranked;
+    for (const auto& entry : counts) {
+        if (entry.second > 1) ranked.push_back(entry);
+    }
+    std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+
+    // A value written in full costs 1 + length bytes; a reference costs the tag and
+    // the ID's varint, and the entry its length varint and bytes once.
+    auto varintSize = [](uint64_t n) {
+        size_t bytes = 1;
+        if (n >= 128) for (; n > 0; n >>= 8) bytes++;
+        return bytes;
+    };
+    for (const auto& [str, count] : ranked) {
+        if (list.size() == maxCount) break;
+        uint64_t plain = count * (1 + str.size());
+        uint64_t referenced = count * (1 + varintSize(list.size())) + varintSize(str.size()) + str.size();
+        if (referenced >= plain) continue;
+        ids.emplace(str, list.size());
+        list.push_back(str);
+    }
+}
+
+bool ValueStrings::encode(std::string_view str, std::vector<uint8_t>& out) const {
+    if (ids.empty()) return false;
+    auto it = ids.find(str);
+    if (it == ids.end()) return false;
+    out.push_back(kValueString);
+    appendVarint(it->second, out);
+    return true;
+}
+
+std::vector<uint8_t> ValueStrings::serialize() const {
+    std::vector<uint8_t> out;
+    for (std::string_view str : list) {
+        appendVarint(str.size(), out);
+        out.insert(out.end(), str.begin(), str.end());
+    }
+    return out;
+}
+
+void CompressionStage::start(const Value& root, const CompressionTier& stringTier, unsigned threads) {
+    static constexpr size_t kWindowPerThread = 256;
+    stop();
+    tier = stringTier;
+    totals = CompressionStats();
+
+    std::vector<const std::string*> sources;
+    forEachString(root, [&](const std::string& s) {
+        if (s.size() >= kLongString) sources.push_back(&s);
+    });
+
+    jobCount = sources.size();
+    if (jobCount == 0) return;
+    jobs.reset(new Job[jobCount]);
+    jobIndex.reserve(jobCount);
+    for (size_t i = 0; i < jobCount; ++i) {
+        jobs[i].source = sources[i];
+        jobIndex.emplace(sources[i]->data(), i);
+    }
+
+    size_t count = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    count = std::min(count, jobCount);
+    window = kWindowPerThread * count;
+    next = 0;
+    reach = 0;
+    stopping = false;
+    for (size_t w = 0; w < count; ++w) workers.emplace_back(&CompressionStage::work, this);
+}
+
+void CompressionStage::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    progress.notify_all();
+    for (auto& worker : workers) worker.join();
+    workers.clear();
+    jobs.reset();
+    jobCount = 0;
+    jobIndex.clear();
+}
+
+bool CompressionStage::claim(size_t i) {
+    uint8_t queued = kQueued;
+    return jobs[i].state.compare_exchange_strong(queued, kRunning);
+}
+
+void CompressionStage::run(size_t i) {
+    Job& job = jobs[i];
+    tier.appendString(*job.source, job.payload);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job.state = kDone;
+    }
+    progress.notify_all();
+}
+
+void CompressionStage::work() {
+    for (;;) {
+        size_t i;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            progress.wait(lock, [&] { return stopping || next >= jobCount || next < reach + window; });
+            if (stopping || next >= jobCount) return;
+            i = next++;
+        }
+        if (claim(i)) run(i);
+    }
+}
+
+bool CompressionStage::take(std::string_view str, std::vector<uint8_t>& out) {
+    auto it = jobIndex.find(str.data());
+    if (it == jobIndex.end() || jobs[it->second].source->size() != str.size()) return false;
+    Job& job = jobs[it->second];
+
+    bool inlined = claim(it->second);
+    if (inlined) {
+        run(it->second);
+    } else if (job.state != kDone) {
+        std::unique_lock<std::mutex> lock(mutex);
+        progress.wait(lock, [&] { return job.state != kRunning; });
+    }
+    if (job.state != kDone) return false;
+
+    out.insert(out.end(), job.payload.begin(), job.payload.end());
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job.state = kTaken;
+        totals.strings++;
+        totals.rawBytes += str.size();
+        totals.storedBytes += job.payload.size();
+        totals.inlined += inlined;
+        std::vector<uint8_t>().swap(job.payload);
+        reach = std::max(reach, it->second + 1);
+    }
+    progress.notify_all();
+    return true;
+}
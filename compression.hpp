@@ -0,0 +1,183 @@
+#pragma once
+
+#include "datastruct.hpp"
+#include "chaos_format.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <lz4.h>
+#include <lz4hc.h>
+
+// How the encoders compress one class of data: not at all, LZ4's fast compressor at a
+// given acceleration, or LZ4HC at a given level. Whatever the tier, the result is
+// stored as LZ4 or, when it would not shrink, as is (see inflateStored), so readers
+// need not know which tier wrote a file.
+struct CompressionTier {
+    enum class Method { None, Fast, HC };
+
+    Method method = Method::HC;
+    int level = LZ4HC_CLEVEL_MAX;  // acceleration for Fast, compression level for HC
+
+    static CompressionTier none() { return {Method::None, 0}; }
+    static CompressionTier fast(int acceleration = 1) { return {Method::Fast, acceleration}; }
+    static CompressionTier hc(int level = LZ4HC_CLEVEL_MAX) { return {Method::HC, level}; }
+
+    // "none", "fast", "fast:<acceleration>", "hc" or "hc:<level>".
+    static CompressionTier parse(const std::string& spec);
+    std::string name() const;
+
+    // Appends the stored form of input to out and returns its size in bytes.
+    size_t compress(const uint8_t* input, size_t size, std::vector<uint8_t>& out) const;
+
+    // Appends a long string's payload: varint stored size, varint length, stored bytes.
+    void appendString(std::string_view str, std::vector<uint8_t>& out) const;
+};
+
+// The tier for each class of data an encoder writes: by default strings and the
+// dictionary at LZ4HC's highest level, LZ4 fast for the blocks of a block-compressed
+// data region, no shared strings, and a value dictionary of up to 65536 strings.
+struct CompressionOptions {
+    CompressionTier strings = CompressionTier::hc();
+    CompressionTier dictionary = CompressionTier::hc();
+    CompressionTier blocks = CompressionTier::fast();
+    // Bytes of shared strings to collect (see SharedStrings); 0 leaves them out.
+    size_t sharedStrings = 0;
+    // Most strings the value dictionary may hold (see ValueStrings); 0 turns it off.
+    size_t valueStrings = 1 << 16;
+    // Whether ISO-8601 strings are written as timestamps (see kTimestamp) rather than
+    // as strings.
+    bool timestamps = true;
+};
+
+// Encoder side of the value dictionary (see kValueString). collect() counts a
+// document's short string values, other than timestamps written as such, and keeps
+// those whose repeats save more than the dictionary entry costs, numbered most
+// frequent first so that they get the shortest IDs. Long strings are left to the
+// string compressor. Read-only once collected.
+class ValueStrings {
+public:
+    // timestamps says whether timestamps are written as such, which leaves them out.
+    void collect(const Value& root, size_t maxCount, bool timestamps);
+    void clear();
+
+    bool empty() const { return list.empty(); }
+    bool contains(std::string_view str) const { return ids.count(str) != 0; }
+
+    // Appends str as a kValueString reference and returns true if it is in the dictionary.
+    bool encode(std::string_view str, std::vector<uint8_t>& out) const;
+    // The dictionary in stored form: each string's varint length, then its bytes.
+    std::vector<uint8_t> serialize() const;
+
+private:
+    std::vector<std::string_view> list;  // views into the collected Value tree
+    std::unordered_map<std::string_view, uint64_t> ids;
+};
+
+// Encoder side of a file's shared strings (see kSharedString). collect() picks sample
+// text from a document's strings, favouring values that recur; compress() then writes
+// a string against it whenever that beats the string's plain encoding. Matching
+// against the samples always uses LZ4's fast compressor, since LZ4HC would have to
+// reload them for every string. compress() may be called from several threads.
+class SharedStrings {
+public:
+    static constexpr size_t kDefaultSize = 32 << 10;
+    // LZ4 leaves the last 12 bytes of its input unmatched, so shorter strings never shrink.
+    static constexpr size_t kMinLength = 16;
+
+    SharedStrings();
+    ~SharedStrings();
+    SharedStrings(const SharedStrings&) = delete;
+    SharedStrings& operator=(const SharedStrings&) = delete;
+
+    // Collects up to size bytes from root's strings, leaving out those values encodes
+    // and, if timestamps are written as such, timestamps; strings tier none disables them.
+    void collect(const Value& root, size_t size, const CompressionTier& tier, const ValueStrings& values, bool timestamps);
+    void clear();
+
+    bool empty() const { return text.empty(); }
+    // Whether any string was written against the samples, so the index needs them.
+    bool used() const { return uses > 0; }
+    const std::string& samples() const { return text; }
+
+    // Appends str as a kSharedString value and returns true if that takes fewer than
+    // plainSize bytes; otherwise leaves out alone.
+    bool compress(std::string_view str, size_t plainSize, std::vector<uint8_t>& out) const;
+
+private:
+    std::string text;
+    int acceleration = 1;
+    LZ4_stream_t* loaded;  // text already hashed, copied for each string
+    mutable std::atomic<uint64_t> uses{0};
+};
+
+// Totals over the long strings a CompressionStage handed out: how many, their length,
+// the bytes written for them, and how many the encoder compressed itself because no
+// worker had got to them yet.
+struct CompressionStats {
+    uint64_t strings = 0;
+    uint64_t rawBytes = 0;
+    uint64_t storedBytes = 0;
+    uint64_t inlined = 0;
+};
+
+// Compresses a Value tree's long strings ahead of the encoder, on threads of its own,
+// so entity encoding does not stall on them. start() queues every string of
+// kLongString bytes or more in the pre-order the encoders visit entities in, and
+// workers stay at most a window of strings past the furthest one the encoder has
+// taken; a columnar list takes its strings column by column, jumping ahead of that
+// order, and the strings it skips are compressed behind it. take() hands over a
+// string's payload, compressing it on the caller's thread if no worker has got to it
+// yet, so the encoder never waits on a string that is still queued.
+class CompressionStage {
+public:
+    static constexpr size_t kLongString = 127;
+
+    CompressionStage() = default;
+    ~CompressionStage() { stop(); }
+    CompressionStage(const CompressionStage&) = delete;
+    CompressionStage& operator=(const CompressionStage&) = delete;
+
+    // threads == 0 uses every hardware thread.
+    void start(const Value& root, const CompressionTier& tier, unsigned threads = 0);
+    void stop();
+
+    // Appends the staged payload of str to out; false if str was not staged.
+    bool take(std::string_view str, std::vector<uint8_t>& out);
+
+    const CompressionStats& stats() const { return totals; }
+
+private:
+    enum State : uint8_t { kQueued, kRunning, kDone, kTaken };
+
+    struct Job {
+        const std::string* source;
+        std::vector<uint8_t> payload;
+        std::atomic<uint8_t> state{kQueued};
+    };
+
+    CompressionTier tier;
+    std::unique_ptr<Job[]> jobs;
+    size_t jobCount = 0;
+    std::unordered_map<const char*, size_t> jobIndex;
+
+    std::atomic<size_t> next{0};
+    size_t reach = 0;  // one past the furthest job taken
+    size_t window = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable progress;
+    std::vector<std::thread> workers;
+    CompressionStats totals;
+
+    bool claim(size_t i);
+    void run(size_t i);
+    void work();
+};
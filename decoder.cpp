@@ -10,6 +10,8 @@
 #include <cstring>
 #include <lz4.h>
 #include "datastruct.hpp"
+#include "arena.hpp"
+#include "chaos_format.hpp"
 
 class MMapDecoder {
     uint8_t* fileData = nullptr;
@@ -19,6 +21,8 @@ class MMapDecoder {
 
     std::vector<std::string> dictionary;
     std::vector<long> entityTable;
+    ShapeList shapes;
+    IndexSections sections;
     std::unordered_map<uint8_t, size_t> customSizeMap;
 
 public:
@@ -45,6 +49,8 @@ public:
             }
         }
         close(fd);
+        // Block-compressed files are inflated whole, in parallel, since a full decode reads every block.
+        if (fileData) inflateBlockedFile(fileData, fileSize);
     }
 
     void addCustom(uint8_t id, size_t size) {
@@ -94,18 +100,12 @@ public:
 
     std::vector<uint8_t> uncompressBuffer(const uint8_t* compressed_ptr, size_t compressed_size, size_t originalSize) {
         std::vector<uint8_t> output(originalSize);
-        int decompressed = LZ4_decompress_safe(
-            reinterpret_cast<const char*>(compressed_ptr),
-            reinterpret_cast<char*>(output.data()),
-            static_cast<int>(compressed_size),
-            static_cast<int>(originalSize)
-        );
-        if (decompressed < 0) throw std::runtime_error("LZ4 decompression failed");
-        output.resize(decompressed);
+        inflateStored(compressed_ptr, compressed_size, output.data(), originalSize);
         return output;
     }
 
     Value decodeValue() {
+        const uint8_t* value = fileData + masterOffset;
         uint8_t byte = readByte();
 
         if ((byte & 0x80) == 0) {
@@ -128,6 +128,7 @@ public:
             return decodeWrapper(id);
         }
 
+        if (isTimestampAt(value)) return Value(formatTimestamp(readTimestamp(readNBytesPtr(kTimestampSize - 1))));
         switch (byte & 0xF0) {
             case 0xC0: return Value(int64_t(byte & 0x0F));
             case 0xD0: return Value(-int64_t(byte & 0x0F));
@@ -156,6 +157,17 @@ public:
                     return Value(val);
                 }
 
+                if (byte == kValueString) return Value(std::string(sections.valueString(readVarNumber())));
+
+                if (byte == kSharedString) {
+                    size_t storedSize = readVarNumber();
+                    size_t originalSize = readVarNumber();
+                    const uint8_t* stored = readNBytesPtr(storedSize);
+                    std::string text(originalSize, '\0');
+                    inflateStored(stored, storedSize, reinterpret_cast<uint8_t*>(text.data()), originalSize, sections.sharedStrings);
+                    return Value(std::move(text));
+                }
+
                 if (subType == 0x08) {
                     const uint8_t* data = readNBytesPtr(4);
                     float fval;
@@ -182,11 +194,19 @@ public:
 
         Object obj;
         long offsetSize = readByte();
+
+        if (isShaped(offsetSize)) {
+            const auto& keys = shapeKeys(shapes, readVarNumber(), count);
+            if (hasImpliedOffsets(offsetSize)) readVarNumber();
+            else masterOffset += shapedOffsetWidth(offsetSize) * count;
+            for (long i = 0; i < count; i++) obj.add(dictionary[keys[i]], decodeValue());
+            return obj.toValue();
+        }
         
         masterOffset += offsetSize * count;
 
         for (int i = 0; i < count; i++) {
-            long keyIdx = readVarNumber();
+            uint64_t keyIdx = readVarNumber();
             if (keyIdx >= dictionary.size()) throw std::runtime_error("Invalid key index");
             obj.add(dictionary[keyIdx], decodeValue());
         }
@@ -199,11 +219,40 @@ public:
         if (count == 0x7F) count = readVarNumber();
 
         List l;
-        long offsetSize = readByte();
+        uint8_t offsetSize = readByte();
+        l.elements.reserve(count);
+
+        if (isPacked(offsetSize)) {
+            const uint8_t* packed = readNBytesPtr(packedDataSize(offsetSize, count));
+            forEachPacked(offsetSize, packed, count, [&](auto element) { l.add(Value(element)); });
+            return l.toValue();
+        }
+
+        if (isColumnar(offsetSize)) {
+            ColumnarList columns(fileData + masterOffset, fileData + fileSize, count);
+            std::vector<Object> records(count);
+            for (size_t j = 0; j < columns.keys.size(); j++) {
+                if (columns.keys[j] >= dictionary.size()) throw std::runtime_error("Invalid key index");
+                const std::string& key = dictionary[columns.keys[j]];
+                ColumnarColumn column = columns.column(j);
+                if (column.typed()) {
+                    forEachPackedCell(column, count, [&](uint64_t row, auto element) {
+                        records[row].fields.emplace_back(key, Value(element));
+                    });
+                    continue;
+                }
+                for (long row = 0; row < count; row++) {
+                    if (!column.present(row)) continue;
+                    masterOffset = column.valueAt(row) - fileData;
+                    records[row].fields.emplace_back(key, decodeValue());
+                }
+            }
+            for (auto& record : records) l.elements.emplace_back(std::move(record));
+            return l.toValue();
+        }
 
         masterOffset += offsetSize * count;
-        
-        l.elements.reserve(count);
+
         for (int i = 0; i < count; i++) {
             l.add(decodeValue());
         }
@@ -221,10 +270,15 @@ public:
         return v;
     }
 
-    Value decode(const std::string& filename) {
+    void load(const std::string& filename) {
         loadFile(filename);
-        
-        long headerLength = readVarNumber();
+
+        bool trailer = findTrailer(fileData, fileSize, masterOffset);
+        size_t indexEnd = fileSize - kTrailerTailSize;
+        if (!trailer) {
+            indexEnd = readVarNumber();
+            indexEnd += masterOffset;
+        }
         long entityCount = readVarNumber();
 
         uint8_t dictFlag = readByte();
@@ -258,8 +312,27 @@ public:
             std::memcpy(&val, b_ptr, offsetSize); 
             entityTable.push_back(val);
         }
+        if (indexEnd > fileSize) throw std::runtime_error("Invalid index size");
+        const uint8_t* p = fileData + masterOffset;
+        shapes = readShapeTable(p, fileData + indexEnd, dictionary.size());
+        sections.read(p, fileData + indexEnd);
         
-        baseOffset = masterOffset;
+        baseOffset = trailer ? kTrailerDataOffset : indexEnd;
+    }
+
+    Value decode(const std::string& filename) {
+        load(filename);
         return decodeWrapper(0);
     }
+
+    NodeDocument decodeNodes(const std::string& filename) {
+        load(filename);
+
+        NodeDocument doc;
+        doc.dictionary = dictionary;
+        doc.arenas.emplace_back();
+        NodeBuilder builder(fileData, fileSize, baseOffset, entityTable, shapes, dictionary.size(), sections, customSizeMap, doc.arenas.back(), true);
+        builder.buildEntity(0, doc.root);
+        return doc;
+    }
 };
\ No newline at end of file
@@ -2,7 +2,6 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
-#include <unordered_set>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -12,8 +11,13 @@
 #include <lz4.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <exception>
 #include <functional>
 #include "datastruct.hpp"
+#include "arena.hpp"
+#include "chaos_format.hpp"
 
 class MMapDecoderParallel {
     uint8_t* fileData = nullptr;
@@ -22,15 +26,21 @@ class MMapDecoderParallel {
 
     std::vector<std::string> dictionary;
     std::vector<long> entityTable;
+    ShapeList shapes;
+    IndexSections sections;
     std::unordered_map<uint8_t, size_t> customSizeMap;
-    std::unordered_map<long, Value> entityMap;
-    std::unordered_map<long, size_t> offsetMap;
+    std::vector<Value> entities;
+    std::vector<std::atomic<long>> parents;
 
-    long nextEntityId = 0;
-    std::mutex nextEntityIdMutex;
-    std::mutex entityMapMutex;
+    unsigned threadCount;
 
 public:
+    // threads == 0 sizes the pool to the hardware concurrency.
+    explicit MMapDecoderParallel(unsigned threads = 0) : threadCount(threads) {
+        if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+        if (threadCount == 0) threadCount = 4;
+    }
+
     ~MMapDecoderParallel() {
         if (fileData) munmap(fileData, fileSize);
     }
@@ -54,32 +64,34 @@ public:
             }
         }
         close(fd);
+        // Block-compressed files are inflated whole, in parallel, since a full decode reads every block.
+        if (fileData) inflateBlockedFile(fileData, fileSize);
     }
 
     void addCustom(uint8_t id, size_t size) {
         customSizeMap[id] = size;
     }
 
-    const uint8_t* readNBytesPtr(size_t n, long threadID) {
-        if (offsetMap.at(threadID) + n > fileSize) {
+    const uint8_t* readNBytesPtr(size_t n, size_t& offset) {
+        if (offset + n > fileSize) {
             throw std::runtime_error("EOF: Attempted to read past end of file.");
         }
-        const uint8_t* ptr = fileData + offsetMap.at(threadID);
-        offsetMap.at(threadID) += n;
+        const uint8_t* ptr = fileData + offset;
+        offset += n;
         return ptr;
     }
 
-    uint8_t readByte(long threadID) {
-        if (offsetMap.at(threadID) >= fileSize) throw std::runtime_error("EOF: Attempted to read a single byte past end of file.");
-        return fileData[offsetMap.at(threadID)++];
+    uint8_t readByte(size_t& offset) {
+        if (offset >= fileSize) throw std::runtime_error("EOF: Attempted to read a single byte past end of file.");
+        return fileData[offset++];
     }
 
-    uint64_t readVarNumber(long threadID) {
-        uint8_t size_byte = readByte(threadID);
+    uint64_t readVarNumber(size_t& offset) {
+        uint8_t size_byte = readByte(offset);
         if (size_byte < 128) return static_cast<uint64_t>(size_byte);
 
         size_t len = size_byte & 0x7F;
-        const uint8_t* arr = readNBytesPtr(len, threadID);
+        const uint8_t* arr = readNBytesPtr(len, offset);
         uint64_t result = 0;
         if (len > sizeof(uint64_t)) len = sizeof(uint64_t);
         std::memcpy(&result, arr, len);
@@ -103,77 +115,84 @@ public:
 
     std::vector<uint8_t> uncompressBuffer(const uint8_t* compressed_ptr, size_t compressed_size, size_t originalSize) {
         std::vector<uint8_t> output(originalSize);
-        int decompressed = LZ4_decompress_safe(
-            reinterpret_cast<const char*>(compressed_ptr),
-            reinterpret_cast<char*>(output.data()),
-            static_cast<int>(compressed_size),
-            static_cast<int>(originalSize)
-        );
-        if (decompressed < 0) throw std::runtime_error("LZ4 decompression failed");
-        output.resize(decompressed);
+        inflateStored(compressed_ptr, compressed_size, output.data(), originalSize);
         return output;
     }
 
-    Value decodeValue(long threadID) {
-        uint8_t byte = readByte(threadID);
+    Value decodeValue(size_t& offset, long parentId) {
+        const uint8_t* value = fileData + offset;
+        uint8_t byte = readByte(offset);
 
         if ((byte & 0x80) == 0) {
             size_t strSize = byte & 0x7F;
             if (strSize == 0x7F) {
-                size_t compressedSize = readVarNumber(threadID);
-                size_t originalSize = readVarNumber(threadID);
-                const uint8_t* comp_ptr = readNBytesPtr(compressedSize, threadID);
+                size_t compressedSize = readVarNumber(offset);
+                size_t originalSize = readVarNumber(offset);
+                const uint8_t* comp_ptr = readNBytesPtr(compressedSize, offset);
                 auto decomp = uncompressBuffer(comp_ptr, compressedSize, originalSize);
                 return Value(std::string(decomp.begin(), decomp.end()));
             } else {
-                const uint8_t* str_ptr = readNBytesPtr(strSize, threadID);
+                const uint8_t* str_ptr = readNBytesPtr(strSize, offset);
                 return Value(std::string(reinterpret_cast<const char*>(str_ptr), strSize));
             }
         }
 
         if (((byte & 0xE0) >> 5) == 0x04 || ((byte & 0xE0) >> 5) == 0x05) {
             uint64_t id = byte & 0x1F;
-            if (id == 0x1F) id = readVarNumber(threadID);
+            if (id == 0x1F) id = readVarNumber(offset);
+            claimChild(id, parentId);
             return Reference(id).toValue();
         }
 
+        if (isTimestampAt(value)) return Value(formatTimestamp(readTimestamp(readNBytesPtr(kTimestampSize - 1, offset))));
         switch (byte & 0xF0) {
             case 0xC0: return Value(int64_t(byte & 0x0F));
             case 0xD0: return Value(-int64_t(byte & 0x0F));
             case 0xE0: {
                 uint64_t id = byte & 0x0F;
-                if (id == 0x0F) id = readVarNumber(threadID);
+                if (id == 0x0F) id = readVarNumber(offset);
                 size_t sz = customSizeMap.at(id);
-                const uint8_t* d = readNBytesPtr(sz, threadID);
+                const uint8_t* d = readNBytesPtr(sz, offset);
                 return Custom(id, std::vector<uint8_t>(d, d + sz)).toValue();
             }
             case 0xF0: {
                 uint8_t subType = byte & 0x0F;
                 switch (subType) {
                     case 0x0C: return Value();
-                    case 0x0D: return Value(readByte(threadID));
+                    case 0x0D: return Value(readByte(offset));
                     case 0x0E: return Value(false);
                     case 0x0F: return Value(true);
                 }
 
                 if (subType <= 0x07) {
                     size_t len = 1 << (subType & 0x03);
-                    const uint8_t* data = readNBytesPtr(len, threadID);
+                    const uint8_t* data = readNBytesPtr(len, offset);
                     int64_t val = 0;
                     std::memcpy(&val, data, len);
                     if (subType & 0x04) val = -val;
                     return Value(val);
                 }
 
+                if (byte == kValueString) return Value(std::string(sections.valueString(readVarNumber(offset))));
+
+                if (byte == kSharedString) {
+                    size_t storedSize = readVarNumber(offset);
+                    size_t originalSize = readVarNumber(offset);
+                    const uint8_t* stored = readNBytesPtr(storedSize, offset);
+                    std::string text(originalSize, '\0');
+                    inflateStored(stored, storedSize, reinterpret_cast<uint8_t*>(text.data()), originalSize, sections.sharedStrings);
+                    return Value(std::move(text));
+                }
+
                 if (subType == 0x08) {
-                    const uint8_t* data = readNBytesPtr(4, threadID);
+                    const uint8_t* data = readNBytesPtr(4, offset);
                     float fval;
                     std::memcpy(&fval, data, sizeof(float));
                     return Value(fval);
                 }
 
                 if (subType == 0x09) {
-                    const uint8_t* data = readNBytesPtr(8, threadID);
+                    const uint8_t* data = readNBytesPtr(8, offset);
                     double dval;
                     std::memcpy(&dval, data, sizeof(double));
                     return Value(dval);
@@ -184,99 +203,177 @@ public:
         throw std::runtime_error("Unknown type byte");
     }
 
-    Value decodeObject(long threadID) {
-        uint8_t byte = readByte(threadID);
+    Value decodeObject(size_t& offset, long id) {
+        uint8_t byte = readByte(offset);
         long count = byte & 0x7F;
-        if (count == 0x7F) count = readVarNumber(threadID);
+        if (count == 0x7F) count = readVarNumber(offset);
 
         Object obj;
-        long offsetSize = readByte(threadID);
+        long offsetSize = readByte(offset);
+
+        if (isShaped(offsetSize)) {
+            const auto& keys = shapeKeys(shapes, readVarNumber(offset), count);
+            if (hasImpliedOffsets(offsetSize)) readVarNumber(offset);
+            else offset += shapedOffsetWidth(offsetSize) * count;
+            for (long i = 0; i < count; i++) obj.add(dictionary[keys[i]], decodeValue(offset, id));
+            return obj.toValue();
+        }
         
-        offsetMap[threadID] += offsetSize * count;
+        offset += offsetSize * count;
 
         for (int i = 0; i < count; i++) {
-            long keyIdx = readVarNumber(threadID);
+            uint64_t keyIdx = readVarNumber(offset);
             if (keyIdx >= dictionary.size()) throw std::runtime_error("Invalid key index");
-            obj.add(dictionary[keyIdx], decodeValue(threadID));
+            obj.add(dictionary[keyIdx], decodeValue(offset, id));
         }
         return obj.toValue();
     }
 
-    Value decodeList(long threadID) {
-        uint8_t byte = readByte(threadID);
+    Value decodeList(size_t& offset, long id) {
+        uint8_t byte = readByte(offset);
         long count = byte & 0x7F;
-        if (count == 0x7F) count = readVarNumber(threadID);
+        if (count == 0x7F) count = readVarNumber(offset);
 
         List l;
-        long offsetSize = readByte(threadID);
-        
-        offsetMap[threadID] += offsetSize * count;
-        
+        uint8_t offsetSize = readByte(offset);
         l.elements.reserve(count);
+
+        if (isPacked(offsetSize)) {
+            const uint8_t* packed = readNBytesPtr(packedDataSize(offsetSize, count), offset);
+            forEachPacked(offsetSize, packed, count, [&](auto element) { l.add(Value(element)); });
+            return l.toValue();
+        }
+
+        if (isColumnar(offsetSize)) {
+            ColumnarList columns(fileData + offset, fileData + fileSize, count);
+            std::vector<Object> records(count);
+            for (size_t j = 0; j < columns.keys.size(); j++) {
+                if (columns.keys[j] >= dictionary.size()) throw std::runtime_error("Invalid key index");
+                const std::string& key = dictionary[columns.keys[j]];
+                ColumnarColumn column = columns.column(j);
+                if (column.typed()) {
+                    forEachPackedCell(column, count, [&](uint64_t row, auto element) {
+                        records[row].fields.emplace_back(key, Value(element));
+                    });
+                    continue;
+                }
+                for (long row = 0; row < count; row++) {
+                    if (!column.present(row)) continue;
+                    size_t cell = column.valueAt(row) - fileData;
+                    records[row].fields.emplace_back(key, decodeValue(cell, id));
+                }
+            }
+            for (auto& record : records) l.elements.emplace_back(std::move(record));
+            return l.toValue();
+        }
+
+        offset += offsetSize * count;
+
         for (int i = 0; i < count; i++) {
-            l.add(decodeValue(threadID));
+            l.add(decodeValue(offset, id));
         }
         return l.toValue();
     }
 
-    Value decodeWrapper(long id, long threadID) {
-        offsetMap[threadID] = entityTable.at(id) + baseOffset;
-        uint8_t peek = fileData[offsetMap.at(threadID)];
-        Value v = (peek & 0x80) ? decodeList(threadID) : decodeObject(threadID);
+    Value decodeWrapper(long id) {
+        size_t offset = entityTable.at(id) + baseOffset;
+        uint8_t peek = fileData[offset];
+        Value v = (peek & 0x80) ? decodeList(offset, id) : decodeObject(offset, id);
         return v;
     }
 
-    void resolveReferences(Value& value, std::unordered_set<long>& visited) {
-        if (!value.isReference()) {
-            if (value.isObject()) {
-                for (auto& pair : value.asObject().fields) {
-                    resolveReferences(pair.second, visited);
-                }
-            } else if (value.isList()) {
-                for (auto& element : value.asList().elements) {
-                    resolveReferences(element, visited);
+    // Records `parentId` as the owner of entity `id`. Encoders number children after their
+    // parent, so anything else (or a second parent) is malformed and resolves to null.
+    void claimChild(uint64_t id, long parentId) {
+        if (id <= static_cast<uint64_t>(parentId) || id >= parents.size()) return;
+        long expected = 0;
+        parents[id].compare_exchange_strong(expected, parentId + 1, std::memory_order_relaxed);
+    }
+
+    void linkEntity(long id) {
+        auto link = [&](Value& value) {
+            if (!value.isReference()) return;
+            long childId = value.asReference().id;
+            if (childId > id && childId < (long)entities.size() && parents[childId].load(std::memory_order_relaxed) == id + 1) {
+                value = std::move(entities[childId]);
+            } else {
+                value = Value();
+            }
+        };
+
+        Value& entity = entities[id];
+        if (entity.isObject()) {
+            for (auto& pair : entity.asObject().fields) link(pair.second);
+        } else if (entity.isList()) {
+            for (auto& element : entity.asList().elements) {
+                // Records of a columnar list are decoded in place, references and all.
+                if (element.isObject()) {
+                    for (auto& pair : element.asObject().fields) link(pair.second);
+                } else {
+                    link(element);
                 }
             }
-            return;
         }
+    }
 
-        long id = value.asReference().id;
-
-        if (visited.count(id)) {
-            value = Value(); 
-            return;
+    // Moves every entity into its parent exactly once. Children always have larger IDs than
+    // their parent, so walking IDs in descending order links each child before its parent.
+    // Subtrees hanging off the root are independent and are linked on separate threads.
+    void linkEntities() {
+        long entityCount = entities.size();
+        long workers = std::max<long>(1, std::min<long>(threadCount, entityCount));
+
+        std::vector<long> owner(entityCount, 0);
+        std::vector<std::vector<long>> buckets(workers);
+        for (long id = 1; id < entityCount; ++id) {
+            long parent = parents[id].load(std::memory_order_relaxed) - 1;
+            if (parent < 0) continue;
+            owner[id] = (parent == 0) ? id : owner[parent];
+            buckets[owner[id] % workers].push_back(id);
         }
 
-        visited.insert(id);
+        auto worker_task = [&](long worker) {
+            const auto& ids = buckets[worker];
+            for (auto it = ids.rbegin(); it != ids.rend(); ++it) {
+                linkEntity(*it);
+            }
+        };
 
-        auto it = entityMap.find(id);
-        if (it != entityMap.end()) {
-            value = it->second;
-            resolveReferences(value, visited);
-        } else {
-            value = Value(); 
+        std::vector<std::thread> threads;
+        for (long i = 1; i < workers; ++i) {
+            threads.emplace_back(worker_task, i);
+        }
+        worker_task(0);
+
+        for (auto& t : threads) {
+            t.join();
         }
 
-        visited.erase(id);
+        linkEntity(0);
     }
 
-    Value decode(const std::string& filename) {
+    void load(const std::string& filename) {
         loadFile(filename);
             
-        offsetMap[0] = 0;
+        size_t offset = 0;
 
-        long headerLength = readVarNumber(0);
-        long entityCount = readVarNumber(0);
+        bool trailer = findTrailer(fileData, fileSize, offset);
+        size_t indexEnd = fileSize - kTrailerTailSize;
+        if (!trailer) {
+            indexEnd = readVarNumber(offset);
+            indexEnd += offset;
+        }
+        long entityCount = readVarNumber(offset);
 
-        uint8_t dictFlag = readByte(0);
+        uint8_t dictFlag = readByte(offset);
         std::vector<uint8_t> dictBuffer;
         if (dictFlag == 0xFF) {
-            long sz = readVarNumber(0);
-            long og = readVarNumber(0);
-            const uint8_t* comp_ptr = readNBytesPtr(sz, 0);
+            long sz = readVarNumber(offset);
+            long og = readVarNumber(offset);
+            const uint8_t* comp_ptr = readNBytesPtr(sz, offset);
             dictBuffer = uncompressBuffer(comp_ptr, sz, og);
         } else {
-            const uint8_t* dict_ptr = readNBytesPtr(dictFlag, 0);
+            const uint8_t* dict_ptr = readNBytesPtr(dictFlag, offset);
             dictBuffer.assign(dict_ptr, dict_ptr + dictFlag);
         }
 
@@ -291,63 +388,145 @@ public:
             dictOffset += stringLength;
         }
 
-        uint8_t offsetSize = readByte(0);
+        uint8_t offsetSize = readByte(offset);
         entityTable.reserve(entityCount);
         for (long i = 0; i < entityCount; i++) {
-            const uint8_t* b_ptr = readNBytesPtr(offsetSize, 0);
+            const uint8_t* b_ptr = readNBytesPtr(offsetSize, offset);
             long val = 0;
             std::memcpy(&val, b_ptr, offsetSize);
             entityTable.push_back(val);
         }
+        if (indexEnd > fileSize) throw std::runtime_error("Invalid index size");
+        const uint8_t* p = fileData + offset;
+        shapes = readShapeTable(p, fileData + indexEnd, dictionary.size());
+        sections.read(p, fileData + indexEnd);
         
-        baseOffset = offsetMap[0];
-        nextEntityId = 0;
+        baseOffset = trailer ? kTrailerDataOffset : indexEnd;
 
-        long threadCount = 4;
-        std::vector<std::thread> threads;
-
-        for (long i = 0; i < threadCount; ++i) {
-            offsetMap[i] = 0; 
+        if (entityCount == 0) {
+             throw std::runtime_error("Root entity (ID 0) not found after decoding.");
         }
+    }
 
-        auto worker_task = [&](long threadID) {
-            while (true) {
-                long currentId = -1;
-                {
-                    std::lock_guard<std::mutex> lock(nextEntityIdMutex);
-                    if (nextEntityId < entityCount) {
-                        currentId = nextEntityId++;
-                    } else {
-                        break;
-                    }
-                }
+    Value decode(const std::string& filename) {
+        load(filename);
 
-                if (currentId != -1) {
-                    Value v = decodeWrapper(currentId, threadID);
-                    {
-                        std::lock_guard<std::mutex> lock(entityMapMutex);
-                        entityMap[currentId] = v;
+        decodeEntities(entityTable.size());
+        linkEntities();
+
+        Value root = std::move(entities[0]);
+        entities.clear();
+        parents.clear();
+
+        return root;
+    }
+
+    // Node-tree variant of decode(): each worker builds its entities into its own arena,
+    // then references are patched by copying the 16-byte child node (its elements stay
+    // where they are), so linking never touches subtree contents.
+    NodeDocument decodeNodes(const std::string& filename) {
+        load(filename);
+
+        long entityCount = entityTable.size();
+        long workers = std::max<long>(1, std::min<long>(threadCount, entityCount));
+        long chunkSize = std::max<long>(1, std::min<long>(1024, entityCount / (workers * 16)));
+
+        NodeDocument doc;
+        doc.dictionary = dictionary;
+        doc.arenas.resize(workers);
+
+        std::vector<Node> entityNodes(entityCount);
+        std::vector<std::vector<std::pair<Node*, long>>> references(workers);
+
+        std::atomic<long> nextEntityId(0);
+        std::atomic<bool> failed(false);
+        std::exception_ptr error;
+        std::mutex errorMutex;
+
+        auto worker_task = [&](long worker) {
+            try {
+                NodeBuilder builder(fileData, fileSize, baseOffset, entityTable, shapes, dictionary.size(), sections, customSizeMap, doc.arenas[worker], false);
+                while (!failed.load(std::memory_order_relaxed)) {
+                    long begin = nextEntityId.fetch_add(chunkSize, std::memory_order_relaxed);
+                    if (begin >= entityCount) break;
+                    long end = std::min(begin + chunkSize, entityCount);
+                    for (long id = begin; id < end; ++id) {
+                        builder.buildEntity(id, entityNodes[id]);
                     }
                 }
+                references[worker] = std::move(builder.references);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error) error = std::current_exception();
+                failed = true;
             }
         };
 
-        for (long i = 0; i < threadCount; ++i) {
+        std::vector<std::thread> threads;
+        for (long i = 1; i < workers; ++i) {
             threads.emplace_back(worker_task, i);
         }
-
+        worker_task(0);
         for (auto& t : threads) {
             t.join();
         }
+        if (error) std::rethrow_exception(error);
 
-        if (entityMap.find(0) == entityMap.end()) {
-             throw std::runtime_error("Root entity (ID 0) not found after decoding.");
+        // Children are numbered after their parent; anything else would form a cycle.
+        for (const auto& refs : references) {
+            for (const auto& [node, parentId] : refs) {
+                long childId = node->reference;
+                *node = (childId > parentId && childId < entityCount) ? entityNodes[childId] : Node();
+            }
         }
-        
-        Value root = entityMap.at(0);
-        std::unordered_set<long> visited;
-        resolveReferences(root, visited);
 
-        return root;
+        doc.root = entityNodes[0];
+        return doc;
+    }
+
+    // Decodes every entity into its own slot of `entities`. Workers claim contiguous
+    // ID ranges from a shared atomic counter, so the hot path takes no locks; the
+    // calling thread participates as one of the workers.
+    void decodeEntities(long entityCount) {
+        entities.clear();
+        entities.resize(entityCount);
+        parents = std::vector<std::atomic<long>>(entityCount);
+
+        long workers = std::max<long>(1, std::min<long>(threadCount, entityCount));
+        long chunkSize = std::max<long>(1, std::min<long>(1024, entityCount / (workers * 16)));
+
+        std::atomic<long> nextEntityId(0);
+        std::atomic<bool> failed(false);
+        std::exception_ptr error;
+        std::mutex errorMutex;
+
+        auto worker_task = [&]() {
+            try {
+                while (!failed.load(std::memory_order_relaxed)) {
+                    long begin = nextEntityId.fetch_add(chunkSize, std::memory_order_relaxed);
+                    if (begin >= entityCount) break;
+                    long end = std::min(begin + chunkSize, entityCount);
+                    for (long id = begin; id < end; ++id) {
+                        entities[id] = decodeWrapper(id);
+                    }
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (long i = 1; i < workers; ++i) {
+            threads.emplace_back(worker_task);
+        }
+        worker_task();
+
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        if (error) std::rethrow_exception(error);
     }
 };
\ No newline at end of file
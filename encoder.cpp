@@ -2,25 +2,63 @@
 
 void Encoder::encode(const Value& root, const std::string& filename) {
     std::vector<uint8_t> output;
-    std::vector<std::pair<long, Value>> stack;
+    std::vector<std::pair<long, const Value*>> stack;
     
-    output.reserve(1024 * 1024); 
-
-    stack.push_back({0, root});
+    output.reserve(ChunkWriter::kFlushBytes); 
+    writer.open(filename, layout, blockSize, compression.blocks);
+    shapes.clear();
+    internSortedKeys(root);
+    valueStrings.collect(root, compression.valueStrings, compression.timestamps);
+    sharedStrings.collect(root, compression.sharedStrings, compression.strings, valueStrings, compression.timestamps);
+    stringStage.start(root, compression.strings);
+
+    stack.push_back({0, &root});
     currentEntityId = 1;
 
     while(!stack.empty()){
         auto [id, value] = stack.back();
         stack.pop_back();
 
-        std::vector<std::pair<long, Value>> children;
-        encodeValue(value, id, output, children);
+        size_t firstChild = stack.size();
+        encodeValue(*value, id, output, stack);
+        std::reverse(stack.begin() + firstChild, stack.end());
+    }
+    stringStage.stop();
 
-        for(int i = children.size() - 1; i >= 0; --i){
-            stack.push_back(children[i]);
-        }
+    writeFile(output);
+}
+
+void Encoder::encode(const NodeDocument& doc, const std::string& filename) {
+    std::vector<uint8_t> output;
+    std::vector<std::pair<long, const Node*>> stack;
+
+    output.reserve(ChunkWriter::kFlushBytes);
+    writer.open(filename, layout, blockSize, compression.blocks);
+    shapes.clear();
+    valueStrings.clear();
+    sharedStrings.clear();
+    nodeKeyIds.assign(doc.dictionary.size(), UINT64_MAX);
+    internSortedKeys(std::vector<std::string_view>(doc.dictionary.begin(), doc.dictionary.end()));
+
+    stack.push_back({0, &doc.root});
+    currentEntityId = 1;
+
+    while(!stack.empty()){
+        auto [id, node] = stack.back();
+        stack.pop_back();
+
+        size_t firstChild = stack.size();
+        encodeNode(*node, id, doc, output, stack);
+        std::reverse(stack.begin() + firstChild, stack.end());
     }
 
+    writeFile(output);
+}
+
+void Encoder::writeFile(std::vector<uint8_t>& output) {
+    writer.write(output);
+    output.clear();
+
     std::vector<uint8_t> header;
     header.reserve(4096);
 
@@ -39,7 +77,7 @@ void Encoder::encode(const Value& root, const std::string& filename) {
         header.insert(header.end(), dictionaryBuffer.begin(), dictionaryBuffer.end());
     } else {
         auto ogSizeVec = varEncodeNumber(dictionaryBuffer.size());
-        auto compressedDict = compressBuffer(dictionaryBuffer);
+        auto compressedDict = compressBuffer(dictionaryBuffer, compression.dictionary);
         auto compressedSizeVec = varEncodeNumber(compressedDict.size());
 
         header.push_back(0xFF);
@@ -48,7 +86,7 @@ void Encoder::encode(const Value& root, const std::string& filename) {
         header.insert(header.end(), compressedDict.begin(), compressedDict.end());
     }
 
-    auto globalOffsetBytes = nearestBytes(output.size());
+    auto globalOffsetBytes = nearestBytes(writer.size());
     header.push_back(static_cast<uint8_t>(globalOffsetBytes));
 
     for (uint32_t eid = 0; eid < currentEntityId; ++eid) {
@@ -56,33 +94,76 @@ void Encoder::encode(const Value& root, const std::string& filename) {
         auto offsetBinary = fixedEncodeNumber(offsetLong, globalOffsetBytes * 8);
         header.insert(header.end(), offsetBinary.begin(), offsetBinary.end());
     }
+    shapes.writeTable(header);
+    if (sharedStrings.used()) {
+        header.push_back(kSharedStringsSection);
+        compression.dictionary.appendString(sharedStrings.samples(), header);
+    }
+    if (!valueStrings.empty()) {
+        std::vector<uint8_t> values = valueStrings.serialize();
+        header.push_back(kValueStringsSection);
+        compression.dictionary.appendString(std::string_view(reinterpret_cast<const char*>(values.data()), values.size()), header);
+    }
 
-    auto headerSizeVarEncoded = varEncodeNumber(header.size());
-    
-    std::ofstream fout(filename, std::ios::binary);
-    fout.write(reinterpret_cast<const char*>(headerSizeVarEncoded.data()), headerSizeVarEncoded.size());
-    fout.write(reinterpret_cast<const char*>(header.data()), header.size());
-    fout.write(reinterpret_cast<const char*>(output.data()), output.size());
+    writer.finish(header, varEncodeNumber(header.size()));
 }
 
-void Encoder::encodeValue(const Value& value, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, Value>>& children) {
+void Encoder::encodeValue(const Value& value, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, const Value*>>& stack) {
     if (value.type() == ValueType::Object) {
-        encodeObject(std::get<Object>(value.data), id, output, children);
+        encodeObject(std::get<Object>(value.data), id, output, stack);
     } else if (value.type() == ValueType::List) {
-        encodeList(std::get<List>(value.data), id, output, children);
+        encodeList(std::get<List>(value.data), id, output, stack);
     }
 }
 
 std::vector<uint8_t> Encoder::encodeKey(const std::string& key){
+    return varEncodeNumber(internKey(key));
+}
+
+// Starts a fresh dictionary holding keys in sorted order, so that key IDs order like
+// the keys themselves and readers can compare IDs instead of strings.
+void Encoder::internSortedKeys(std::vector<std::string_view> keys) {
+    dictionary_list.clear();
+    dictionary_map.clear();
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    for (std::string_view key : keys) internKey(std::string(key));
+}
+
+void Encoder::internSortedKeys(const Value& root) {
+    std::unordered_set<std::string_view> seen;
+    std::vector<std::string_view> keys;
+    std::vector<const Value*> stack{&root};
+    while (!stack.empty()) {
+        const Value* value = stack.back();
+        stack.pop_back();
+        if (value->type() == ValueType::Object) {
+            for (const auto& kvPair : std::get<Object>(value->data).fields) {
+                if (seen.insert(kvPair.first).second) keys.push_back(kvPair.first);
+                if (kvPair.second.type() == ValueType::Object || kvPair.second.type() == ValueType::List) {
+                    stack.push_back(&kvPair.second);
+                }
+            }
+        } else if (value->type() == ValueType::List) {
+            for (const auto& element : std::get<List>(value->data).elements) {
+                if (element.type() == ValueType::Object || element.type() == ValueType::List) {
+                    stack.push_back(&element);
+                }
+            }
+        }
+    }
+    internSortedKeys(std::move(keys));
+}
+
+uint64_t Encoder::internKey(const std::string& key){
     auto it = dictionary_map.find(key);
     if (it != dictionary_map.end()) {
-        return varEncodeNumber(it->second);
-    } else {
-        uint64_t index = dictionary_list.size();
-        dictionary_list.push_back(key);
-        dictionary_map[key] = index;
-        return varEncodeNumber(index);
+        return it->second;
     }
+    uint64_t index = dictionary_list.size();
+    dictionary_list.push_back(key);
+    dictionary_map[key] = index;
+    return index;
 }
 
 void Encoder::encodePrimitive(const Value& value, std::vector<uint8_t>& out) {
@@ -101,62 +182,15 @@ void Encoder::encodePrimitive(const Value& value, std::vector<uint8_t>& out) {
             break;
         }
         case ValueType::Integer: {
-            int64_t n = std::get<int64_t>(value.data);
-            uint8_t meta = (n >= 0) ? ((n < 16) ? 0xC0 : 0xF0) : ((n > -16) ? 0xD0 : 0xF4);
-            int64_t abs_n = (n >= 0) ? n : -n;
-            if (abs_n < 16) {
-                out.push_back(meta | (abs_n & 0x0F));
-            } else {
-                out.push_back(meta);
-                if (abs_n <= UINT8_MAX) {
-                    out.push_back(static_cast<uint8_t>(abs_n));
-                } else if (abs_n <= UINT16_MAX) {
-                    out.back() |= 0x01;
-                    auto encodedInt = fixedEncodeNumber(abs_n, 16);
-                    out.insert(out.end(), encodedInt.begin(), encodedInt.end());
-                } else if (abs_n <= UINT32_MAX) {
-                    out.back() |= 0x02;
-                    auto encodedInt = fixedEncodeNumber(abs_n, 32);
-                    out.insert(out.end(), encodedInt.begin(), encodedInt.end());
-                } else {
-                    out.back() |= 0x03;
-                    auto encodedInt = fixedEncodeNumber(abs_n, 64);
-                    out.insert(out.end(), encodedInt.begin(), encodedInt.end());
-                }
-            }
+            encodeInteger(std::get<int64_t>(value.data), out);
             break;
         }
         case ValueType::String: {
-            const std::string& strData = std::get<std::string>(value.data);
-            if (strData.length() < 127) {
-                out.push_back(strData.length() & 0x7F);
-                out.insert(out.end(), strData.begin(), strData.end());
-            } else {
-                out.push_back(0x7F);
-                std::vector<uint8_t> bytes(strData.begin(), strData.end());
-                auto ogSize = varEncodeNumber(bytes.size());
-                bytes = compressBuffer(bytes);
-                auto compressedSize = varEncodeNumber(bytes.size());
-                out.insert(out.end(), compressedSize.begin(), compressedSize.end());
-                out.insert(out.end(), ogSize.begin(), ogSize.end());
-                out.insert(out.end(), bytes.begin(), bytes.end());
-            }
+            encodeString(std::get<std::string>(value.data), out);
             break;
         }
         case ValueType::Float: {
-            double f = std::get<double>(value.data);
-            if (f >= -FLT_MAX && f <= FLT_MAX) {
-                out.push_back(0xF8);
-                float f32 = static_cast<float>(f);
-                uint32_t bits;
-                std::memcpy(&bits, &f32, sizeof(float));
-                for (int i = 0; i < 4; ++i) out.push_back(static_cast<uint8_t>((bits >> (i * 8)) & 0xFF));
-            } else {
-                out.push_back(0xF9);
-                uint64_t bits;
-                std::memcpy(&bits, &f, sizeof(double));
-                for (int i = 0; i < 8; ++i) out.push_back(static_cast<uint8_t>((bits >> (i * 8)) & 0xFF));
-            }
+            encodeFloat(std::get<double>(value.data), out);
             break;
         }
         case ValueType::Custom: {
@@ -175,8 +209,62 @@ void Encoder::encodePrimitive(const Value& value, std::vector<uint8_t>& out) {
     }
 }
 
-void Encoder::encodeList(const List& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, Value>>& children) {
-    entityOffsetTable[id] = output.size();
+void Encoder::encodeInteger(int64_t n, std::vector<uint8_t>& out) {
+    uint8_t meta = (n >= 0) ? ((n < 16) ? 0xC0 : 0xF0) : ((n > -16) ? 0xD0 : 0xF4);
+    int64_t abs_n = (n >= 0) ? n : -n;
+    if (abs_n < 16) {
+        out.push_back(meta | (abs_n & 0x0F));
+    } else {
+        out.push_back(meta);
+        if (abs_n <= UINT8_MAX) {
+            out.push_back(static_cast<uint8_t>(abs_n));
+        } else if (abs_n <= UINT16_MAX) {
+            out.back() |= 0x01;
+            auto encodedInt = fixedEncodeNumber(abs_n, 16);
+            out.insert(out.end(), encodedInt.begin(), encodedInt.end());
+        } else if (abs_n <= UINT32_MAX) {
+            out.back() |= 0x02;
+            auto encodedInt = fixedEncodeNumber(abs_n, 32);
+            out.insert(out.end(), encodedInt.begin(), encodedInt.end());
+        } else {
+            out.back() |= 0x03;
+            auto encodedInt = fixedEncodeNumber(abs_n, 64);
+            out.insert(out.end(), encodedInt.begin(), encodedInt.end());
+        }
+    }
+}
+
+void Encoder::encodeString(std::string_view str, std::vector<uint8_t>& out) {
+    if (str.length() < 127) {
+        if ((compression.timestamps && encodeTimestamp(str, out)) || valueStrings.encode(str, out) || sharedStrings.compress(str, 1 + str.length(), out)) return;
+        out.push_back(str.length() & 0x7F);
+        out.insert(out.end(), str.begin(), str.end());
+    } else {
+        size_t start = out.size();
+        out.push_back(0x7F);
+        if (!stringStage.take(str, out)) compression.strings.appendString(str, out);
+        size_t plainSize = out.size() - start;
+        if (sharedStrings.compress(str, plainSize, out)) out.erase(out.begin() + start, out.begin() + start + plainSize);
+    }
+}
+
+void Encoder::encodeFloat(double f, std::vector<uint8_t>& out) {
+    if (f >= -FLT_MAX && f <= FLT_MAX) {
+        out.push_back(0xF8);
+        float f32 = static_cast<float>(f);
+        uint32_t bits;
+        std::memcpy(&bits, &f32, sizeof(float));
+        for (int i = 0; i < 4; ++i) out.push_back(static_cast<uint8_t>((bits >> (i * 8)) & 0xFF));
+    } else {
+        out.push_back(0xF9);
+        uint64_t bits;
+        std::memcpy(&bits, &f, sizeof(double));
+        for (int i = 0; i < 8; ++i) out.push_back(static_cast<uint8_t>((bits >> (i * 8)) & 0xFF));
+    }
+}
+
+void Encoder::encodeList(const List& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, const Value*>>& stack) {
+    if (columnar && encodeColumnar(entity, id, output, stack)) return;
 
     std::vector<uint8_t> dataValue;
     std::vector<long> offsetTableLong;
@@ -187,64 +275,278 @@ void Encoder::encodeList(const List& entity, long id, std::vector<uint8_t>& outp
             long childId = currentEntityId++;
             auto referenceCode = generateReferenceCode(value.type(), childId);
             dataValue.insert(dataValue.end(), referenceCode.begin(), referenceCode.end());
-            children.push_back({childId, value});
+            stack.push_back({childId, &value});
         } else {
             encodePrimitive(value, dataValue);
         }
     }
 
-    size_t length = entity.elements.size();
-    if (length < 127) {
-        output.push_back(0x80 | (length & 0x7F));
+    writeEntity(ValueType::List, id, offsetTableLong, dataValue, output);
+}
+
+void Encoder::encodeObject(const Object& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, const Value*>>& stack) {
+    std::vector<uint8_t> dataValue;
+    std::vector<long> offsetTableLong;
+
+    for (const auto& kvPair : entity.fields) {
+        offsetTableLong.push_back(dataValue.size());
+        
+        auto encodedKey = encodeKey(kvPair.first);
+        dataValue.insert(dataValue.end(), encodedKey.begin(), encodedKey.end());
+
+        const auto& value = kvPair.second;
+        if (value.type() == ValueType::List || value.type() == ValueType::Object) {
+            long childId = currentEntityId++;
+            auto referenceCode = generateReferenceCode(value.type(), childId);
+            dataValue.insert(dataValue.end(), referenceCode.begin(), referenceCode.end());
+            stack.push_back({childId, &value});
+        } else {
+            encodePrimitive(value, dataValue);
+        }
+    }
+
+    writeEntity(ValueType::Object, id, offsetTableLong, dataValue, output);
+}
+
+// Writes a list of objects as a ColumnarList, or returns false if it is not one: too
+// short, holding something other than objects, or without a key set shared by at
+// least half of its records.
+bool Encoder::encodeColumnar(const List& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, const Value*>>& stack) {
+    size_t rows = entity.elements.size();
+    if (rows < kMinColumnarRows) return false;
+
+    std::unordered_map<std::string, size_t> shapeCounts;
+    std::string shape;
+    size_t common = 0;
+    for (const auto& element : entity.elements) {
+        if (element.type() != ValueType::Object) return false;
+        shape.clear();
+        for (const auto& kvPair : std::get<Object>(element.data).fields) {
+            uint64_t key = internKey(kvPair.first);
+            shape.append(reinterpret_cast<const char*>(&key), sizeof(key));
+        }
+        common = std::max(common, ++shapeCounts[shape]);
+    }
+    if (common * 2 < rows) return false;
+
+    std::vector<uint64_t> keys;
+    for (const auto& entry : shapeCounts) {
+        for (size_t i = 0; i < entry.first.size(); i += sizeof(uint64_t)) {
+            uint64_t key;
+            std::memcpy(&key, entry.first.data() + i, sizeof(key));
+            keys.push_back(key);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    // Key IDs order like the keys, and so do each record's fields: one cursor per
+    // record walks its fields while the columns are filled in key order.
+    std::vector<size_t> cursors(rows, 0);
+    std::vector<const Value*> cells(rows);
+    std::vector<uint8_t> columns;
+    std::vector<long> columnOffsets;
+    for (uint64_t key : keys) {
+        const std::string& name = dictionary_list[key];
+        for (size_t r = 0; r < rows; ++r) {
+            const auto& fields = std::get<Object>(entity.elements[r].data).fields;
+            bool present = cursors[r] < fields.size() && fields[cursors[r]].first == name;
+            cells[r] = present ? &fields[cursors[r]++].second : nullptr;
+        }
+        columnOffsets.push_back(columns.size());
+        encodeColumn(cells, columns, stack);
+    }
+
+    entityOffsetTable[id] = writer.size() + output.size();
+    if (rows < 127) {
+        output.push_back(0x80 | static_cast<uint8_t>(rows));
     } else {
         output.push_back(0xFF);
-        auto varEncodedListLength = varEncodeNumber(length);
-        output.insert(output.end(), varEncodedListLength.begin(), varEncodedListLength.end());
+        auto varEncodedLength = varEncodeNumber(rows);
+        output.insert(output.end(), varEncodedLength.begin(), varEncodedLength.end());
     }
+    output.push_back(kColumnarTag);
+    appendVarint(keys.size(), output);
+    for (uint64_t key : keys) appendVarint(key, output);
 
-    int offsetByteCount = nearestBytes(dataValue.size());
+    int offsetByteCount = nearestBytes(columns.size());
     output.push_back(static_cast<uint8_t>(offsetByteCount));
+    for (long offset : columnOffsets) {
+        auto offsetEncoded = fixedEncodeNumber(offset, offsetByteCount * 8);
+        output.insert(output.end(), offsetEncoded.begin(), offsetEncoded.end());
+    }
+    output.insert(output.end(), columns.begin(), columns.end());
+    writer.flushIfFull(output);
+    return true;
+}
 
+// The first present cell if every present cell is a timestamp of one format, else null.
+// Checked up front, since encoding a string that turns out not to be one may already
+// have used up its result from the string stage.
+const Value* Encoder::timestampColumn(const std::vector<const Value*>& cells) {
+    const Value* first = nullptr;
+    uint8_t format = 0;
+    for (const Value* cell : cells) {
+        if (!cell) continue;
+        Timestamp t;
+        if (!parseTimestamp(cell->asString(), t) || (first && t.format != format)) return nullptr;
+        if (!first) {
+            first = cell;
+            format = t.format;
+        }
+    }
+    return first;
+}
+
+// One column of a ColumnarList; cells[r] is row r's value, or null if it lacks the key.
+// Integer, float, boolean and timestamp columns are packed, with placeholders in the
+// missing rows; anything else keeps an offset table over ordinary encoded values.
+void Encoder::encodeColumn(const std::vector<const Value*>& cells, std::vector<uint8_t>& out, std::vector<std::pair<long, const Value*>>& stack) {
+    size_t rows = cells.size();
+    std::vector<uint8_t> presence((rows + 7) / 8, 0);
+    bool complete = true;
+    ValueType kind = ValueType::Null;
+    bool uniform = true;
+    for (size_t r = 0; r < rows; ++r) {
+        if (!cells[r]) {
+            complete = false;
+            continue;
+        }
+        presence[r >> 3] |= uint8_t(1) << (r & 7);
+        if (kind == ValueType::Null) kind = cells[r]->type();
+        uniform = uniform && cells[r]->type() == kind;
+    }
+
+    out.push_back(complete ? 0 : 1);
+    if (!complete) out.insert(out.end(), presence.begin(), presence.end());
+
+    std::vector<uint8_t> dataValue;
+    std::vector<long> offsetTableLong;
+    const Value* firstTimestamp = uniform && kind == ValueType::String && compression.timestamps ? timestampColumn(cells) : nullptr;
+    if (uniform && (kind == ValueType::Integer || kind == ValueType::Float || kind == ValueType::Boolean || firstTimestamp)) {
+        Value placeholder = firstTimestamp ? *firstTimestamp : kind == ValueType::Integer ? Value(int64_t(0))
+                          : kind == ValueType::Float ? Value(0.0) : Value(false);
+        for (const Value* cell : cells) {
+            offsetTableLong.push_back(dataValue.size());
+            encodePrimitive(cell ? *cell : placeholder, dataValue);
+        }
+        uint8_t packedTag;
+        if (packList(offsetTableLong, dataValue, nearestBytes(dataValue.size()) * rows + dataValue.size(), packedTag, packedData)) {
+            out.push_back(packedTag);
+            out.insert(out.end(), packedData.begin(), packedData.end());
+            return;
+        }
+        dataValue.clear();
+        offsetTableLong.clear();
+    }
+
+    for (const Value* cell : cells) {
+        offsetTableLong.push_back(dataValue.size());
+        if (!cell) continue;
+        if (cell->type() == ValueType::List || cell->type() == ValueType::Object) {
+            long childId = currentEntityId++;
+            auto referenceCode = generateReferenceCode(cell->type(), childId);
+            dataValue.insert(dataValue.end(), referenceCode.begin(), referenceCode.end());
+            stack.push_back({childId, cell});
+        } else {
+            encodePrimitive(*cell, dataValue);
+        }
+    }
+
+    int offsetByteCount = nearestBytes(dataValue.size());
+    out.push_back(kColumnValues);
+    out.push_back(static_cast<uint8_t>(offsetByteCount));
     for (long offset : offsetTableLong) {
         auto offsetEncoded = fixedEncodeNumber(offset, offsetByteCount * 8);
-        output.insert(output.end(), offsetEncoded.begin(), offsetEncoded.end());
+        out.insert(out.end(), offsetEncoded.begin(), offsetEncoded.end());
     }
-    output.insert(output.end(), dataValue.begin(), dataValue.end());
+    out.insert(out.end(), dataValue.begin(), dataValue.end());
 }
 
-void Encoder::encodeObject(const Object& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, Value>>& children) {
-    entityOffsetTable[id] = output.size();
+void Encoder::encodeNode(const Node& node, long id, const NodeDocument& doc, std::vector<uint8_t>& output, std::vector<std::pair<long, const Node*>>& stack) {
+    if (node.type != ValueType::Object && node.type != ValueType::List) return;
 
     std::vector<uint8_t> dataValue;
     std::vector<long> offsetTableLong;
+    offsetTableLong.reserve(node.size);
 
-    for (const auto& kvPair : entity.fields) {
+    for (uint32_t i = 0; i < node.size; ++i) {
         offsetTableLong.push_back(dataValue.size());
-        
-        auto encodedKey = encodeKey(kvPair.first);
-        dataValue.insert(dataValue.end(), encodedKey.begin(), encodedKey.end());
 
-        const auto& value = kvPair.second;
-        if (value.type() == ValueType::List || value.type() == ValueType::Object) {
+        const Node* value;
+        if (node.type == ValueType::Object) {
+            uint32_t keyIdx = node.fields[i].key;
+            if (nodeKeyIds[keyIdx] == UINT64_MAX) nodeKeyIds[keyIdx] = internKey(std::string(doc.key(keyIdx)));
+            auto encodedKey = varEncodeNumber(nodeKeyIds[keyIdx]);
+            dataValue.insert(dataValue.end(), encodedKey.begin(), encodedKey.end());
+            value = &node.fields[i].value;
+        } else {
+            value = &node.elements[i];
+        }
+
+        if (value->type == ValueType::List || value->type == ValueType::Object) {
             long childId = currentEntityId++;
-            auto referenceCode = generateReferenceCode(value.type(), childId);
+            auto referenceCode = generateReferenceCode(value->type, childId);
             dataValue.insert(dataValue.end(), referenceCode.begin(), referenceCode.end());
-            children.push_back({childId, value});
+            stack.push_back({childId, value});
         } else {
-            encodePrimitive(value, dataValue);
+            encodeNodePrimitive(*value, dataValue);
         }
     }
 
-    size_t length = entity.fields.size();
+    writeEntity(node.type, id, offsetTableLong, dataValue, output);
+}
+
+void Encoder::encodeNodePrimitive(const Node& node, std::vector<uint8_t>& out) {
+    switch (node.type) {
+        case ValueType::Boolean: out.push_back(node.boolean ? 0xFF : 0xFE); break;
+        case ValueType::Null: out.push_back(0xFC); break;
+        case ValueType::Byte: out.push_back(0xFD); out.push_back(node.byte); break;
+        case ValueType::Integer: encodeInteger(node.integer, out); break;
+        case ValueType::String: encodeString(node.asString(), out); break;
+        case ValueType::Float: encodeFloat(node.real, out); break;
+        case ValueType::Custom: {
+            uint8_t meta = (node.aux < 15) ? (0xE0 | node.aux) : 0xEF;
+            out.push_back(meta);
+            if (node.aux >= 15) {
+                auto idVarEncoded = varEncodeNumber(node.aux);
+                out.insert(out.end(), idVarEncoded.begin(), idVarEncoded.end());
+            }
+            out.insert(out.end(), node.bytes, node.bytes + node.size);
+            break;
+        }
+        default:
+            throw std::runtime_error("Unsupported primitive type");
+    }
+}
+
+void Encoder::writeEntity(ValueType type, long id, const std::vector<long>& offsetTableLong, const std::vector<uint8_t>& dataValue, std::vector<uint8_t>& output) {
+    entityOffsetTable[id] = writer.size() + output.size();
+
+    size_t length = offsetTableLong.size();
     if (length < 127) {
-        output.push_back(length & 0x7F);
+        output.push_back((type == ValueType::List ? 0x80 : 0x00) | (length & 0x7F));
     } else {
-        output.push_back(0x7F);
-        auto varEncodedObjLength = varEncodeNumber(length);
-        output.insert(output.end(), varEncodedObjLength.begin(), varEncodedObjLength.end());
+        output.push_back(type == ValueType::List ? 0xFF : 0x7F);
+        auto varEncodedLength = varEncodeNumber(length);
+        output.insert(output.end(), varEncodedLength.begin(), varEncodedLength.end());
+    }
+
+    if (type == ValueType::Object && length > 0) {
+        shapes.writeObject(offsetTableLong, dataValue.data(), dataValue.size(), output);
+        writer.flushIfFull(output);
+        return;
     }
 
     int offsetByteCount = nearestBytes(dataValue.size());
+    uint8_t packedTag;
+    if (type == ValueType::List &&
+        packList(offsetTableLong, dataValue, offsetByteCount * length + dataValue.size(), packedTag, packedData)) {
+        output.push_back(packedTag);
+        output.insert(output.end(), packedData.begin(), packedData.end());
+        writer.flushIfFull(output);
+        return;
+    }
     output.push_back(static_cast<uint8_t>(offsetByteCount));
 
     for (long offset : offsetTableLong) {
@@ -252,6 +554,7 @@ void Encoder::encodeObject(const Object& entity, long id, std::vector<uint8_t>&
         output.insert(output.end(), offsetEncoded.begin(), offsetEncoded.end());
     }
     output.insert(output.end(), dataValue.begin(), dataValue.end());
+    writer.flushIfFull(output);
 }
 
 std::vector<uint8_t> Encoder::varEncodeNumber(uint64_t number) {
@@ -289,22 +592,10 @@ std::vector<uint8_t> Encoder::fixedEncodeNumber(long number, int bitCount) {
     return encoded;
 }
 
-std::vector<uint8_t> Encoder::compressBuffer(const std::vector<uint8_t>& input) {
-    if (input.empty()) return {};
-    int maxCompressedSize = LZ4_compressBound(input.size());
-    std::vector<uint8_t> compressed(maxCompressedSize);
-    int compressedSize = LZ4_compress_HC(
-        reinterpret_cast<const char*>(input.data()),
-        reinterpret_cast<char*>(compressed.data()),
-        static_cast<int>(input.size()),
-        maxCompressedSize,
-        LZ4HC_CLEVEL_MAX
-    );
-    if (compressedSize <= 0) {
-        throw std::runtime_error("LZ4-HC compression failed");
-    }
-    compressed.resize(compressedSize);
-    return compressed;
+std::vector<uint8_t> Encoder::compressBuffer(const std::vector<uint8_t>& input, const CompressionTier& tier) {
+    std::vector<uint8_t> stored;
+    tier.compress(input.data(), input.size(), stored);
+    return stored;
 }
 
 std::vector<uint8_t> Encoder::generateReferenceCode(ValueType type, long id){
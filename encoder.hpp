@@ -1,10 +1,15 @@
 #pragma once
 
 #include "datastruct.hpp"
+#include "arena.hpp"
+#include "chunk_writer.hpp"
+#include "compression.hpp"
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdint>
 #include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <utility>
 #include <cfloat>
@@ -19,27 +24,79 @@
 
 class Encoder {
 public:
-    Encoder() : currentEntityId(0), masterOffset(0) {}
+    Encoder() : currentEntityId(0), masterOffset(0), layout(FileLayout::Trailer), blockSize(0), columnar(false) {}
     void encode(const Value& root, const std::string& filename);
+    void encode(const NodeDocument& doc, const std::string& filename);
 
-private:
+    // Trailer (v2) by default; Header writes the original v1 layout.
+    void setLayout(FileLayout fileLayout) { layout = fileLayout; }
+
+    // Block-compresses the data region in blocks of this many uncompressed bytes
+    // (v2 only); 0, the default, leaves it uncompressed. See BlockTable.
+    void setBlockSize(size_t bytes) { blockSize = bytes; }
+
+    // Compression tier for long strings, the dictionary and data blocks. Long strings
+    // of a Value tree are compressed by a CompressionStage running alongside the encode.
+    // Shared strings and the value dictionary are only collected from Value trees.
+    void setCompression(const CompressionOptions& options) { compression = options; }
+    const CompressionStats& compressionStats() const { return stringStage.stats(); }
+
+    // Writes lists of objects that mostly share one key set column by column (see
+    // ColumnarList). Off by default; only encode(const Value&) honours it.
+    void setColumnar(bool enabled) { columnar = enabled; }
+
+protected:
     uint64_t currentEntityId;
     uint64_t masterOffset;
     std::unordered_map<long, long> entityOffsetTable;
 
+    // Entities are staged in the caller's output buffer and handed to writer in
+    // kFlushBytes pieces; offsets are relative to the start of the data region.
+    ChunkWriter writer;
+    FileLayout layout;
+    size_t blockSize;
+    CompressionOptions compression;
+    CompressionStage stringStage;
+    ValueStrings valueStrings;
+    SharedStrings sharedStrings;
+    bool columnar;
+
+    // Below this many records a columnar list saves too little to be worth it.
+    static constexpr size_t kMinColumnarRows = 8;
+
     std::vector<std::string> dictionary_list;
     std::unordered_map<std::string, uint64_t> dictionary_map;
 
-    void encodeValue(const Value& value, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, Value>>& children);
+    void encodeValue(const Value& value, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, const Value*>>& stack);
     void encodePrimitive(const Value& value, std::vector<uint8_t>& out);
-    void encodeList(const List& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, Value>>& children);
-    void encodeObject(const Object& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, Value>>& children);
+    void encodeInteger(int64_t n, std::vector<uint8_t>& out);
+    void encodeString(std::string_view str, std::vector<uint8_t>& out);
+    void encodeFloat(double f, std::vector<uint8_t>& out);
+    void encodeList(const List& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, const Value*>>& stack);
+    void encodeObject(const Object& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, const Value*>>& stack);
+    bool encodeColumnar(const List& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, const Value*>>& stack);
+    void encodeColumn(const std::vector<const Value*>& cells, std::vector<uint8_t>& out, std::vector<std::pair<long, const Value*>>& stack);
+    static const Value* timestampColumn(const std::vector<const Value*>& cells);
+
+    std::vector<uint64_t> nodeKeyIds;
+    void encodeNode(const Node& node, long id, const NodeDocument& doc, std::vector<uint8_t>& output, std::vector<std::pair<long, const Node*>>& stack);
+    void encodeNodePrimitive(const Node& node, std::vector<uint8_t>& out);
     
     std::vector<uint8_t> generateReferenceCode(ValueType type, long id);
     std::vector<uint8_t> encodeKey(const std::string& key);
+    uint64_t internKey(const std::string& key);
+    void internSortedKeys(std::vector<std::string_view> keys);
+    void internSortedKeys(const Value& root);
+
+    // Lists of only integers, floats, booleans or timestamps are written packed (see packList);
+    // non-empty objects are written against the key lists interned in shapes.
+    ShapeTable shapes;
+    std::vector<uint8_t> packedData;
+    void writeEntity(ValueType type, long id, const std::vector<long>& offsetTableLong, const std::vector<uint8_t>& dataValue, std::vector<uint8_t>& output);
+    void writeFile(std::vector<uint8_t>& output);
     
     std::vector<uint8_t> varEncodeNumber(uint64_t number);
     std::vector<uint8_t> fixedEncodeNumber(long number, int bitCount);
-    std::vector<uint8_t> compressBuffer(const std::vector<uint8_t>& input);
+    std::vector<uint8_t> compressBuffer(const std::vector<uint8_t>& input, const CompressionTier& tier);
     int nearestBytes(long n);
 };
\ No newline at end of file
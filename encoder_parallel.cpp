@@ -5,10 +5,11 @@
 #include <vector>
 #include <map>
 #include <queue>
+#include <deque>
 #include <functional>
 #include <thread>
 
-EncoderP::EncoderP() : pool_stop(false) {
+EncoderP::EncoderP() : pool_stop(false), layout(FileLayout::Trailer), blockSize(0) {
     init_pool();
 }
 
@@ -62,34 +63,62 @@ std::future<std::pair<long, std::vector<uint8_t>>> EncoderP::enqueue_task(std::f
     return res;
 }
 
-void EncoderP::serial_build_key(const std::string& key) {
-    std::lock_guard<std::mutex> lock(dictionary_mutex);
-    auto it = dictionary_map.find(key);
-    if (it == dictionary_map.end()) {
-        uint64_t index = dictionary_list.size();
-        dictionary_list.push_back(key);
-        dictionary_map[key] = index;
+// Collects the distinct keys of every object in parallel (each thread dedupes a
+// contiguous slice of the jobs), then numbers them in sorted order so that key IDs
+// order like the keys themselves and readers can compare IDs instead of strings.
+void EncoderP::build_dictionary(const std::vector<const Value*>& jobs) {
+    size_t thread_count = std::max<size_t>(1, std::min(pool_workers.size(), jobs.size()));
+    size_t slice = (jobs.size() + thread_count - 1) / thread_count;
+
+    std::vector<std::vector<std::string_view>> local_keys(thread_count);
+    auto collect = [&](size_t t) {
+        std::unordered_set<std::string_view> seen;
+        size_t end = std::min(jobs.size(), (t + 1) * slice);
+        for (size_t i = t * slice; i < end; ++i) {
+            if (jobs[i]->type() != ValueType::Object) continue;
+            for (const auto& kvPair : std::get<Object>(jobs[i]->data).fields) {
+                if (seen.insert(kvPair.first).second) local_keys[t].push_back(kvPair.first);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < thread_count; ++t) threads.emplace_back(collect, t);
+    collect(0);
+    for (auto& t : threads) t.join();
+
+    std::vector<std::string_view> keys;
+    for (const auto& local : local_keys) keys.insert(keys.end(), local.begin(), local.end());
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    frozen_keys.reserve(keys.size());
+    for (std::string_view key : keys) {
+        frozen_keys.emplace(key, dictionary_list.size());
+        encoded_keys.push_back(varEncodeNumber(dictionary_list.size()));
+        dictionary_list.emplace_back(key);
     }
 }
 
-std::vector<uint8_t> EncoderP::get_key_encoding(const std::string& key) {
-    auto it = dictionary_map.find(key);
-    if (it == dictionary_map.end()) {
+const std::vector<uint8_t>& EncoderP::get_key_encoding(const std::string& key) const {
+    auto it = frozen_keys.find(key);
+    if (it == frozen_keys.end()) {
          throw std::runtime_error("Key not found in dictionary: " + key);
     }
-    return varEncodeNumber(it->second);
+    return encoded_keys[it->second];
 }
 
-std::vector<uint8_t> EncoderP::parallel_encode_list(const List& entity, const std::map<const Value*, long>& id_map) {
+std::vector<uint8_t> EncoderP::parallel_encode_list(const List& entity, long id) {
     std::vector<uint8_t> output;
     std::vector<long> offsetTableLong;
     std::vector<uint8_t> dataValue;
+    long childId = id + 1;
 
     for (const auto& value : entity.elements) {
         offsetTableLong.push_back(dataValue.size());
         if (value.type() == ValueType::List || value.type() == ValueType::Object) {
-            long childId = id_map.at(&value);
             auto referenceCode = generateReferenceCode(value.type(), childId);
+            childId += subtree_sizes[childId];
             dataValue.insert(dataValue.end(), referenceCode.begin(), referenceCode.end());
         } else {
             encodePrimitive(value, dataValue);
@@ -106,6 +135,13 @@ std::vector<uint8_t> EncoderP::parallel_encode_list(const List& entity, const st
     }
 
     int offsetByteCount = nearestBytes(dataValue.size());
+    uint8_t packedTag;
+    std::vector<uint8_t> packedData;
+    if (packList(offsetTableLong, dataValue, offsetByteCount * length + dataValue.size(), packedTag, packedData)) {
+        output.push_back(packedTag);
+        output.insert(output.end(), packedData.begin(), packedData.end());
+        return output;
+    }
     output.push_back(static_cast<uint8_t>(offsetByteCount));
 
     for (long offset : offsetTableLong) {
@@ -116,21 +152,22 @@ std::vector<uint8_t> EncoderP::parallel_encode_list(const List& entity, const st
     return output;
 }
 
-std::vector<uint8_t> EncoderP::parallel_encode_object(const Object& entity, const std::map<const Value*, long>& id_map) {
+std::vector<uint8_t> EncoderP::parallel_encode_object(const Object& entity, long id) {
     std::vector<uint8_t> output;
     std::vector<long> offsetTableLong;
     std::vector<uint8_t> dataValue;
+    long childId = id + 1;
 
     for (const auto& kvPair : entity.fields) {
         offsetTableLong.push_back(dataValue.size());
         
-        auto encodedKey = get_key_encoding(kvPair.first); 
+        const auto& encodedKey = get_key_encoding(kvPair.first);
         dataValue.insert(dataValue.end(), encodedKey.begin(), encodedKey.end());
 
         const auto& value = kvPair.second;
         if (value.type() == ValueType::List || value.type() == ValueType::Object) {
-            long childId = id_map.at(&value); 
             auto referenceCode = generateReferenceCode(value.type(), childId);
+            childId += subtree_sizes[childId];
             dataValue.insert(dataValue.end(), referenceCode.begin(), referenceCode.end());
         } else {
             encodePrimitive(value, dataValue);
@@ -157,12 +194,12 @@ std::vector<uint8_t> EncoderP::parallel_encode_object(const Object& entity, cons
     return output;
 }
 
-std::pair<long, std::vector<uint8_t>> EncoderP::parallel_encode_value(const Value* value, long id, const std::map<const Value*, long>* id_map) {
+std::pair<long, std::vector<uint8_t>> EncoderP::parallel_encode_value(const Value* value, long id) {
     std::vector<uint8_t> data;
     if (value->type() == ValueType::Object) {
-        data = parallel_encode_object(std::get<Object>(value->data), *id_map);
+        data = parallel_encode_object(std::get<Object>(value->data), id);
     } else if (value->type() == ValueType::List) {
-        data = parallel_encode_list(std::get<List>(value->data), *id_map);
+        data = parallel_encode_list(std::get<List>(value->data), id);
     }
     return {id, std::move(data)};
 }
@@ -170,37 +207,35 @@ std::pair<long, std::vector<uint8_t>> EncoderP::parallel_encode_value(const Valu
 void EncoderP::encode(const Value& root, const std::string& filename) {
 
     dictionary_list.clear();
-    dictionary_map.clear();
+    frozen_keys.clear();
+    encoded_keys.clear();
     entityOffsetTable.clear();
+    shapes.clear();
 
-    std::map<const Value*, long> id_map;
     std::vector<const Value*> jobs;
+    std::vector<long> parents;
     
-    std::vector<const Value*> stack;
-    stack.push_back(&root);
+    std::vector<std::pair<const Value*, long>> stack;
+    stack.push_back({&root, -1});
     
     currentEntityId = 0;
 
     while(!stack.empty()){
-        const Value* value = stack.back();
+        const Value* value = stack.back().first;
+        long parent = stack.back().second;
         stack.pop_back();
 
-        if (id_map.count(value)) {
-            continue;
-        }
-
         long id = currentEntityId.fetch_add(1);
-        id_map[value] = id;
         jobs.push_back(value);
+        parents.push_back(parent);
 
         if (value->type() == ValueType::Object) {
             const auto& obj = std::get<Object>(value->data);
 
             for (int i = obj.fields.size() - 1; i >= 0; --i) {
-                serial_build_key(obj.fields[i].first); 
                 const auto& childVal = obj.fields[i].second;
                 if (childVal.type() == ValueType::Object || childVal.type() == ValueType::List) {
-                    stack.push_back(&childVal);
+                    stack.push_back({&childVal, id});
                 }
             }
         } else if (value->type() == ValueType::List) {
@@ -209,36 +244,54 @@ void EncoderP::encode(const Value& root, const std::string& filename) {
             for (int i = list.elements.size() - 1; i >= 0; --i) {
                 const auto& childVal = list.elements[i];
                 if (childVal.type() == ValueType::Object || childVal.type() == ValueType::List) {
-                    stack.push_back(&childVal);
+                    stack.push_back({&childVal, id});
                 }
             }
         }
     }
 
+    // Children always have higher IDs than their parent, so one backwards sweep
+    // folds every subtree into its parent's count.
+    subtree_sizes.assign(jobs.size(), 1);
+    for (size_t id = jobs.size() - 1; id > 0; --id) {
+        subtree_sizes[parents[id]] += subtree_sizes[id];
+    }
+    parents.clear();
+    parents.shrink_to_fit();
+
     long totalEntities = currentEntityId; 
 
-    std::vector<std::future<std::pair<long, std::vector<uint8_t>>>> tasks;
-    for (long id = 0; id < totalEntities; ++id) {
+    build_dictionary(jobs);
+    valueStrings.collect(root, compression.valueStrings, compression.timestamps);
+    sharedStrings.collect(root, compression.sharedStrings, compression.strings, valueStrings, compression.timestamps);
+
+    writer.open(filename, layout, blockSize, compression.blocks);
+    stringStage.start(root, compression.strings);
+
+    auto submit = [this, &jobs](long id) {
         const Value* v = jobs[id];
-        tasks.push_back(enqueue_task([this, v, id, &id_map]() {
-            return this->parallel_encode_value(v, id, &id_map);
-        }));
-    }
+        return enqueue_task([this, v, id]() {
+            return this->parallel_encode_value(v, id);
+        });
+    };
 
-    std::map<long, std::vector<uint8_t>> results;
-    for(auto& f : tasks) {
-        auto pair = f.get();
-        results[pair.first] = std::move(pair.second);
+    long window = static_cast<long>(window_per_worker * pool_workers.size());
+    std::deque<std::future<std::pair<long, std::vector<uint8_t>>>> pending;
+    long nextSubmit = 0;
+    for (; nextSubmit < totalEntities && nextSubmit < window; ++nextSubmit) {
+        pending.push_back(submit(nextSubmit));
     }
 
-    std::vector<uint8_t> output;
-    output.reserve(1024 * 1024);
-
     for (long i = 0; i < totalEntities; ++i) {
-        entityOffsetTable[i] = output.size();
-        auto& chunk = results.at(i);
-        output.insert(output.end(), std::make_move_iterator(chunk.begin()), std::make_move_iterator(chunk.end()));
+        auto chunk = pending.front().get().second;
+        pending.pop_front();
+        if (nextSubmit < totalEntities) pending.push_back(submit(nextSubmit++));
+
+        shapeObject(chunk);
+        entityOffsetTable[i] = writer.size();
+        writer.write(chunk);
     }
+    stringStage.stop();
 
     std::vector<uint8_t> header;
     header.reserve(4096);
@@ -258,7 +311,7 @@ void EncoderP::encode(const Value& root, const std::string& filename) {
         header.insert(header.end(), dictionaryBuffer.begin(), dictionaryBuffer.end());
     } else {
         auto ogSizeVec = varEncodeNumber(dictionaryBuffer.size());
-        auto compressedDict = compressBuffer(dictionaryBuffer);
+        auto compressedDict = compressBuffer(dictionaryBuffer, compression.dictionary);
         auto compressedSizeVec = varEncodeNumber(compressedDict.size());
 
         header.push_back(0xFF);
@@ -267,7 +320,7 @@ void EncoderP::encode(const Value& root, const std::string& filename) {
         header.insert(header.end(), compressedDict.begin(), compressedDict.end());
     }
 
-    auto globalOffsetBytes = nearestBytes(output.size());
+    auto globalOffsetBytes = nearestBytes(writer.size());
     header.push_back(static_cast<uint8_t>(globalOffsetBytes));
 
     for (uint32_t eid = 0; eid < totalEntities; ++eid) {
@@ -275,26 +328,42 @@ void EncoderP::encode(const Value& root, const std::string& filename) {
         auto offsetBinary = fixedEncodeNumber(offsetLong, globalOffsetBytes * 8);
         header.insert(header.end(), offsetBinary.begin(), offsetBinary.end());
     }
+    shapes.writeTable(header);
+    if (sharedStrings.used()) {
+        header.push_back(kSharedStringsSection);
+        compression.dictionary.appendString(sharedStrings.samples(), header);
+    }
+    if (!valueStrings.empty()) {
+        std::vector<uint8_t> values = valueStrings.serialize();
+        header.push_back(kValueStringsSection);
+        compression.dictionary.appendString(std::string_view(reinterpret_cast<const char*>(values.data()), values.size()), header);
+    }
 
-    auto headerSizeVarEncoded = varEncodeNumber(header.size());
-    
-    std::ofstream fout(filename, std::ios::binary);
-    fout.write(reinterpret_cast<const char*>(headerSizeVarEncoded.data()), headerSizeVarEncoded.size());
-    fout.write(reinterpret_cast<const char*>(header.data()), header.size());
-    fout.write(reinterpret_cast<const char*>(output.data()), output.size());
+    writer.finish(header, varEncodeNumber(header.size()));
 }
 
-std::vector<uint8_t> EncoderP::encodeKey(const std::string& key){
-    std::lock_guard<std::mutex> lock(dictionary_mutex);
-    auto it = dictionary_map.find(key);
-    if (it != dictionary_map.end()) {
-        return varEncodeNumber(it->second);
-    } else {
-        uint64_t index = dictionary_list.size();
-        dictionary_list.push_back(key);
-        dictionary_map[key] = index;
-        return varEncodeNumber(index);
+void EncoderP::shapeObject(std::vector<uint8_t>& chunk) {
+    if (chunk.empty() || (chunk[0] & 0x80) != 0) return;
+
+    const uint8_t* begin = chunk.data();
+    const uint8_t* end = begin + chunk.size();
+    const uint8_t* p = begin + 1;
+    uint64_t count = chunk[0];
+    if (count == 0x7F) count = readVarint(p, end);
+    if (count == 0) return;
+
+    size_t prefixSize = p - begin;
+    uint8_t width = *p++;
+    shapeOffsets.resize(count);
+    for (uint64_t i = 0; i < count; ++i, p += width) {
+        uint64_t offset = 0;
+        std::memcpy(&offset, p, width);
+        shapeOffsets[i] = static_cast<long>(offset);
     }
+
+    shapedChunk.assign(begin, begin + prefixSize);
+    shapes.writeObject(shapeOffsets, p, end - p, shapedChunk);
+    chunk.swap(shapedChunk);
 }
 
 void EncoderP::encodePrimitive(const Value& value, std::vector<uint8_t>& out) {
@@ -341,17 +410,16 @@ void EncoderP::encodePrimitive(const Value& value, std::vector<uint8_t>& out) {
         case ValueType::String: {
             const std::string& strData = std::get<std::string>(value.data);
             if (strData.length() < 127) {
+                if ((compression.timestamps && encodeTimestamp(strData, out)) || valueStrings.encode(strData, out) ||
+                    sharedStrings.compress(strData, 1 + strData.length(), out)) break;
                 out.push_back(strData.length() & 0x7F);
                 out.insert(out.end(), strData.begin(), strData.end());
             } else {
+                size_t start = out.size();
                 out.push_back(0x7F);
-                std::vector<uint8_t> bytes(strData.begin(), strData.end());
-                auto ogSize = varEncodeNumber(bytes.size());
-                bytes = compressBuffer(bytes);
-                auto compressedSize = varEncodeNumber(bytes.size());
-                out.insert(out.end(), compressedSize.begin(), compressedSize.end());
-                out.insert(out.end(), ogSize.begin(), ogSize.end());
-                out.insert(out.end(), bytes.begin(), bytes.end());
+                if (!stringStage.take(strData, out)) compression.strings.appendString(strData, out);
+                size_t plainSize = out.size() - start;
+                if (sharedStrings.compress(strData, plainSize, out)) out.erase(out.begin() + start, out.begin() + start + plainSize);
             }
             break;
         }
@@ -422,22 +490,10 @@ std::vector<uint8_t> EncoderP::fixedEncodeNumber(long number, int bitCount) {
     return encoded;
 }
 
-std::vector<uint8_t> EncoderP::compressBuffer(const std::vector<uint8_t>& input) {
-    if (input.empty()) return {};
-    int maxCompressedSize = LZ4_compressBound(input.size());
-    std::vector<uint8_t> compressed(maxCompressedSize);
-    int compressedSize = LZ4_compress_HC(
-        reinterpret_cast<const char*>(input.data()),
-        reinterpret_cast<char*>(compressed.data()),
-        static_cast<int>(input.size()),
-        maxCompressedSize,
-        LZ4HC_CLEVEL_MAX
-    );
-    if (compressedSize <= 0) {
-        throw std::runtime_error("LZ4-HC compression failed");
-    }
-    compressed.resize(compressedSize);
-    return compressed;
+std::vector<uint8_t> EncoderP::compressBuffer(const std::vector<uint8_t>& input, const CompressionTier& tier) {
+    std::vector<uint8_t> stored;
+    tier.compress(input.data(), input.size(), stored);
+    return stored;
 }
 
 std::vector<uint8_t> EncoderP::generateReferenceCode(ValueType type, long id){
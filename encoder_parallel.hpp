@@ -1,10 +1,14 @@
 #pragma once
 
 #include "datastruct.hpp"
+#include "chunk_writer.hpp"
+#include "compression.hpp"
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdint>
 #include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <utility>
 #include <cfloat>
@@ -31,6 +35,18 @@ public:
     
     void encode(const Value& root, const std::string& filename);
 
+    // Trailer (v2) by default; Header writes the original v1 layout.
+    void setLayout(FileLayout fileLayout) { layout = fileLayout; }
+
+    // Block-compresses the data region in blocks of this many uncompressed bytes
+    // (v2 only); 0, the default, leaves it uncompressed. See BlockTable.
+    void setBlockSize(size_t bytes) { blockSize = bytes; }
+
+    // Compression tier for long strings, the dictionary and data blocks. Long strings
+    // are compressed by a CompressionStage, so workers rarely stall on one.
+    void setCompression(const CompressionOptions& options) { compression = options; }
+    const CompressionStats& compressionStats() const { return stringStage.stats(); }
+
 private:
     std::vector<std::thread> pool_workers;
     std::queue<std::packaged_task<std::pair<long, std::vector<uint8_t>>()>> pool_tasks;
@@ -44,26 +60,51 @@ private:
 
     std::atomic<long> currentEntityId;
     std::unordered_map<long, long> entityOffsetTable;
-    std::mutex dictionary_mutex;
 
+    // Encoded entities are written in ID order as they complete; at most
+    // window_per_worker * workers of them are queued or waiting to be written.
+    static constexpr size_t window_per_worker = 64;
+    ChunkWriter writer;
+    FileLayout layout;
+    size_t blockSize;
+    CompressionOptions compression;
+    CompressionStage stringStage;
+    ValueStrings valueStrings;
+    SharedStrings sharedStrings;
+
+    // Built once per encode by build_dictionary, then only read by the workers.
+    // Keys are views into the source Value tree, which outlives the encode call.
     std::vector<std::string> dictionary_list;
-    std::unordered_map<std::string, uint64_t> dictionary_map;
+    std::unordered_map<std::string_view, uint64_t> frozen_keys;
+    std::vector<std::vector<uint8_t>> encoded_keys;
+
+    // IDs are handed out in pre-order, so a container's first child is id + 1 and
+    // each later child follows the previous child's whole subtree. subtree_sizes[id]
+    // counts the containers under (and including) entity id.
+    std::vector<long> subtree_sizes;
+
+    // Shape IDs are handed out on the writer thread, in entity order, so output stays
+    // deterministic; workers encode objects in the plain keyed form and shapeObject
+    // rewrites them as they are written.
+    ShapeTable shapes;
+    std::vector<long> shapeOffsets;
+    std::vector<uint8_t> shapedChunk;
+    void shapeObject(std::vector<uint8_t>& chunk);
 
     void encodeValue(const Value& value, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, Value>>& children);
     void encodeList(const List& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, Value>>& children);
     void encodeObject(const Object& entity, long id, std::vector<uint8_t>& output, std::vector<std::pair<long, Value>>& children);
-    std::vector<uint8_t> encodeKey(const std::string& key);
 
-    void serial_build_key(const std::string& key);
-    std::vector<uint8_t> get_key_encoding(const std::string& key);
-    std::vector<uint8_t> parallel_encode_list(const List& entity, const std::map<const Value*, long>& id_map);
-    std::vector<uint8_t> parallel_encode_object(const Object& entity, const std::map<const Value*, long>& id_map);
-    std::pair<long, std::vector<uint8_t>> parallel_encode_value(const Value* value, long id, const std::map<const Value*, long>* id_map);
+    void build_dictionary(const std::vector<const Value*>& jobs);
+    const std::vector<uint8_t>& get_key_encoding(const std::string& key) const;
+    std::vector<uint8_t> parallel_encode_list(const List& entity, long id);
+    std::vector<uint8_t> parallel_encode_object(const Object& entity, long id);
+    std::pair<long, std::vector<uint8_t>> parallel_encode_value(const Value* value, long id);
     
     void encodePrimitive(const Value& value, std::vector<uint8_t>& out);
     std::vector<uint8_t> generateReferenceCode(ValueType type, long id);
     std::vector<uint8_t> varEncodeNumber(uint64_t number);
     std::vector<uint8_t> fixedEncodeNumber(long number, int bitCount);
-    std::vector<uint8_t> compressBuffer(const std::vector<uint8_t>& input);
+    std::vector<uint8_t> compressBuffer(const std::vector<uint8_t>& input, const CompressionTier& tier);
     int nearestBytes(long n);
 };
\ No newline at end of file
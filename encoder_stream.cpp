@@ -0,0 +1,147 @@
+#include "encoder_stream.hpp"
+
+void StreamEncoder::encode(const std::string& jsonFile, const std::string& filename) {
+    simdjson::ondemand::parser parser;
+    simdjson::padded_string json = simdjson::padded_string::load(jsonFile);
+    simdjson::ondemand::document doc = parser.iterate(json);
+
+    std::vector<uint8_t> output;
+    output.reserve(ChunkWriter::kFlushBytes);
+    writer.open(filename, layout, blockSize, compression.blocks);
+
+    // Keys are only discovered while streaming, so this dictionary stays in
+    // first-seen order; readers rank it themselves when it is not sorted.
+    dictionary_list.clear();
+    dictionary_map.clear();
+    shapes.clear();
+    currentEntityId = 1;
+    depth = 0;
+
+    switch (doc.type()) {
+        case simdjson::ondemand::json_type::object:
+            streamObject(doc.get_object(), 0, output);
+            break;
+        case simdjson::ondemand::json_type::array:
+            streamList(doc.get_array(), 0, output);
+            break;
+        default:
+            throw std::runtime_error("Root JSON value must be an object or array");
+    }
+
+    writeFile(output);
+}
+
+StreamEncoder::StreamFrame& StreamEncoder::enterFrame() {
+    if (depth == frames.size()) frames.emplace_back();
+    StreamFrame& frame = frames[depth++];
+    frame.data.clear();
+    frame.sorted.clear();
+    frame.offsets.clear();
+    frame.fields.clear();
+    frame.keys.clear();
+    frame.byKey.clear();
+    frame.superseded.clear();
+    return frame;
+}
+
+void StreamEncoder::streamValue(simdjson::ondemand::value value, std::vector<uint8_t>& data, std::vector<uint8_t>& output) {
+    switch (value.type()) {
+        case simdjson::ondemand::json_type::object: {
+            long childId = currentEntityId++;
+            auto referenceCode = generateReferenceCode(ValueType::Object, childId);
+            data.insert(data.end(), referenceCode.begin(), referenceCode.end());
+            streamObject(value.get_object(), childId, output);
+            break;
+        }
+        case simdjson::ondemand::json_type::array: {
+            long childId = currentEntityId++;
+            auto referenceCode = generateReferenceCode(ValueType::List, childId);
+            data.insert(data.end(), referenceCode.begin(), referenceCode.end());
+            streamList(value.get_array(), childId, output);
+            break;
+        }
+        case simdjson::ondemand::json_type::string: {
+            encodeString(value.get_string(), data);
+            break;
+        }
+        case simdjson::ondemand::json_type::number: {
+            switch (value.get_number_type()) {
+                case simdjson::ondemand::number_type::signed_integer:
+                    encodeInteger(value.get_int64(), data);
+                    break;
+                case simdjson::ondemand::number_type::unsigned_integer:
+                    encodeInteger(static_cast<int64_t>(value.get_uint64().value()), data);
+                    break;
+                default:
+                    encodeFloat(value.get_double(), data);
+                    break;
+            }
+            break;
+        }
+        case simdjson::ondemand::json_type::boolean: {
+            data.push_back(value.get_bool() ? 0xFF : 0xFE);
+            break;
+        }
+        case simdjson::ondemand::json_type::null: {
+            data.push_back(0xFC);
+            break;
+        }
+        default:
+            throw std::runtime_error("Unsupported JSON value type");
+    }
+}
+
+void StreamEncoder::streamList(simdjson::ondemand::array array, long id, std::vector<uint8_t>& output) {
+    StreamFrame& frame = enterFrame();
+
+    for (simdjson::ondemand::value element : array) {
+        frame.offsets.push_back(frame.data.size());
+        streamValue(element, frame.data, output);
+    }
+
+    writeEntity(ValueType::List, id, frame.offsets, frame.data, output);
+    --depth;
+}
+
+void StreamEncoder::streamObject(simdjson::ondemand::object object, long id, std::vector<uint8_t>& output) {
+    StreamFrame& frame = enterFrame();
+
+    // On duplicate keys the last one wins, as with nlohmann::json. Which occurrence is
+    // the last is only known once every key has been seen, so the keys are read in a
+    // first pass; earlier duplicates are then skipped unread, before any list or object
+    // inside them is given an ID and written.
+    for (auto field : object) frame.keys.push_back(internKey(std::string(field.unescaped_key().value())));
+    frame.byKey.resize(frame.keys.size());
+    for (size_t i = 0; i < frame.keys.size(); ++i) frame.byKey[i] = i;
+    std::stable_sort(frame.byKey.begin(), frame.byKey.end(), [&](size_t a, size_t b) {
+        return dictionary_list[frame.keys[a]] < dictionary_list[frame.keys[b]];
+    });
+    frame.superseded.assign(frame.keys.size(), 0);
+    for (size_t i = 0; i + 1 < frame.byKey.size(); ++i) {
+        if (frame.keys[frame.byKey[i]] == frame.keys[frame.byKey[i + 1]]) frame.superseded[frame.byKey[i]] = 1;
+    }
+
+    object.reset();
+    frame.fields.resize(frame.keys.size());
+    size_t index = 0;
+    for (auto field : object) {
+        size_t i = index++;
+        if (frame.superseded[i]) continue;
+        frame.fields[i].begin = frame.data.size();
+        streamValue(field.value(), frame.data, output);
+        frame.fields[i].end = frame.data.size();
+    }
+
+    // Objects are stored sorted by key, the order byKey is in.
+    for (size_t i : frame.byKey) {
+        if (frame.superseded[i]) continue;
+        const auto& field = frame.fields[i];
+        frame.offsets.push_back(frame.sorted.size());
+        auto encodedKey = varEncodeNumber(frame.keys[i]);
+        frame.sorted.insert(frame.sorted.end(), encodedKey.begin(), encodedKey.end());
+        frame.sorted.insert(frame.sorted.end(), frame.data.begin() + field.begin, frame.data.begin() + field.end);
+    }
+
+    writeEntity(ValueType::Object, id, frame.offsets, frame.sorted, output);
+    --depth;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "encoder.hpp"
+#include "simdjson.h"
+#include <deque>
+#include <string>
+#include <vector>
+
+// Encodes a JSON file straight from simdjson On-Demand into the CHAOS entity
+// writer, without building a nlohmann::json document or a Value tree.
+// Only the entities that are still open (one per nesting level) are buffered;
+// children are written as soon as they close, so their IDs precede the parent's data.
+class StreamEncoder : public Encoder {
+public:
+    StreamEncoder() : depth(0) {}
+    void encode(const std::string& jsonFile, const std::string& filename);
+
+private:
+    struct StreamField {
+        size_t begin;
+        size_t end;
+    };
+
+    // An object's fields are indexed by their position in the JSON text: keys holds
+    // their key IDs, byKey the positions in key order, and superseded flags the ones a
+    // later duplicate key replaces.
+    struct StreamFrame {
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> sorted;
+        std::vector<long> offsets;
+        std::vector<StreamField> fields;
+        std::vector<uint64_t> keys;
+        std::vector<size_t> byKey;
+        std::vector<uint8_t> superseded;
+    };
+
+    std::deque<StreamFrame> frames;
+    size_t depth;
+
+    StreamFrame& enterFrame();
+    void streamValue(simdjson::ondemand::value value, std::vector<uint8_t>& data, std::vector<uint8_t>& output);
+    void streamObject(simdjson::ondemand::object object, long id, std::vector<uint8_t>& output);
+    void streamList(simdjson::ondemand::array array, long id, std::vector<uint8_t>& output);
+};
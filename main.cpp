@@ -1,8 +1,10 @@
 #include "encoder_parallel.hpp"
 #include "encoder.hpp"
+#include "encoder_stream.hpp"
 #include "decoder.cpp"
 #include "decoder_parallel.cpp"
 #include "selective_decoder.cpp"
+#include "view_decoder.cpp"
 #include "datastruct.hpp"
 #include "json.hpp"
 #include "simdjson.h"
@@ -18,6 +20,9 @@
 #include <string>
 #include <sstream>
 #include <ctime>
+#include <thread>
+#include <algorithm>
+#include <atomic>
 
 using json = nlohmann::json;
 
@@ -148,9 +153,14 @@ int main(int argc, char* argv[]) {
     if (argc < 3) {
         std::cerr << "Usage: " << argv[0] << " <mode> [options...]\n";
         std::cerr << "Modes:\n";
-        std::cerr << "  encode <serial|parallel> <input.json> <output.chaos>\n";
-        std::cerr << "  decode <serial|parallel|query> <input.chaos> [query_part1 ... [ | query_part1 ... ] ]\n";
+        std::cerr << "  encode <serial|parallel|stream|columnar> <input.json> <output.chaos> [v1|v2|blocked] [strings|dictionary|blocks=<tier>...] [shared[=<bytes>]] [values=<count>] [timestamps=on|off]\n";
+        std::cerr << "  decode <serial|parallel|arena|query|batch|column|view> <input.chaos> [query_part1 ... [ | query_part1 ... ] ]\n";
         std::cerr << "  metric <input.json> <output_base.chaos> [query_part1 ... [ | query_part1 ... ] ]\n";
+        std::cerr << "  scale <input.chaos> [max_threads]\n";
+        std::cerr << "  throughput <input.chaos> <max_threads> <query_part1> ... [ | query_part1 ... ]\n";
+        std::cerr << "  nested <output.chaos> [max_depth]\n";
+        std::cerr << "  compression <input.json> <output_base.chaos> [tier...]\n";
+        std::cerr << "Tiers: none, fast[:acceleration], hc[:level]\n";
         return 1;
     }
 
@@ -158,33 +168,81 @@ int main(int argc, char* argv[]) {
 
     try {
         if (mode == "encode") {
-            if (argc != 5) {
-                std::cerr << "Usage: " << argv[0] << " encode <serial|parallel> <input.json> <output.chaos>\n";
+            if (argc < 5) {
+                std::cerr << "Usage: " << argv[0] << " encode <serial|parallel|stream|columnar> <input.json> <output.chaos> [v1|v2|blocked] [strings|dictionary|blocks=<tier>...] [shared[=<bytes>]] [values=<count>] [timestamps=on|off]\n";
                 return 1;
             }
             std::string encoder_type = argv[2];
             std::string inputJsonFile = argv[3];
             std::string outputChaosFile = argv[4];
 
-            std::ifstream ifs(inputJsonFile);
-            if (!ifs) throw std::runtime_error("Failed to open JSON file: " + inputJsonFile);
-            json j;
-            ifs >> j;
-
-            Value rootValue = jsonToValue(j);
-            j = nullptr;
-
+            FileLayout layout = FileLayout::Trailer;
+            size_t blockSize = 0;
+            CompressionOptions compression;
+            for (int i = 5; i < argc; ++i) {
+                std::string option = argv[i];
+                size_t eq = option.find('=');
+                if (option == "shared") {
+                    compression.sharedStrings = SharedStrings::kDefaultSize;
+                } else if (option.compare(0, eq, "shared") == 0) {
+                    compression.sharedStrings = std::stoul(option.substr(eq + 1));
+                } else if (option.compare(0, eq, "values") == 0) {
+                    compression.valueStrings = std::stoul(option.substr(eq + 1));
+                } else if (option == "timestamps=on" || option == "timestamps=off") {
+                    compression.timestamps = option == "timestamps=on";
+                } else if (eq != std::string::npos) {
+                    std::string dataClass = option.substr(0, eq);
+                    CompressionTier tier = CompressionTier::parse(option.substr(eq + 1));
+                    if (dataClass == "strings") compression.strings = tier;
+                    else if (dataClass == "dictionary") compression.dictionary = tier;
+                    else if (dataClass == "blocks") compression.blocks = tier;
+                    else {
+                        std::cerr << "Invalid compression class: " << dataClass << ". Use 'strings', 'dictionary' or 'blocks'.\n";
+                        return 1;
+                    }
+                } else if (option == "v1") layout = FileLayout::Header;
+                else if (option == "blocked") blockSize = kDefaultBlockSize;
+                else if (option != "v2") {
+                    std::cerr << "Invalid format version: " << option << ". Use 'v1', 'v2' or 'blocked'.\n";
+                    return 1;
+                }
+            }
 
             auto tStart = std::chrono::high_resolution_clock::now();
 
-            if (encoder_type == "serial") {
-                Encoder encoderS;
-                encoderS.encode(rootValue, outputChaosFile);
-            } else if (encoder_type == "parallel") {
-                EncoderP encoderP;
-                encoderP.encode(rootValue, outputChaosFile);
+            if (encoder_type == "stream") {
+                StreamEncoder encoderSt;
+                encoderSt.setLayout(layout);
+                encoderSt.setBlockSize(blockSize);
+                encoderSt.setCompression(compression);
+                encoderSt.encode(inputJsonFile, outputChaosFile);
+            } else if (encoder_type == "serial" || encoder_type == "parallel" || encoder_type == "columnar") {
+                std::ifstream ifs(inputJsonFile);
+                if (!ifs) throw std::runtime_error("Failed to open JSON file: " + inputJsonFile);
+                json j;
+                ifs >> j;
+
+                Value rootValue = jsonToValue(j);
+                j = nullptr;
+
+                tStart = std::chrono::high_resolution_clock::now();
+
+                if (encoder_type == "serial" || encoder_type == "columnar") {
+                    Encoder encoderS;
+                    encoderS.setLayout(layout);
+                    encoderS.setBlockSize(blockSize);
+                    encoderS.setCompression(compression);
+                    encoderS.setColumnar(encoder_type == "columnar");
+                    encoderS.encode(rootValue, outputChaosFile);
+                } else {
+                    EncoderP encoderP;
+                    encoderP.setLayout(layout);
+                    encoderP.setBlockSize(blockSize);
+                    encoderP.setCompression(compression);
+                    encoderP.encode(rootValue, outputChaosFile);
+                }
             } else {
-                std::cerr << "Invalid encoder type: " << encoder_type << ". Use 'serial' or 'parallel'.\n";
+                std::cerr << "Invalid encoder type: " << encoder_type << ". Use 'serial', 'parallel', 'stream' or 'columnar'.\n";
                 return 1;
             }
 
@@ -197,7 +255,7 @@ int main(int argc, char* argv[]) {
 
         } else if (mode == "decode") {
             if (argc < 4) {
-                std::cerr << "Usage: " << argv[0] << " decode <serial|parallel|query> <input.chaos> [query...]\n";
+                std::cerr << "Usage: " << argv[0] << " decode <serial|parallel|arena|query|batch|column|view> <input.chaos> [query...]\n";
                 return 1;
             }
             std::string decoder_type = argv[2];
@@ -226,6 +284,16 @@ int main(int argc, char* argv[]) {
                           << " decoder. (" << formatDuration(tEnd - tStart) << ") ["
                           << getCurrentTimestamp() << "]\n";
 
+            } else if (decoder_type == "arena") {
+                MMapDecoderParallel decoderP;
+                NodeDocument doc = decoderP.decodeNodes(inputChaosFile);
+                auto tEnd = std::chrono::high_resolution_clock::now();
+                printValue(doc.toValue(), 0);
+                std::cout << std::endl;
+                std::cout << "Decoded '" << inputChaosFile << "' using " << decoder_type
+                          << " decoder. (" << formatDuration(tEnd - tStart) << ") ["
+                          << getCurrentTimestamp() << "]\n";
+
             } else if (decoder_type == "query") {
                 if (argc < 5) {
                      std::cerr << "Usage: " << argv[0] << " decode query <input.chaos> <query_part1> ... [ | <query_part1> ... ]\n";
@@ -257,8 +325,8 @@ int main(int argc, char* argv[]) {
                 MMapDecoderSelective decoderS;
                 Value firstResult;
                 auto tFirstStart = std::chrono::high_resolution_clock::now();
-                decoderS.setQuery(list_of_queries[0]);
-                firstResult = decoderS.decode(inputChaosFile); 
+                decoderS.load(inputChaosFile);
+                firstResult = decoderS.execute(decoderS.compile(list_of_queries[0]));
                 auto tFirstEnd = std::chrono::high_resolution_clock::now();
 
                 std::cout << "Query 1 (" << buildJsonPointer(list_of_queries[0]) << "):\n";
@@ -267,8 +335,8 @@ int main(int argc, char* argv[]) {
 
                 for (size_t i = 1; i < list_of_queries.size(); ++i) {
                     auto tSubsequentStart = std::chrono::high_resolution_clock::now();
-                    decoderS.setQuery(list_of_queries[i]);
-                    Value subsequentResult = decoderS.decodeWrapper(0); 
+                    CompiledQuery plan = decoderS.compile(list_of_queries[i]);
+                    Value subsequentResult = decoderS.execute(plan);
                     auto tSubsequentEnd = std::chrono::high_resolution_clock::now();
 
                     std::cout << "Query " << (i + 1) << " (" << buildJsonPointer(list_of_queries[i]) << "):\n";
@@ -278,8 +346,111 @@ int main(int argc, char* argv[]) {
                  std::cout << "Completed " << list_of_queries.size() << " queries [" << getCurrentTimestamp() << "]\n";
 
 
+            } else if (decoder_type == "batch") {
+                if (argc < 5) {
+                     std::cerr << "Usage: " << argv[0] << " decode batch <input.chaos> <query_part1> ... [ | <query_part1> ... ]\n";
+                     return 1;
+                }
+
+                std::vector<std::vector<std::string>> list_of_queries;
+                std::vector<std::string> current_query;
+                for (int i = 4; i < argc; ++i) {
+                    std::string arg = argv[i];
+                    if (arg == "|") {
+                        if (!current_query.empty()) {
+                            list_of_queries.push_back(current_query);
+                            current_query.clear();
+                        }
+                    } else {
+                        current_query.push_back(arg);
+                    }
+                }
+                if (!current_query.empty()) {
+                    list_of_queries.push_back(current_query);
+                }
+
+                MMapDecoderSelective decoderS;
+                decoderS.load(inputChaosFile);
+
+                auto tBatchStart = std::chrono::high_resolution_clock::now();
+                std::vector<CompiledQuery> plans;
+                plans.reserve(list_of_queries.size());
+                for (const auto& q : list_of_queries) plans.push_back(decoderS.compile(q));
+                std::vector<Value> results = decoderS.executeBatch(plans);
+                auto tBatchEnd = std::chrono::high_resolution_clock::now();
+
+                for (size_t i = 0; i < results.size(); ++i) {
+                    std::cout << "Query " << (i + 1) << " (" << buildJsonPointer(list_of_queries[i]) << "):\n";
+                    printValue(results[i], 0);
+                    std::cout << "\n---\n";
+                }
+                std::cout << "Completed " << results.size() << " queries as one batch ("
+                          << formatDuration(tBatchEnd - tBatchStart) << ") [" << getCurrentTimestamp() << "]\n";
+
+            } else if (decoder_type == "column") {
+                if (argc < 5) {
+                     std::cerr << "Usage: " << argv[0] << " decode column <input.chaos> <query_part1> ... (use * for every list element)\n";
+                     return 1;
+                }
+
+                std::vector<std::string> path(argv + 4, argv + argc);
+                MMapDecoderSelective decoderS;
+                decoderS.load(inputChaosFile);
+
+                auto tColumnStart = std::chrono::high_resolution_clock::now();
+                Column column = decoderS.executeColumn(decoderS.compile(path), 0);
+                auto tColumnEnd = std::chrono::high_resolution_clock::now();
+
+                static const char* kindNames[] = {"null", "integer", "float", "boolean", "string", "timestamp", "mixed"};
+                List rows;
+                rows.elements.reserve(column.rows);
+                for (size_t i = 0; i < column.rows; ++i) rows.add(column.row(i));
+                std::cout << "Column (" << buildJsonPointer(path) << "): "
+                          << kindNames[static_cast<int>(column.kind)] << ", " << column.rows << " rows\n";
+                printValue(rows.toValue(), 0);
+                std::cout << "\n---\n";
+                std::cout << "Completed column extraction (" << formatDuration(tColumnEnd - tColumnStart)
+                          << ") [" << getCurrentTimestamp() << "]\n";
+
+            } else if (decoder_type == "view") {
+                if (argc < 5) {
+                     std::cerr << "Usage: " << argv[0] << " decode view <input.chaos> <query_part1> ... [ | <query_part1> ... ]\n";
+                     return 1;
+                }
+
+                std::vector<std::vector<std::string>> list_of_queries;
+                std::vector<std::string> current_query;
+                for (int i = 4; i < argc; ++i) {
+                    std::string arg = argv[i];
+                    if (arg == "|") {
+                        if (!current_query.empty()) {
+                            list_of_queries.push_back(current_query);
+                            current_query.clear();
+                        }
+                    } else {
+                        current_query.push_back(arg);
+                    }
+                }
+                if (!current_query.empty()) {
+                    list_of_queries.push_back(current_query);
+                }
+
+                MMapDecoderView decoderV;
+                decoderV.load(inputChaosFile);
+
+                for (size_t i = 0; i < list_of_queries.size(); ++i) {
+                    auto tQueryStart = std::chrono::high_resolution_clock::now();
+                    ValueView result = decoderV.query(list_of_queries[i]);
+                    auto tQueryEnd = std::chrono::high_resolution_clock::now();
+
+                    std::cout << "Query " << (i + 1) << " (" << buildJsonPointer(list_of_queries[i]) << "):\n";
+                    printValue(result.toValue(), 0);
+                    std::cout << "\n(" << formatDuration(tQueryEnd - tQueryStart) << ")\n---\n";
+                }
+                std::cout << "Completed " << list_of_queries.size() << " queries [" << getCurrentTimestamp() << "]\n";
+
             } else {
-                 std::cerr << "Invalid decoder type: " << decoder_type << ". Use 'serial', 'parallel', or 'query'.\n";
+                 std::cerr << "Invalid decoder type: " << decoder_type << ". Use 'serial', 'parallel', 'arena', 'query', 'batch', 'column' or 'view'.\n";
                  return 1;
             }
 
@@ -310,10 +481,12 @@ int main(int argc, char* argv[]) {
 
             std::string chaosOutputFileS = outputChaosFileBase + "._s";
             std::string chaosOutputFileP = outputChaosFileBase + "._p";
+            std::string chaosOutputFileSt = outputChaosFileBase + "._st";
             std::string jsonOutputFile = outputChaosFileBase + ".json";
 
             Encoder encoderS;
             EncoderP encoderP;
+            StreamEncoder encoderSt;
             MMapDecoder decoder{};
             MMapDecoderParallel decoderP{};
             MMapDecoderSelective decoderS{};
@@ -334,6 +507,9 @@ int main(int argc, char* argv[]) {
             encoderS.encode(rootValue, chaosOutputFileS);
             auto tEncodeChaosEndS = std::chrono::high_resolution_clock::now();
 
+            encoderSt.encode(inputJsonFile, chaosOutputFileSt);
+            auto tEncodeChaosEndSt = std::chrono::high_resolution_clock::now();
+
             valueToJson = [&](const Value& v) -> json {
                  switch (v.type()) {
                     case ValueType::Null:    return nullptr;
@@ -372,10 +548,14 @@ int main(int argc, char* argv[]) {
             auto outP2 = decoderP.decode(chaosOutputFileP);
             auto tDecodeChaosEnd2 = std::chrono::high_resolution_clock::now();
 
+            MMapDecoderParallel decoderA{};
+            auto outA = decoderA.decodeNodes(chaosOutputFileP);
+            auto tDecodeArenaEnd = std::chrono::high_resolution_clock::now();
+
             Value firstChaosQueryResult;
             std::vector<Value> subsequentChaosQueryResults;
             std::vector<long long> chaosQueryTimesMs;
-            std::chrono::high_resolution_clock::time_point tChaosQueryEnd = tDecodeChaosEnd2; 
+            std::chrono::high_resolution_clock::time_point tChaosQueryEnd = tDecodeArenaEnd; 
 
             if (!list_of_queries.empty()) {
                 auto tChaosQueryStart = std::chrono::high_resolution_clock::now();
@@ -424,9 +604,11 @@ int main(int argc, char* argv[]) {
             auto parseTime         = std::chrono::duration_cast<std::chrono::milliseconds>(tParseEnd - tStart).count();
             auto encodeTimeP       = std::chrono::duration_cast<std::chrono::milliseconds>(tEncodeChaosEndP - tParseEnd).count();
             auto encodeTimeS       = std::chrono::duration_cast<std::chrono::milliseconds>(tEncodeChaosEndS - tEncodeChaosEndP).count();
-            auto writeJsonTime     = std::chrono::duration_cast<std::chrono::milliseconds>(tJsonWriteEnd - tEncodeChaosEndS).count();
+            auto encodeTimeSt      = std::chrono::duration_cast<std::chrono::milliseconds>(tEncodeChaosEndSt - tEncodeChaosEndS).count();
+            auto writeJsonTime     = std::chrono::duration_cast<std::chrono::milliseconds>(tJsonWriteEnd - tEncodeChaosEndSt).count();
             auto decodeTime        = std::chrono::duration_cast<std::chrono::milliseconds>(tDecodeChaosEnd - tJsonWriteEnd).count();
             auto decodeTimeP       = std::chrono::duration_cast<std::chrono::milliseconds>(tDecodeChaosEnd2 - tDecodeChaosEnd).count();
+            auto decodeTimeA       = std::chrono::duration_cast<std::chrono::milliseconds>(tDecodeArenaEnd - tDecodeChaosEnd2).count();
             
             auto decodeTimeS_first = chaosQueryTimesMs.empty() ? -1 : chaosQueryTimesMs[0];
             auto totalTime         = std::chrono::duration_cast<std::chrono::milliseconds>(tSimdjsonEnd - tStart).count();
@@ -435,11 +617,13 @@ int main(int argc, char* argv[]) {
             uintmax_t json_size = 0;
             uintmax_t chaos_size_s = 0;
             uintmax_t chaos_size_p = 0;
+            uintmax_t chaos_size_st = 0;
             double ratio_s = 0.0, ratio_p = 0.0;
             try {
                 json_size = std::filesystem::file_size(inputJsonFile);
                 if(std::filesystem::exists(chaosOutputFileS)) chaos_size_s = std::filesystem::file_size(chaosOutputFileS);
                 if(std::filesystem::exists(chaosOutputFileP)) chaos_size_p = std::filesystem::file_size(chaosOutputFileP);
+                if(std::filesystem::exists(chaosOutputFileSt)) chaos_size_st = std::filesystem::file_size(chaosOutputFileSt);
                 if (json_size > 0) {
                      if(chaos_size_s > 0) ratio_s = static_cast<double>(chaos_size_s) / json_size;
                      if(chaos_size_p > 0) ratio_p = static_cast<double>(chaos_size_p) / json_size;
@@ -454,8 +638,10 @@ int main(int argc, char* argv[]) {
                 {"json-encode-nlohmann-ms", writeJsonTime},
                 {"chaos-encode-serial-ms", encodeTimeS},
                 {"chaos-encode-parallel-ms", encodeTimeP},
+                {"chaos-encode-stream-ms", encodeTimeSt},
                 {"chaos-decode-serial-ms", decodeTime},
                 {"chaos-decode-parallel-ms", decodeTimeP},
+                {"chaos-decode-arena-ms", decodeTimeA},
                 {"chaos-decode-selective-first-ms", decodeTimeS_first},
                 {"json-query-simdjson-first-ms", simdjsonQueryTimesMs.empty() ? -1 : simdjsonQueryTimesMs[0]},
                 {"total-time-ms", totalTime}
@@ -477,6 +663,7 @@ int main(int argc, char* argv[]) {
                 {"json-bytes", json_size},
                 {"chaos-serial-bytes", chaos_size_s},
                 {"chaos-parallel-bytes", chaos_size_p},
+                {"chaos-stream-bytes", chaos_size_st},
                 {"chaos-ratio-serial", ratio_s},
                 {"chaos-ratio-parallel", ratio_p}
             };
@@ -510,13 +697,238 @@ int main(int argc, char* argv[]) {
             results_json["output-files"] = {
                 {"chaos-serial", chaosOutputFileS},
                 {"chaos-parallel", chaosOutputFileP},
+                {"chaos-stream", chaosOutputFileSt},
                 {"json-written-back", jsonOutputFile}
             };
 
             std::cout << std::setw(2) << results_json << std::endl;
 
+        } else if (mode == "scale") {
+            std::string inputChaosFile = argv[2];
+            unsigned maxThreads = (argc > 3) ? std::stoul(argv[3]) : std::thread::hardware_concurrency();
+            if (maxThreads == 0) maxThreads = 4;
+
+            std::vector<unsigned> threadCounts;
+            for (unsigned t = 1; t < maxThreads; t *= 2) threadCounts.push_back(t);
+            threadCounts.push_back(maxThreads);
+
+            json decodeTimes = json::object();
+            long long baselineUs = -1;
+            for (unsigned t : threadCounts) {
+                MMapDecoderParallel decoderP(t);
+                auto tStart = std::chrono::high_resolution_clock::now();
+                decoderP.decode(inputChaosFile);
+                auto tEnd = std::chrono::high_resolution_clock::now();
+                long long us = std::max<long long>(1, std::chrono::duration_cast<std::chrono::microseconds>(tEnd - tStart).count());
+                if (baselineUs < 0) baselineUs = us;
+                decodeTimes[std::to_string(t)] = {
+                    {"ms", us / 1000.0},
+                    {"speedup", static_cast<double>(baselineUs) / us}
+                };
+            }
+
+            json results_json = json::object();
+            results_json["input"] = inputChaosFile;
+            results_json["chaos-decode-parallel-threads"] = decodeTimes;
+            std::cout << std::setw(2) << results_json << std::endl;
+
+        } else if (mode == "throughput") {
+            // Query throughput of one shared ChaosFile served by 1..N threads, each
+            // with its own cursor, running the compiled queries for a fixed interval.
+            if (argc < 5) {
+                std::cerr << "Usage: " << argv[0] << " throughput <input.chaos> <max_threads> <query_part1> ... [ | <query_part1> ... ]\n";
+                return 1;
+            }
+            std::string inputChaosFile = argv[2];
+            unsigned maxThreads = std::stoul(argv[3]);
+            if (maxThreads == 0) maxThreads = std::thread::hardware_concurrency();
+            if (maxThreads == 0) maxThreads = 4;
+
+            std::vector<std::vector<std::string>> list_of_queries;
+            std::vector<std::string> current_query;
+            for (int i = 4; i < argc; ++i) {
+                std::string arg = argv[i];
+                if (arg == "|") {
+                    if (!current_query.empty()) {
+                        list_of_queries.push_back(current_query);
+                        current_query.clear();
+                    }
+                } else {
+                    current_query.push_back(arg);
+                }
+            }
+            if (!current_query.empty()) {
+                list_of_queries.push_back(current_query);
+            }
+
+            auto sharedFile = ChaosFile::open(inputChaosFile);
+            std::vector<CompiledQuery> plans;
+            {
+                MMapDecoderSelective cursor(sharedFile);
+                for (const auto& q : list_of_queries) {
+                    plans.push_back(cursor.compile(q));
+                    cursor.execute(plans.back());
+                }
+            }
+
+            std::vector<unsigned> threadCounts;
+            for (unsigned t = 1; t < maxThreads; t *= 2) threadCounts.push_back(t);
+            threadCounts.push_back(maxThreads);
+
+            json throughput = json::object();
+            double baselineQps = -1;
+            for (unsigned t : threadCounts) {
+                std::atomic<bool> stop(false);
+                std::vector<long long> counts(t, 0);
+                std::vector<std::thread> workers;
+                auto tStart = std::chrono::high_resolution_clock::now();
+                for (unsigned w = 0; w < t; ++w) {
+                    workers.emplace_back([&, w]() {
+                        MMapDecoderSelective cursor(sharedFile);
+                        long long executed = 0;
+                        while (!stop.load(std::memory_order_relaxed)) {
+                            for (const auto& plan : plans) cursor.execute(plan);
+                            executed += plans.size();
+                        }
+                        counts[w] = executed;
+                    });
+                }
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                stop = true;
+                for (auto& worker : workers) worker.join();
+                auto tEnd = std::chrono::high_resolution_clock::now();
+
+                long long total = 0;
+                for (long long c : counts) total += c;
+                double seconds = std::chrono::duration<double>(tEnd - tStart).count();
+                double qps = total / seconds;
+                if (baselineQps < 0) baselineQps = qps;
+                throughput[std::to_string(t)] = {
+                    {"queries-per-sec", qps},
+                    {"speedup", baselineQps > 0 ? qps / baselineQps : 0.0}
+                };
+            }
+
+            json results_json = json::object();
+            results_json["input"] = inputChaosFile;
+            results_json["queries"] = list_of_queries.size();
+            results_json["chaos-query-throughput-threads"] = throughput;
+            std::cout << std::setw(2) << results_json << std::endl;
+
+        } else if (mode == "compression") {
+            // Encodes the same document once per compression tier (applied to strings,
+            // the dictionary and, in a second, block-compressed file, the data blocks)
+            // and reports encode throughput, sizes and ratios for each. A third, columnar
+            // encode shows how many long strings the encoder had to compress itself.
+            if (argc < 4) {
+                std::cerr << "Usage: " << argv[0] << " compression <input.json> <output_base.chaos> [tier...]\n";
+                return 1;
+            }
+            std::string inputJsonFile = argv[2];
+            std::string outputChaosFileBase = argv[3];
+
+            std::vector<CompressionTier> tiers;
+            for (int i = 4; i < argc; ++i) tiers.push_back(CompressionTier::parse(argv[i]));
+            if (tiers.empty()) {
+                tiers = {CompressionTier::none(), CompressionTier::fast(), CompressionTier::fast(8),
+                         CompressionTier::hc(3), CompressionTier::hc(9), CompressionTier::hc()};
+            }
+
+            std::ifstream ifs(inputJsonFile);
+            if (!ifs) throw std::runtime_error("Failed to open JSON file: " + inputJsonFile);
+            json j;
+            ifs >> j;
+            Value rootValue = jsonToValue(j);
+            j = nullptr;
+            double inputMB = std::filesystem::file_size(inputJsonFile) / 1e6;
+
+            json results = json::object();
+            for (const auto& tier : tiers) {
+                json entry = json::object();
+                for (std::string layout : {"plain", "blocked", "columnar"}) {
+                    bool blocked = layout == "blocked";
+                    std::string outputFile = outputChaosFileBase + (blocked ? "._b" : layout == "columnar" ? "._c" : "._s");
+                    Encoder encoder;
+                    encoder.setCompression({tier, tier, tier});
+                    encoder.setBlockSize(blocked ? kDefaultBlockSize : 0);
+                    encoder.setColumnar(layout == "columnar");
+
+                    auto tStart = std::chrono::high_resolution_clock::now();
+                    encoder.encode(rootValue, outputFile);
+                    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tStart).count();
+
+                    MMapDecoder decoder;
+                    tStart = std::chrono::high_resolution_clock::now();
+                    decoder.decode(outputFile);
+                    double decodeSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tStart).count();
+
+                    auto bytes = std::filesystem::file_size(outputFile);
+                    const CompressionStats& stats = encoder.compressionStats();
+                    json result = {
+                        {"encode-ms", seconds * 1e3},
+                        {"encode-MBps", seconds > 0 ? inputMB / seconds : 0.0},
+                        {"decode-ms", decodeSeconds * 1e3},
+                        {"bytes", bytes},
+                        {"ratio", bytes ? inputMB * 1e6 / bytes : 0.0}
+                    };
+                    if (!blocked) {
+                        result["long-strings"] = stats.strings;
+                        result["long-strings-inline"] = stats.inlined;
+                        result["long-string-ratio"] = stats.storedBytes ? static_cast<double>(stats.rawBytes) / stats.storedBytes : 0.0;
+                    }
+                    entry[layout] = result;
+                }
+                results[tier.name()] = entry;
+            }
+
+            json results_json = json::object();
+            results_json["input"] = inputJsonFile;
+            results_json["input-bytes"] = std::filesystem::file_size(inputJsonFile);
+            results_json["chaos-compression-tiers"] = results;
+            std::cout << std::setw(2) << results_json << std::endl;
+
+        } else if (mode == "nested") {
+            std::string outputChaosFile = argv[2];
+            long maxDepth = (argc > 3) ? std::stol(argv[3]) : 16384;
+
+            // Encode time of {"level": i, "tags": [...], "child": {...}} chains of growing depth;
+            // a linear encoder keeps the per-level cost flat as depth doubles.
+            json encodeTimes = json::object();
+            for (long depth = 256; depth <= maxDepth; depth *= 2) {
+                Value rootValue;
+                for (long level = depth - 1; level >= 0; --level) {
+                    Object obj;
+                    obj.add("level", Value((int64_t)level));
+                    List tags;
+                    tags.add(Value("node-" + std::to_string(level)));
+                    obj.add("tags", tags.toValue());
+                    if (!rootValue.isNull()) obj.fields.insert(obj.fields.begin(), {"child", std::move(rootValue)});
+                    rootValue = Value(std::move(obj));
+                }
+
+                Encoder encoderS;
+                auto tStart = std::chrono::high_resolution_clock::now();
+                encoderS.encode(rootValue, outputChaosFile);
+                auto tEnd = std::chrono::high_resolution_clock::now();
+                auto us = std::chrono::duration_cast<std::chrono::microseconds>(tEnd - tStart).count();
+                encodeTimes[std::to_string(depth)] = {
+                    {"ms", us / 1000.0},
+                    {"us-per-level", static_cast<double>(us) / depth}
+                };
+
+                // Unwind iteratively so tearing down a deep chain doesn't recurse.
+                while (rootValue.isObject() && rootValue.asObject().fields.front().first == "child") {
+                    Value child = std::move(rootValue.asObject().fields.front().second);
+                    rootValue = std::move(child);
+                }
+            }
+
+            json results_json = json::object();
+            results_json["chaos-encode-serial-nested"] = encodeTimes;
+            std::cout << std::setw(2) << results_json << std::endl;
+
         } else {
-            std::cerr << "Invalid mode: " << mode << ". Use 'encode', 'decode', or 'metric'.\n";
+            std::cerr << "Invalid mode: " << mode << ". Use 'encode', 'decode', 'metric', 'scale', 'throughput', 'compression' or 'nested'.\n";
             return 1;
         }
 
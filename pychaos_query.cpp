@@ -1,17 +1,25 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <pybind11/numpy.h>
+#include <cmath>
 #include <chrono>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <thread>
+#include <future>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include "selective_decoder.cpp"
 #include "datastruct.hpp"
 #include "encoder_parallel.hpp"
-#include "json.hpp"
+#include "encoder_stream.hpp"
 #include "decoder_parallel.cpp"
 
 namespace py = pybind11;
-using json = nlohmann::json;
 
 py::object toPython(const Value& v) {
     switch (v.type()) {
@@ -44,64 +52,178 @@ py::object toPython(const Value& v) {
     }
 }
 
-Value jsonToValue(const json& j) {
-    if (j.is_object()) {
-        Object o;
-        for (auto it = j.begin(); it != j.end(); ++it)
-            o.add(it.key(), jsonToValue(it.value()));
-        return o.toValue();
-    }
-    if (j.is_array()) {
-        List l;
-        for (auto& el : j) l.add(jsonToValue(el));
-        return l.toValue();
+py::object toPython(const NodeDocument& doc, const Node& n) {
+    switch (n.type) {
+        case ValueType::Null: return py::none();
+        case ValueType::String: {
+            std::string_view sv = n.asString();
+            return py::str(sv.data(), sv.size());
+        }
+        case ValueType::Integer: return py::int_(n.integer);
+        case ValueType::Float: return py::float_(n.real);
+        case ValueType::Boolean: return py::bool_(n.boolean);
+        case ValueType::Byte: return py::int_(n.byte);
+        case ValueType::Object: {
+            py::dict d;
+            for (uint32_t i = 0; i < n.size; ++i) {
+                std::string_view key = doc.key(n.fields[i].key);
+                d[py::str(key.data(), key.size())] = toPython(doc, n.fields[i].value);
+            }
+            return d;
+        }
+        case ValueType::List: {
+            py::list l(n.size);
+            for (uint32_t i = 0; i < n.size; ++i) l[i] = toPython(doc, n.elements[i]);
+            return l;
+        }
+        case ValueType::Custom: {
+            std::ostringstream oss;
+            for (uint32_t i = 0; i < n.size; ++i)
+                oss << std::hex << std::setw(2) << std::setfill('0') << (int)n.bytes[i];
+            return py::bytes(oss.str());
+        }
+        default: return py::str("<unknown>");
     }
-    if (j.is_string()) return Value(j.get<std::string>());
-    if (j.is_number_integer()) return Value((int64_t)j.get<int64_t>());
-    if (j.is_number_float()) return Value(j.get<double>());
-    if (j.is_boolean()) return Value(j.get<bool>());
-    if (j.is_null()) return Value();
-    throw std::runtime_error("Unsupported JSON value type");
 }
 
 // chaos_bindings_fixes.cpp
 
 py::object chaos_load(const std::string& chaos_file) {
     auto* decoder_ptr = new MMapDecoderSelective();
-    decoder_ptr->load(chaos_file);
+    {
+        py::gil_scoped_release release;
+        decoder_ptr->load(chaos_file);
+    }
     return py::cast(decoder_ptr, py::return_value_policy::take_ownership);
 }
 
-std::tuple<py::object, long long>
-chaos_query(const std::string& chaos_file,
-            const std::vector<std::vector<std::string>>& queries,
-            py::object existing_decoder = py::none())
-{
-    MMapDecoderSelective* decoder_ptr = nullptr;
-    std::unique_ptr<MMapDecoderSelective> owned_decoder; // if we create one, we own it
+// Native worker pool behind parallel_query and query_async. Tasks run without the GIL
+// and only take it to hand results back to Python. shutdown() finishes the queued
+// tasks and joins the workers.
+class NativePool {
+public:
+    explicit NativePool(unsigned threads) : stop(false) {
+        if (threads == 0) threads = 4;
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back([this] {
+                while (true) {
+                    std::packaged_task<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv.wait(lock, [this] { return stop || !tasks.empty(); });
+                        if (stop && tasks.empty()) return;
+                        task = std::move(tasks.front());
+                        tasks.pop();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    std::future<void> submit(std::function<void()> func) {
+        std::packaged_task<void()> task(std::move(func));
+        std::future<void> res = task.get_future();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            tasks.emplace(std::move(task));
+        }
+        cv.notify_one();
+        return res;
+    }
+
+    size_t size() const { return workers.size(); }
+
+    void shutdown() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto& worker : workers) {
+            if (worker.joinable()) worker.join();
+        }
+        workers.clear();
+    }
+
+    ~NativePool() { shutdown(); }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::packaged_task<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop;
+};
+
+// The pool is created on first use and shut down from Python's atexit hook, while the
+// interpreter can still hand the GIL to workers delivering results; waiting for them
+// in a static destructor, after finalization, would deadlock.
+std::mutex native_pool_mutex;
+std::unique_ptr<NativePool> native_pool_instance;
+
+NativePool& native_pool() {
+    std::lock_guard<std::mutex> lock(native_pool_mutex);
+    if (!native_pool_instance) native_pool_instance.reset(new NativePool(std::thread::hardware_concurrency()));
+    return *native_pool_instance;
+}
+
+void shutdown_native_pool() {
+    py::gil_scoped_release release;
+    std::unique_ptr<NativePool> pool;
+    {
+        std::lock_guard<std::mutex> lock(native_pool_mutex);
+        pool = std::move(native_pool_instance);
+    }
+    pool.reset();
+}
 
+// The file a call works on: the one behind a decoder from load(), or chaos_file opened
+// for this call. Each call queries through its own cursor, so the GIL can be released
+// even while other Python threads use the same decoder.
+std::shared_ptr<const ChaosFile> resolve_file(const std::string& chaos_file, py::object existing_decoder) {
     if (existing_decoder.is_none()) {
-        owned_decoder.reset(new MMapDecoderSelective());
-        owned_decoder->load(chaos_file);
-        decoder_ptr = owned_decoder.get();
-    } else {
-        decoder_ptr = existing_decoder.cast<MMapDecoderSelective*>();
-        if (!decoder_ptr) throw std::runtime_error("Invalid decoder object passed");
+        py::gil_scoped_release release;
+        return ChaosFile::open(chaos_file);
     }
+    auto* decoder_ptr = existing_decoder.cast<MMapDecoderSelective*>();
+    if (!decoder_ptr) throw std::runtime_error("Invalid decoder object passed");
+    if (!decoder_ptr->sharedFile()) throw std::runtime_error("Decoder has no file loaded");
+    return decoder_ptr->sharedFile();
+}
 
+py::list toPythonList(const std::vector<Value>& values) {
     py::list results;
+    for (const Value& v : values) results.append(toPython(v));
+    return results;
+}
+
+// Compiles and runs queries as one batch, so prefixes they share are only walked once.
+std::vector<Value> run_batch(const std::shared_ptr<const ChaosFile>& file,
+                             const std::vector<std::vector<std::string>>& queries,
+                             size_t begin, size_t end)
+{
+    MMapDecoderSelective cursor(file);
+    std::vector<CompiledQuery> plans;
+    plans.reserve(end - begin);
+    for (size_t i = begin; i < end; ++i) plans.push_back(cursor.compile(queries[i]));
+    return cursor.executeBatch(plans);
+}
+
+std::tuple<py::object, long long>
+chaos_query(const std::string& chaos_file,
+            const std::vector<std::vector<std::string>>& queries,
+            py::object existing_decoder = py::none())
+{
+    auto file = resolve_file(chaos_file, existing_decoder);
     auto s = std::chrono::high_resolution_clock::now();
 
-    for (size_t i = 0; i < queries.size(); ++i) {
-        const auto& q = queries[i];
-        decoder_ptr->setQuery(const_cast<std::vector<std::string>&>(const_cast<std::vector<std::string>&>(q)));
-        Value r;
-        // first query must call decode() only if we created and haven't previously used this decoder to query
-        // safe behavior: if owned_decoder is non-null -> do a decodeWrapper(0) after load, selective traversal works
-        // but decodeWrapper expects entityTable/baseOffset to be set (they are after load)
-        r = decoder_ptr->decodeWrapper(0);
-        results.append(toPython(r));
+    std::vector<Value> values;
+    {
+        py::gil_scoped_release release;
+        values = run_batch(file, queries, 0, queries.size());
     }
+    py::list results = toPythonList(values);
 
     auto e = std::chrono::high_resolution_clock::now();
     long long ms = std::chrono::duration_cast<std::chrono::microseconds>(e - s).count();
@@ -114,29 +236,17 @@ chaos_keys(const std::string& chaos_file,
            const std::vector<std::vector<std::string>>& queries,
            py::object existing_decoder = py::none())
 {
-    MMapDecoderSelective* decoder_ptr = nullptr;
-    std::unique_ptr<MMapDecoderSelective> owned_decoder;
-
-    if (existing_decoder.is_none()) {
-        owned_decoder.reset(new MMapDecoderSelective());
-        owned_decoder->load(chaos_file);
-        decoder_ptr = owned_decoder.get();
-    } else {
-        decoder_ptr = existing_decoder.cast<MMapDecoderSelective*>();
-        if (!decoder_ptr) throw std::runtime_error("Invalid decoder object passed");
-    }
-
-    py::list results;
+    auto file = resolve_file(chaos_file, existing_decoder);
     auto s = std::chrono::high_resolution_clock::now();
 
-    for (size_t i = 0; i < queries.size(); ++i) {
-        const auto& q = queries[i];
-        decoder_ptr->setQuery(const_cast<std::vector<std::string>&>(const_cast<std::vector<std::string>&>(q)));
-        // ensure queryOffset starts at 0 inside setQuery (your setQuery does this)
-        // ensure decodeWrapper reads from baseOffset/entityTable (load() populated these)
-        Value r = decoder_ptr->getKeys();
-        results.append(toPython(r));
+    std::vector<Value> values;
+    {
+        py::gil_scoped_release release;
+        MMapDecoderSelective cursor(file);
+        values.reserve(queries.size());
+        for (const auto& q : queries) values.push_back(cursor.executeKeys(cursor.compile(q)));
     }
+    py::list results = toPythonList(values);
 
     auto e = std::chrono::high_resolution_clock::now();
     long long ms = std::chrono::duration_cast<std::chrono::microseconds>(e - s).count();
@@ -149,27 +259,55 @@ chaos_len(const std::string& chaos_file,
           const std::vector<std::vector<std::string>>& queries,
           py::object existing_decoder = py::none())
 {
-    MMapDecoderSelective* decoder_ptr = nullptr;
-    std::unique_ptr<MMapDecoderSelective> owned_decoder;
+    auto file = resolve_file(chaos_file, existing_decoder);
+    auto s = std::chrono::high_resolution_clock::now();
 
-    if (existing_decoder.is_none()) {
-        owned_decoder.reset(new MMapDecoderSelective());
-        owned_decoder->load(chaos_file);
-        decoder_ptr = owned_decoder.get();
-    } else {
-        decoder_ptr = existing_decoder.cast<MMapDecoderSelective*>();
-        if (!decoder_ptr) throw std::runtime_error("Invalid decoder object passed");
+    std::vector<Value> values;
+    {
+        py::gil_scoped_release release;
+        MMapDecoderSelective cursor(file);
+        values.reserve(queries.size());
+        for (const auto& q : queries) values.push_back(cursor.executeLen(cursor.compile(q)));
     }
+    py::list results = toPythonList(values);
 
-    py::list results;
+    auto e = std::chrono::high_resolution_clock::now();
+    long long ms = std::chrono::duration_cast<std::chrono::microseconds>(e - s).count();
+
+    return std::make_tuple(results, ms);
+}
+
+// Spreads the queries over the native pool in contiguous slices, each run as a batch
+// on its own cursor; the GIL is only taken back to build the result list.
+std::tuple<py::object, long long>
+chaos_parallel_query(const std::string& chaos_file,
+                     const std::vector<std::vector<std::string>>& queries,
+                     py::object existing_decoder = py::none(),
+                     unsigned threads = 0)
+{
+    auto file = resolve_file(chaos_file, existing_decoder);
     auto s = std::chrono::high_resolution_clock::now();
 
-    for (size_t i = 0; i < queries.size(); ++i) {
-        const auto& q = queries[i];
-        decoder_ptr->setQuery(const_cast<std::vector<std::string>&>(const_cast<std::vector<std::string>&>(q)));
-        Value r = decoder_ptr->getLen();
-        results.append(toPython(r));
+    std::vector<Value> values(queries.size());
+    {
+        py::gil_scoped_release release;
+        NativePool& pool = native_pool();
+        size_t workers = threads ? std::min<size_t>(threads, pool.size()) : pool.size();
+        workers = std::max<size_t>(1, std::min(workers, queries.size()));
+        size_t slice = (queries.size() + workers - 1) / workers;
+
+        std::vector<std::future<void>> done;
+        for (size_t begin = 0; begin < queries.size(); begin += slice) {
+            size_t end = std::min(queries.size(), begin + slice);
+            done.push_back(pool.submit([&, begin, end] {
+                std::vector<Value> part = run_batch(file, queries, begin, end);
+                std::move(part.begin(), part.end(), values.begin() + begin);
+            }));
+        }
+        for (auto& f : done) f.wait();
+        for (auto& f : done) f.get();
     }
+    py::list results = toPythonList(values);
 
     auto e = std::chrono::high_resolution_clock::now();
     long long ms = std::chrono::duration_cast<std::chrono::microseconds>(e - s).count();
@@ -177,16 +315,167 @@ chaos_len(const std::string& chaos_file,
     return std::make_tuple(results, ms);
 }
 
+// A Column as a NumPy array. Integer, float and boolean buffers are copied in one go;
+// with null rows, integers become float64 holding NaN, and booleans join strings and
+// mixed columns as object arrays holding None. Timestamps become datetime64[us], null
+// rows NaT.
+py::object toNumPy(const Column& column) {
+    bool hasNulls = std::find(column.nulls.begin(), column.nulls.end(), 1) != column.nulls.end();
+    if (column.kind == Column::Kind::Timestamp) {
+        py::array_t<int64_t> micros(column.rows);
+        int64_t* data = micros.mutable_data();
+        for (size_t i = 0; i < column.rows; ++i) data[i] = column.nulls[i] ? INT64_MIN : column.integers[i];
+        return micros.attr("view")("datetime64[us]");
+    }
+    if (column.kind == Column::Kind::Integer && !hasNulls) {
+        py::array_t<int64_t> out(column.rows);
+        std::copy(column.integers.begin(), column.integers.end(), out.mutable_data());
+        return out;
+    }
+    if (column.kind == Column::Kind::Integer || column.kind == Column::Kind::Float) {
+        py::array_t<double> out(column.rows);
+        double* data = out.mutable_data();
+        for (size_t i = 0; i < column.rows; ++i) {
+            if (column.nulls[i]) data[i] = std::nan("");
+            else data[i] = column.kind == Column::Kind::Float ? column.floats[i] : static_cast<double>(column.integers[i]);
+        }
+        return out;
+    }
+    if (column.kind == Column::Kind::Boolean && !hasNulls) {
+        py::array_t<bool> out(column.rows);
+        std::copy(column.booleans.begin(), column.booleans.end(), out.mutable_data());
+        return out;
+    }
+
+    py::object out = py::module_::import("numpy").attr("empty")(column.rows, py::arg("dtype") = "object");
+    for (size_t i = 0; i < column.rows; ++i) {
+        if (column.nulls[i]) out[py::int_(i)] = py::none();
+        else if (column.kind == Column::Kind::String) {
+            out[py::int_(i)] = py::str(column.chars.data() + column.offsets[i], column.offsets[i + 1] - column.offsets[i]);
+        } else {
+            out[py::int_(i)] = toPython(column.row(i));
+        }
+    }
+    return out;
+}
+
+// Runs one wildcard query ("*" segments) and returns its rows as a NumPy array, with
+// the elements split across threads (0: every hardware thread).
+std::tuple<py::object, long long>
+chaos_column(const std::string& chaos_file,
+             const std::vector<std::string>& query,
+             py::object existing_decoder = py::none(),
+             unsigned threads = 0)
+{
+    auto file = resolve_file(chaos_file, existing_decoder);
+    auto s = std::chrono::high_resolution_clock::now();
+
+    Column column;
+    {
+        py::gil_scoped_release release;
+        MMapDecoderSelective cursor(file);
+        column = cursor.executeColumn(cursor.compile(query), threads);
+    }
+    py::object result = toNumPy(column);
+
+    auto e = std::chrono::high_resolution_clock::now();
+    long long ms = std::chrono::duration_cast<std::chrono::microseconds>(e - s).count();
+
+    return std::make_tuple(result, ms);
+}
+
+// Python handles for one query_async call. They are only copied or dropped while the
+// GIL is held.
+struct AsyncQuery {
+    py::object loop;
+    py::object future;
+    std::vector<std::vector<std::string>> queries;
+};
+
+// Runs on the event loop. The future may have been cancelled while its batch ran, and
+// setting it then would raise InvalidStateError.
+void settle_future(py::object future, py::object outcome, bool failed) {
+    if (future.attr("done")().cast<bool>()) return;
+    future.attr(failed ? "set_exception" : "set_result")(outcome);
+}
+
+// Returns an asyncio future for the results of a batch run on the native pool; it
+// must be called from a running event loop. Errors are raised as RuntimeError.
+py::object chaos_query_async(const std::string& chaos_file,
+                             const std::vector<std::vector<std::string>>& queries,
+                             py::object existing_decoder = py::none())
+{
+    auto file = resolve_file(chaos_file, existing_decoder);
+    auto state = std::make_shared<AsyncQuery>();
+    state->loop = py::module_::import("asyncio").attr("get_running_loop")();
+    state->future = state->loop.attr("create_future")();
+    state->queries = queries;
+    py::object future = state->future;
+
+    native_pool().submit([state, file] {
+        std::vector<Value> values;
+        std::string error;
+        try {
+            values = run_batch(file, state->queries, 0, state->queries.size());
+        } catch (const std::exception& ex) {
+            error = ex.what();
+        }
+
+        py::gil_scoped_acquire acquire;
+        try {
+            py::object outcome = error.empty()
+                ? py::object(toPythonList(values))
+                : py::module_::import("builtins").attr("RuntimeError")(error);
+            state->loop.attr("call_soon_threadsafe")(py::cpp_function(&settle_future), state->future, outcome, !error.empty());
+        } catch (const py::error_already_set&) {
+            // The event loop was closed before the queries finished; nobody is waiting.
+        }
+        state->future = py::object();
+        state->loop = py::object();
+    });
+    return future;
+}
+
+// Resolves a path against the decoder's file once; the returned plan can be passed to
+// run() any number of times.
+CompiledQuery chaos_compile(py::object decoder, const std::vector<std::string>& query) {
+    auto* decoder_ptr = decoder.cast<MMapDecoderSelective*>();
+    if (!decoder_ptr) throw std::runtime_error("Invalid decoder object passed");
+    return decoder_ptr->compile(query);
+}
+
+std::tuple<py::object, long long>
+chaos_run(const py::list& plans, py::object decoder)
+{
+    auto file = resolve_file("", decoder);
+    auto s = std::chrono::high_resolution_clock::now();
 
+    // Copied while the GIL is held: once it is released, another thread may drop the
+    // list's references to the plans.
+    std::vector<CompiledQuery> compiled;
+    compiled.reserve(plans.size());
+    for (const auto& plan : plans) compiled.push_back(plan.cast<const CompiledQuery&>());
+
+    std::vector<Value> values;
+    {
+        py::gil_scoped_release release;
+        MMapDecoderSelective cursor(file);
+        values.reserve(compiled.size());
+        for (const CompiledQuery& plan : compiled) values.push_back(cursor.execute(plan));
+    }
+    py::list results = toPythonList(values);
+
+    auto e = std::chrono::high_resolution_clock::now();
+    long long ms = std::chrono::duration_cast<std::chrono::microseconds>(e - s).count();
+
+    return std::make_tuple(results, ms);
+}
 
 long long chaos_encode(const std::string& json_file, const std::string& chaos_file) {
-    std::ifstream ifs(json_file);
-    if (!ifs) throw std::runtime_error("Failed to open " + json_file);
-    json j; ifs >> j;
-    Value root = jsonToValue(j);
-    EncoderP enc;
+    py::gil_scoped_release release;
+    StreamEncoder enc;
     auto s = std::chrono::high_resolution_clock::now();
-    enc.encode(root, chaos_file);
+    enc.encode(json_file, chaos_file);
     auto e = std::chrono::high_resolution_clock::now();
     return std::chrono::duration_cast<std::chrono::microseconds>(e - s).count();
 }
@@ -194,14 +483,19 @@ long long chaos_encode(const std::string& json_file, const std::string& chaos_fi
 std::pair<py::object, unsigned long long> chaos_decode(const std::string& chaos_file) {
     MMapDecoderParallel d;
     auto s = std::chrono::high_resolution_clock::now();
-    Value v = d.decode(chaos_file);
+    NodeDocument doc;
+    {
+        py::gil_scoped_release release;
+        doc = d.decodeNodes(chaos_file);
+    }
     auto e = std::chrono::high_resolution_clock::now();
     long long ms = std::chrono::duration_cast<std::chrono::microseconds>(e - s).count();
-    return {toPython(v), ms};
+    return {toPython(doc, doc.root), ms};
 }
 
-
 PYBIND11_MODULE(pychaos, m) {
+    py::module_::import("atexit").attr("register")(py::cpp_function(&shutdown_native_pool));
+
     py::class_<MMapDecoderSelective>(m, "Decoder");
     m.def("query", &chaos_query,
           py::arg("chaos_file"),
@@ -221,6 +515,30 @@ PYBIND11_MODULE(pychaos, m) {
           py::arg("decoder")
     );
 
+    m.def("parallel_query", &chaos_parallel_query,
+          py::arg("chaos_file"),
+          py::arg("queries"),
+          py::arg("decoder") = py::none(),
+          py::arg("threads") = 0
+    );
+
+    m.def("query_async", &chaos_query_async,
+          py::arg("chaos_file"),
+          py::arg("queries"),
+          py::arg("decoder") = py::none()
+    );
+
+
+    m.def("column", &chaos_column,
+          py::arg("chaos_file"),
+          py::arg("query"),
+          py::arg("decoder") = py::none(),
+          py::arg("threads") = 0
+    );
+
+    py::class_<CompiledQuery>(m, "CompiledQuery");
+    m.def("compile", &chaos_compile, py::arg("decoder"), py::arg("query"));
+    m.def("run", &chaos_run, py::arg("plans"), py::arg("decoder"));
 
     m.def("encode", &chaos_encode, py::arg("json_file"), py::arg("chaos_file"));
     m.def("decode", &chaos_decode, py::arg("chaos_file"));
@@ -8,35 +8,108 @@
 #include <unistd.h>
 #include <stdexcept>
 #include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <charconv>
+#include <map>
+#include <limits>
+#include <tuple>
+#include <memory>
+#include <thread>
+#include <exception>
 #include <lz4.h>
 #include "datastruct.hpp"
+#include "arena.hpp"
+#include "chaos_format.hpp"
+
+// The immutable half of a loaded CHAOS file: the mapping, the key dictionary with its
+// sort ranks, the entity table, the object shapes and, for block-compressed files, the
+// block table. ChaosFile::open builds it once; any number of
+// MMapDecoderSelective cursors then share it through std::shared_ptr, on any threads,
+// without locking. The mapping is released with the last reference.
+class ChaosFile {
+public:
+    static std::shared_ptr<const ChaosFile> open(const std::string& filename) {
+        std::shared_ptr<ChaosFile> file(new ChaosFile());
+        file->loadFile(filename);
+        file->loadIndex();
+        return file;
+    }
+
+    ~ChaosFile() {
+        if (fileData) munmap(fileData, fileSize);
+    }
+
+    ChaosFile(const ChaosFile&) = delete;
+    ChaosFile& operator=(const ChaosFile&) = delete;
 
-class MMapDecoderSelective {
     uint8_t* fileData = nullptr;
     size_t fileSize = 0;
-    size_t masterOffset = 0;
     size_t baseOffset = 0;
-    std::vector<std::string> query;
-    long queryOffset = 0;
-
-    int mode = 0;
 
     std::vector<std::string> dictionary;
+    // Sorted position of each key ID, and the inverse. Both stay empty when the file's
+    // dictionary is already sorted (as the Value encoders write it), since IDs then
+    // order like their keys.
+    std::vector<uint32_t> keyRank;
+    std::vector<uint32_t> keysByRank;
     std::vector<long> entityTable;
-    std::unordered_map<uint8_t, size_t> customSizeMap;
+    // Key IDs of each object shape, and the same keys as sorted ranks. Shaped objects
+    // hold their fields in key order, so each rank list is ascending.
+    ShapeList shapes;
+    std::vector<std::vector<uint32_t>> shapeRanks;
+    // Shared strings and value dictionary, loaded once per file.
+    IndexSections sections;
+
+    // Block-compressed files only: the block table, the stored blocks, and the entity
+    // start offsets in ascending order, which bound each entity's extent.
+    bool blocked = false;
+    BlockTable blocks;
+    const uint8_t* blockRegion = nullptr;
+    std::vector<long> entityStarts;
+
+    // Uncompressed byte range [begin, end) of entity id in the data region.
+    std::pair<size_t, size_t> entityExtent(long id) const {
+        long begin = entityTable.at(id);
+        auto next = std::upper_bound(entityStarts.begin(), entityStarts.end(), begin);
+        return {begin, next == entityStarts.end() ? blocks.dataSize : *next};
+    }
 
-public:
-    ~MMapDecoderSelective() {
-        if (fileData) munmap(fileData, fileSize);
+    // Sorted position of a query key among the file's keys, or -1 if no object has it.
+    // Done once per path segment; the object probes then only compare integers.
+    long resolveKey(const std::string& key) const {
+        long low = 0;
+        long high = static_cast<long>(dictionary.size()) - 1;
+        while (low <= high) {
+            long mid = low + (high - low) / 2;
+            int cmp = dictionary[keysByRank.empty() ? mid : keysByRank[mid]].compare(key);
+            if (cmp == 0) return mid;
+            if (cmp < 0) low = mid + 1;
+            else high = mid - 1;
+        }
+        return -1;
     }
 
-    void setQuery(std::vector<std::string>& q){
-        queryOffset = 0;
-        query = q;
+    long rankOf(uint64_t keyIdx) const {
+        if (keyIdx >= dictionary.size()) throw std::runtime_error("Invalid key index");
+        return keyRank.empty() ? static_cast<long>(keyIdx) : keyRank[keyIdx];
     }
 
+    // Position of the key with sorted rank target in objects of the given shape, or -1.
+    long shapeField(uint64_t shape, long count, long target) const {
+        if (shape >= shapeRanks.size() || shapeRanks[shape].size() != static_cast<size_t>(count)) {
+            throw std::runtime_error("Invalid shape index");
+        }
+        const auto& ranks = shapeRanks[shape];
+        auto it = std::lower_bound(ranks.begin(), ranks.end(), static_cast<uint32_t>(target));
+        return (it != ranks.end() && *it == target) ? static_cast<long>(it - ranks.begin()) : -1;
+    }
+
+private:
+    ChaosFile() = default;
+
     void loadFile(const std::string& filename) {
-        int fd = open(filename.c_str(), O_RDONLY);
+        int fd = ::open(filename.c_str(), O_RDONLY);
         if (fd < 0) throw std::runtime_error("Cannot open file");
 
         struct stat st;
@@ -47,41 +120,43 @@ public:
         fileSize = st.st_size;
 
         if (fileSize > 0) {
-            fileData = (uint8_t*)mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
-            if (fileData == MAP_FAILED) {
+            void* mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
                 close(fd);
                 throw std::runtime_error("mmap failed");
             }
+            fileData = static_cast<uint8_t*>(mapped);
         }
         close(fd);
     }
 
-    void addCustom(uint8_t id, size_t size) {
-        customSizeMap[id] = size;
-    }
-
-    const uint8_t* readNBytesPtr(size_t n) {
-        if (masterOffset + n > fileSize) {
+    const uint8_t* readNBytesPtr(size_t n, size_t& offset) const {
+        if (offset + n > fileSize) {
             throw std::runtime_error("EOF: Attempted to read past end of file.");
         }
-        const uint8_t* ptr = fileData + masterOffset;
-        masterOffset += n;
+        const uint8_t* ptr = fileData + offset;
+        offset += n;
         return ptr;
     }
 
-    uint64_t readVarNumber() {
-        uint8_t size_byte = readByte();
+    uint8_t readByte(size_t& offset) const {
+        if (offset >= fileSize) throw std::runtime_error("EOF: Attempted to read a single byte past end of file.");
+        return fileData[offset++];
+    }
+
+    uint64_t readVarNumber(size_t& offset) const {
+        uint8_t size_byte = readByte(offset);
         if (size_byte < 128) return static_cast<uint64_t>(size_byte);
 
         size_t len = size_byte & 0x7F;
-        const uint8_t* arr = readNBytesPtr(len);
+        const uint8_t* arr = readNBytesPtr(len, offset);
         uint64_t result = 0;
         if (len > sizeof(uint64_t)) len = sizeof(uint64_t);
         std::memcpy(&result, arr, len);
         return result;
     }
 
-    std::pair<uint64_t, size_t> readVarNumberFromBuffer(const std::vector<uint8_t>& buffer, size_t offset) {
+    std::pair<uint64_t, size_t> readVarNumberFromBuffer(const std::vector<uint8_t>& buffer, size_t offset) const {
         if (offset >= buffer.size()) throw std::runtime_error("Buffer underflow at start.");
         
         uint8_t sizeByte = buffer[offset];
@@ -96,6 +171,545 @@ public:
         return { result, 1 + len };
     }
 
+    void loadIndex() {
+        size_t offset = 0;
+
+        // v2 files keep the index in a trailer, found by reading the file's tail.
+        bool trailer = findTrailer(fileData, fileSize, offset);
+        size_t indexEnd = fileSize - kTrailerTailSize;
+        if (!trailer) {
+            indexEnd = readVarNumber(offset);
+            indexEnd += offset;
+        }
+        if (trailer && fileData[0] == kBlockedFormatByte) {
+            const uint8_t* p = fileData + offset;
+            blocks = BlockTable::read(p, fileData + indexEnd, offset - kTrailerDataOffset);
+            blockRegion = fileData + kTrailerDataOffset;
+            offset = p - fileData;
+            blocked = true;
+        }
+        long entityCount = readVarNumber(offset);
+
+        uint8_t dictFlag = readByte(offset);
+        std::vector<uint8_t> dictBuffer;
+        if (dictFlag == 0xFF) {
+            long sz = readVarNumber(offset);
+            long og = readVarNumber(offset);
+            const uint8_t* comp_ptr = readNBytesPtr(sz, offset);
+            dictBuffer.resize(og);
+            inflateStored(comp_ptr, sz, dictBuffer.data(), og);
+        } else {
+            const uint8_t* dict_ptr = readNBytesPtr(dictFlag, offset);
+            dictBuffer.assign(dict_ptr, dict_ptr + dictFlag);
+        }
+
+        size_t dictOffset = 0;
+        while (dictOffset < dictBuffer.size()) {
+            auto [stringLength, bytesConsumed] = readVarNumberFromBuffer(dictBuffer, dictOffset);
+            dictOffset += bytesConsumed;
+            if (dictOffset + stringLength > dictBuffer.size()) {
+                throw std::runtime_error("Invalid dictionary format");
+            }
+            dictionary.emplace_back(reinterpret_cast<const char*>(dictBuffer.data() + dictOffset), stringLength);
+            dictOffset += stringLength;
+        }
+
+        rankKeys();
+
+        uint8_t offsetSize = readByte(offset);
+        entityTable.reserve(entityCount);
+        for (long i = 0; i < entityCount; i++) {
+            const uint8_t* b_ptr = readNBytesPtr(offsetSize, offset);
+            long val = 0;
+            std::memcpy(&val, b_ptr, offsetSize);
+            entityTable.push_back(val);
+        }
+        if (indexEnd > fileSize) throw std::runtime_error("Invalid index size");
+
+        const uint8_t* p = fileData + offset;
+        shapes = readShapeTable(p, fileData + indexEnd, dictionary.size());
+        sections.read(p, fileData + indexEnd);
+        shapeRanks.resize(shapes.size());
+        for (size_t i = 0; i < shapes.size(); ++i) {
+            for (uint64_t keyIdx : shapes[i]) shapeRanks[i].push_back(static_cast<uint32_t>(rankOf(keyIdx)));
+        }
+        
+        baseOffset = trailer ? kTrailerDataOffset : indexEnd;
+        if (blocked) {
+            entityStarts = entityTable;
+            std::sort(entityStarts.begin(), entityStarts.end());
+            if (!entityStarts.empty() && static_cast<size_t>(entityStarts.back()) >= blocks.dataSize) {
+                throw std::runtime_error("Invalid entity offset");
+            }
+        }
+    }
+
+    void rankKeys() {
+        auto unordered = std::adjacent_find(dictionary.begin(), dictionary.end(),
+                                            [](const std::string& a, const std::string& b) { return a >= b; });
+        if (unordered == dictionary.end()) return;
+
+        keysByRank.resize(dictionary.size());
+        std::iota(keysByRank.begin(), keysByRank.end(), 0);
+        std::sort(keysByRank.begin(), keysByRank.end(),
+                  [this](uint32_t a, uint32_t b) { return dictionary[a] < dictionary[b]; });
+        keyRank.resize(dictionary.size());
+        for (uint32_t rank = 0; rank < keysByRank.size(); ++rank) keyRank[keysByRank[rank]] = rank;
+    }
+};
+
+// A query path resolved once against a loaded file by MMapDecoderSelective::compile.
+// Each segment keeps both readings, since only the data decides whether it meets an
+// object or a list: the key's sorted rank (-1 if no object in the file has that key)
+// and what it selects from a list. That is either one index, negative ones counting
+// from the end, or a start:stop:step slice with Python's semantics, "*" being the
+// whole list. Executing it does no string work and no allocation beyond the result.
+// Valid for every cursor on the ChaosFile it was compiled against.
+struct CompiledQuery {
+    static constexpr long kOpen = std::numeric_limits<long>::min();
+
+    struct Step {
+        long keyRank;
+        long index = 0;
+        bool indexed = false;
+        bool wildcard = false;  // a slice; on a list it selects several elements
+        long start = kOpen;
+        long stop = kOpen;
+        long stride = 1;
+
+        // Position of the indexed element in a list of count elements, or -1.
+        long resolveIndex(long count) const {
+            if (!indexed) return -1;
+            long i = index < 0 ? index + count : index;
+            return (i >= 0 && i < count) ? i : -1;
+        }
+
+        // First element, number of elements and stride the slice selects from a list
+        // of count elements. Bounds past either end are clamped, as in Python.
+        std::tuple<long, long, long> range(long count) const {
+            long lower = stride > 0 ? 0 : -1;
+            long upper = stride > 0 ? count : count - 1;
+            auto bound = [&](long v, long open) {
+                if (v == kOpen) return open;
+                if (v < 0) return std::max(v + count, lower);
+                return std::min(v, upper);
+            };
+            long first = bound(start, stride > 0 ? lower : upper);
+            long last = bound(stop, stride > 0 ? upper : lower);
+            long length = 0;
+            if (stride > 0 && last > first) length = (last - first + stride - 1) / stride;
+            if (stride < 0 && first > last) length = (first - last - stride - 1) / -stride;
+            return {first, length, stride};
+        }
+    };
+
+    // Fills the list reading of step from segment; false if it has none.
+    static bool parseListSegment(const std::string& segment, Step& step) {
+        auto parse = [](const char* begin, const char* end, long& out) {
+            auto [stop, ec] = std::from_chars(begin, end, out);
+            return ec == std::errc() && stop == end;
+        };
+        const char* begin = segment.data();
+        const char* end = begin + segment.size();
+
+        if (segment == "*") {
+            step.wildcard = true;
+            return true;
+        }
+        if (segment.find(':') == std::string::npos) {
+            step.indexed = parse(begin, end, step.index);
+            return step.indexed;
+        }
+
+        long* bounds[] = {&step.start, &step.stop, &step.stride};
+        size_t part = 0;
+        for (const char* p = begin; ; ++part) {
+            const char* colon = std::find(p, end, ':');
+            if (part == 3 || (p != colon && !parse(p, colon, *bounds[part]))) {
+                step.start = step.stop = kOpen;
+                step.stride = 1;
+                return false;
+            }
+            if (colon == end) break;
+            p = colon + 1;
+        }
+        if (step.stride == 0) throw std::runtime_error("Slice step cannot be zero in '" + segment + "'");
+        step.wildcard = true;
+        return true;
+    }
+
+    std::vector<Step> steps;
+    const void* owner = nullptr;
+};
+
+// The result of a wildcard query: one row per element the wildcards expanded to, held
+// in a contiguous buffer of the rows' common type. Integer rows are widened to Float
+// when both occur; any other mix, and rows holding lists, objects or custom values,
+// make the column Mixed, which keeps whole Values. Timestamps of one format make a
+// Timestamp column, holding microseconds since the epoch in integers. Rows whose path
+// does not exist in that element, or whose value is null, are flagged in nulls.
+struct Column {
+    enum class Kind { Null, Integer, Float, Boolean, String, Timestamp, Mixed };
+
+    Kind kind = Kind::Null;
+    size_t rows = 0;
+    std::vector<uint8_t> nulls;
+    std::vector<int64_t> integers;      // Integer rows, or Timestamp rows in microseconds
+    uint8_t timestampFormat = 0;        // shared by all Timestamp rows
+    std::vector<double> floats;
+    std::vector<uint8_t> booleans;
+    std::string chars;                  // String rows, back to back
+    std::vector<uint64_t> offsets{0};   // String row i is chars[offsets[i], offsets[i + 1])
+    std::vector<Value> values;          // Mixed rows
+
+    void appendNull() {
+        nulls.push_back(1);
+        pad();
+        rows++;
+    }
+
+    void appendInteger(int64_t v) {
+        if (!accept(Kind::Integer)) return appendValue(Value(v));
+        if (kind == Kind::Float) floats.push_back(static_cast<double>(v));
+        else integers.push_back(v);
+        nulls.push_back(0);
+        rows++;
+    }
+
+    void appendFloat(double v) {
+        if (!accept(Kind::Float)) return appendValue(Value(v));
+        floats.push_back(v);
+        nulls.push_back(0);
+        rows++;
+    }
+
+    void appendBoolean(bool v) {
+        if (!accept(Kind::Boolean)) return appendValue(Value(v));
+        booleans.push_back(v);
+        nulls.push_back(0);
+        rows++;
+    }
+
+    void appendString(const char* data, size_t size) {
+        if (!accept(Kind::String)) return appendValue(Value(std::string(data, size)));
+        chars.append(data, size);
+        offsets.push_back(chars.size());
+        nulls.push_back(0);
+        rows++;
+    }
+
+    void appendTimestamp(const Timestamp& t) {
+        if (kind == Kind::Null) timestampFormat = t.format;
+        if ((kind == Kind::Timestamp && t.format != timestampFormat) || !accept(Kind::Timestamp)) {
+            return appendValue(Value(formatTimestamp(t)));
+        }
+        integers.push_back(t.micros);
+        nulls.push_back(0);
+        rows++;
+    }
+
+    void appendValue(Value v) {
+        switch (v.type()) {
+            case ValueType::Null: return appendNull();
+            case ValueType::Integer: if (kind != Kind::Mixed) return appendInteger(v.asInteger()); break;
+            case ValueType::Byte: if (kind != Kind::Mixed) return appendInteger(v.asByte()); break;
+            case ValueType::Float: if (kind != Kind::Mixed) return appendFloat(v.asFloat()); break;
+            case ValueType::Boolean: if (kind != Kind::Mixed) return appendBoolean(v.asBoolean()); break;
+            case ValueType::String: if (kind != Kind::Mixed) return appendString(v.asString().data(), v.asString().size()); break;
+            default: break;
+        }
+        become(Kind::Mixed);
+        values.push_back(std::move(v));
+        nulls.push_back(0);
+        rows++;
+    }
+
+    // Appends length elements of a packed list, from first on and stride apart. Unit
+    // stride runs of matching kind are converted straight into the buffers.
+    void appendPacked(uint8_t tag, const uint8_t* data, long first, long length, long stride) {
+        if (length <= 0) return;
+        uint8_t width = packedWidth(tag);
+        if (packedKind(tag) == kPackedTimestamp) {
+            for (long k = 0; k < length; ++k) appendTimestamp(packedTimestamp(data, width, first + k * stride));
+            return;
+        }
+        Kind incoming = packedKind(tag) == kPackedInteger ? Kind::Integer
+                      : packedKind(tag) == kPackedFloat ? Kind::Float : Kind::Boolean;
+        if (!accept(incoming)) {
+            for (long k = 0; k < length; ++k) {
+                long i = first + k * stride;
+                if (incoming == Kind::Integer) appendValue(Value(packedInteger(data, width, i)));
+                else if (incoming == Kind::Float) appendValue(Value(packedFloat(data, width, i)));
+                else appendValue(Value(packedBoolean(data, i)));
+            }
+            return;
+        }
+
+        size_t at = rows;
+        nulls.resize(rows + length, 0);
+        rows += length;
+        if (kind == Kind::Integer) {
+            integers.resize(rows);
+            if (stride == 1) unpackIntegers(data + first * width, width, length, integers.data() + at);
+            else for (long k = 0; k < length; ++k) integers[at + k] = packedInteger(data, width, first + k * stride);
+        } else if (kind == Kind::Float) {
+            floats.resize(rows);
+            if (incoming == Kind::Float && stride == 1) unpackFloats(data + first * width, width, length, floats.data() + at);
+            else for (long k = 0; k < length; ++k) {
+                long i = first + k * stride;
+                floats[at + k] = incoming == Kind::Float ? packedFloat(data, width, i)
+                                                         : static_cast<double>(packedInteger(data, width, i));
+            }
+        } else {
+            booleans.resize(rows);
+            for (long k = 0; k < length; ++k) booleans[at + k] = packedBoolean(data, first + k * stride);
+        }
+    }
+
+    // Appends other's rows after this column's, unifying the two kinds.
+    void append(const Column& other) {
+        if (rows == 0) {
+            *this = other;
+            return;
+        }
+        if ((other.kind == kind && (kind != Kind::Timestamp || other.timestampFormat == timestampFormat)) ||
+            other.kind == Kind::Null) {
+            nulls.insert(nulls.end(), other.nulls.begin(), other.nulls.end());
+            integers.insert(integers.end(), other.integers.begin(), other.integers.end());
+            floats.insert(floats.end(), other.floats.begin(), other.floats.end());
+            booleans.insert(booleans.end(), other.booleans.begin(), other.booleans.end());
+            if (kind == Kind::String) {
+                uint64_t base = chars.size();
+                chars += other.chars;
+                for (size_t i = 1; i < other.offsets.size(); ++i) offsets.push_back(base + other.offsets[i]);
+            }
+            values.insert(values.end(), other.values.begin(), other.values.end());
+            if (other.kind == Kind::Null) for (size_t i = 0; i < other.rows; ++i) pad();
+            rows += other.rows;
+            return;
+        }
+        for (size_t i = 0; i < other.rows; ++i) {
+            if (other.kind == Kind::Timestamp && !other.nulls[i]) appendTimestamp(Timestamp{other.integers[i], other.timestampFormat});
+            else appendValue(other.row(i));
+        }
+    }
+
+    Value row(size_t i) const {
+        if (nulls.at(i)) return Value();
+        switch (kind) {
+            case Kind::Integer: return Value(integers[i]);
+            case Kind::Float: return Value(floats[i]);
+            case Kind::Boolean: return Value(booleans[i] != 0);
+            case Kind::String: return Value(chars.substr(offsets[i], offsets[i + 1] - offsets[i]));
+            case Kind::Timestamp: return Value(formatTimestamp(Timestamp{integers[i], timestampFormat}));
+            case Kind::Mixed: return values[i];
+            case Kind::Null: break;
+        }
+        return Value();
+    }
+
+private:
+    // Whether a row of kind incoming can be stored without going Mixed, converting the
+    // rows so far if the column has to change kind for it.
+    bool accept(Kind incoming) {
+        if (kind == incoming) return true;
+        if (kind == Kind::Null) {
+            become(incoming);
+            return true;
+        }
+        if (kind == Kind::Float && incoming == Kind::Integer) return true;
+        if (kind == Kind::Integer && incoming == Kind::Float) {
+            become(Kind::Float);
+            return true;
+        }
+        become(Kind::Mixed);
+        return false;
+    }
+
+    void become(Kind target) {
+        if (kind == target) return;
+        if (target == Kind::Mixed) {
+            values.reserve(rows);
+            for (size_t i = 0; i < rows; ++i) values.push_back(row(i));
+        } else if (kind == Kind::Integer && target == Kind::Float) {
+            floats.assign(integers.begin(), integers.end());
+        }
+        integers.clear();
+        if (target != Kind::Float) floats.clear();
+        booleans.clear();
+        chars.clear();
+        offsets.assign(1, 0);
+        Kind previous = kind;
+        kind = target;
+        if (previous == Kind::Null && target != Kind::Mixed) for (size_t i = 0; i < rows; ++i) pad();
+    }
+
+    // Placeholder for a null row in the current kind's buffer.
+    void pad() {
+        switch (kind) {
+            case Kind::Integer:
+            case Kind::Timestamp: integers.push_back(0); break;
+            case Kind::Float: floats.push_back(0.0); break;
+            case Kind::Boolean: booleans.push_back(0); break;
+            case Kind::String: offsets.push_back(chars.size()); break;
+            case Kind::Mixed: values.emplace_back(); break;
+            case Kind::Null: break;
+        }
+    }
+};
+
+// A query cursor over a ChaosFile. It holds all traversal state (read position, the
+// current query and result mode), so it is cheap to create and each thread uses its
+// own; the file itself is shared. load() opens a new ChaosFile, while attach() and
+// the ChaosFile constructor join one that is already open.
+class MMapDecoderSelective {
+    std::shared_ptr<const ChaosFile> file;
+    const uint8_t* fileData = nullptr;
+    size_t fileSize = 0;
+    size_t masterOffset = 0;
+    size_t baseOffset = 0;
+    std::vector<std::string> query;
+    long queryOffset = 0;
+
+    int mode = 0;
+
+    std::unordered_map<uint8_t, size_t> customSizeMap;
+
+    // Block-compressed files are read through this cursor's own cache; fileData is
+    // then its image of the uncompressed data region and baseOffset 0.
+    BlockCache blocks;
+
+    // Moves to the start of entity id, inflating the blocks it spans if need be.
+    void seekEntity(long id) {
+        if (file->blocked) {
+            auto [begin, end] = file->entityExtent(id);
+            blocks.ensure(begin, end);
+        }
+        masterOffset = file->entityTable.at(id) + baseOffset;
+    }
+
+    // Field positions already resolved for (shape, key rank) pairs, direct-mapped. Records
+    // in a list mostly share one shape, so each key is looked up once per shape.
+    struct ShapeSlot {
+        uint64_t shape = UINT64_MAX;
+        long keyRank = -1;
+        long field = -1;
+    };
+    static constexpr size_t kShapeSlots = 64;
+    ShapeSlot shapeSlots[kShapeSlots];
+
+    long shapedField(uint64_t shape, long count, long target) {
+        ShapeSlot& slot = shapeSlots[(shape * 31 + static_cast<uint64_t>(target)) & (kShapeSlots - 1)];
+        if (slot.shape != shape || slot.keyRank != target) {
+            slot.field = file->shapeField(shape, count, target);
+            slot.shape = shape;
+            slot.keyRank = target;
+        }
+        return slot.field;
+    }
+
+    // Header of the columnar list last walked into, with its keys as sorted ranks. Callers
+    // copy what they need before walking further, since that may replace it.
+    long columnarId = -1;
+    ColumnarList columnar;
+    std::vector<long> columnarRanks;
+
+    const ColumnarList& columnarList(long listId) {
+        if (listId == columnarId) return columnar;
+        seekEntity(listId);
+        uint8_t byte = readByte();
+        long count = byte & 0x7F;
+        if (count == 0x7F) count = readVarNumber();
+        if ((byte & 0x80) == 0 || !isColumnar(readByte())) throw std::runtime_error("Not a columnar list");
+        columnar = ColumnarList(fileData + masterOffset, fileData + fileSize, count);
+        columnarRanks.clear();
+        for (uint64_t key : columnar.keys) columnarRanks.push_back(file->rankOf(key));
+        columnarId = listId;
+        return columnar;
+    }
+
+    // Column of the cached columnar list that holds the key with sorted rank target, or -1.
+    long columnOf(long target) const {
+        auto it = std::lower_bound(columnarRanks.begin(), columnarRanks.end(), target);
+        return (it != columnarRanks.end() && *it == target) ? static_cast<long>(it - columnarRanks.begin()) : -1;
+    }
+
+    // With masterOffset just past a shaped object's shape ID, returns where the value of
+    // field starts.
+    size_t shapedValueOffset(uint8_t offsetByte, long count, long field) {
+        if (hasImpliedOffsets(offsetByte)) {
+            uint64_t stride = readVarNumber();
+            return masterOffset + field * stride;
+        }
+        uint8_t width = shapedOffsetWidth(offsetByte);
+        size_t tableOffset = masterOffset;
+        masterOffset = tableOffset + field * width;
+        const uint8_t* offsetPtr = readNBytesPtr(width);
+        size_t fieldOffset = 0;
+        std::memcpy(&fieldOffset, offsetPtr, width);
+        return tableOffset + count * width + fieldOffset;
+    }
+
+public:
+    MMapDecoderSelective() = default;
+
+    explicit MMapDecoderSelective(std::shared_ptr<const ChaosFile> sharedFile) {
+        attach(std::move(sharedFile));
+    }
+
+    void attach(std::shared_ptr<const ChaosFile> sharedFile) {
+        file = std::move(sharedFile);
+        fileData = file->fileData;
+        fileSize = file->fileSize;
+        baseOffset = file->baseOffset;
+        masterOffset = 0;
+        blocks.attach(file->blocked ? &file->blocks : nullptr, file->blockRegion);
+        if (file->blocked) {
+            fileData = blocks.data();
+            fileSize = file->blocks.dataSize;
+            baseOffset = 0;
+        }
+    }
+
+    // Decompressed bytes of a block-compressed file this cursor keeps between queries.
+    void setBlockCacheSize(size_t bytes) {
+        blocks.setCapacity(bytes);
+    }
+
+    const std::shared_ptr<const ChaosFile>& sharedFile() const {
+        return file;
+    }
+
+    void setQuery(std::vector<std::string>& q){
+        queryOffset = 0;
+        query = q;
+    }
+
+    void addCustom(uint8_t id, size_t size) {
+        customSizeMap[id] = size;
+    }
+
+    const uint8_t* readNBytesPtr(size_t n) {
+        if (masterOffset + n > fileSize) {
+            throw std::runtime_error("EOF: Attempted to read past end of file.");
+        }
+        const uint8_t* ptr = fileData + masterOffset;
+        masterOffset += n;
+        return ptr;
+    }
+
+    uint64_t readVarNumber() {
+        uint8_t size_byte = readByte();
+        if (size_byte < 128) return static_cast<uint64_t>(size_byte);
+
+        size_t len = size_byte & 0x7F;
+        const uint8_t* arr = readNBytesPtr(len);
+        uint64_t result = 0;
+        if (len > sizeof(uint64_t)) len = sizeof(uint64_t);
+        std::memcpy(&result, arr, len);
+        return result;
+    }
+
     uint8_t readByte() {
         if (masterOffset >= fileSize) throw std::runtime_error("EOF: Attempted to read a single byte past end of file.");
         return fileData[masterOffset++];
@@ -103,18 +717,12 @@ public:
 
     std::vector<uint8_t> uncompressBuffer(const uint8_t* compressed_ptr, size_t compressed_size, size_t originalSize) {
         std::vector<uint8_t> output(originalSize);
-        int decompressed = LZ4_decompress_safe(
-            reinterpret_cast<const char*>(compressed_ptr),
-            reinterpret_cast<char*>(output.data()),
-            static_cast<int>(compressed_size),
-            static_cast<int>(originalSize)
-        );
-        if (decompressed < 0) throw std::runtime_error("LZ4 decompression failed");
-        output.resize(decompressed);
+        inflateStored(compressed_ptr, compressed_size, output.data(), originalSize);
         return output;
     }
 
     Value decodeValue() {
+        const uint8_t* value = fileData + masterOffset;
         uint8_t byte = readByte();
 
         if ((byte & 0x80) == 0) {
@@ -137,6 +745,7 @@ public:
             return decodeWrapper(id);
         }
 
+        if (isTimestampAt(value)) return Value(formatTimestamp(readTimestamp(readNBytesPtr(kTimestampSize - 1))));
         switch (byte & 0xF0) {
             case 0xC0: return Value(int64_t(byte & 0x0F));
             case 0xD0: return Value(-int64_t(byte & 0x0F));
@@ -165,6 +774,17 @@ public:
                     return Value(val);
                 }
 
+                if (byte == kValueString) return Value(std::string(file->sections.valueString(readVarNumber())));
+
+                if (byte == kSharedString) {
+                    size_t storedSize = readVarNumber();
+                    size_t originalSize = readVarNumber();
+                    const uint8_t* stored = readNBytesPtr(storedSize);
+                    std::string text(originalSize, '\0');
+                    inflateStored(stored, storedSize, reinterpret_cast<uint8_t*>(text.data()), originalSize, file->sections.sharedStrings);
+                    return Value(std::move(text));
+                }
+
                 if (subType == 0x08) {
                     const uint8_t* data = readNBytesPtr(4);
                     float fval;
@@ -195,7 +815,17 @@ public:
         int low = 0;
         int high = count - 1;
 
-        std::string target = query[queryOffset++];
+        long target = file->resolveKey(query[queryOffset++]);
+        if (target < 0) throw std::runtime_error("The Key is not valid");
+
+        if (isShaped(offsetSize)) {
+            uint64_t shape = readVarNumber();
+            long field = shapedField(shape, count, target);
+            if (field < 0) throw std::runtime_error("The Key is not valid");
+            masterOffset = shapedValueOffset(offsetSize, count, field);
+            if (masterOffset >= fileSize) throw std::runtime_error("EOF: Attempted to read past end of file.");
+            return decodeValue();
+        }
 
         long savedOffset = masterOffset;
 
@@ -219,9 +849,7 @@ public:
                 throw std::runtime_error("EOF: Attempted to read past end of file.");
             }
 
-            long keyIdx = readVarNumber();
-            if (keyIdx >= dictionary.size()) throw std::runtime_error("Invalid key index");
-            auto key = dictionary[keyIdx];
+            long key = file->rankOf(readVarNumber());
 
             if (key == target) {
                 return decodeValue();
@@ -242,35 +870,50 @@ public:
         long count = byte & 0x7F;
         if (count == 0x7F) count = readVarNumber();
 
-        List l;
-        long offsetSize = readByte();
-
-        int low = 0;
-        int high = count - 1;
-
+        uint8_t offsetSize = readByte();
+        size_t tableOffset = masterOffset;
         long baseOffsetForData = masterOffset + (count * offsetSize);
 
-        std::string targetString = query[queryOffset++];
-
-        long target = std::stol(targetString);
-
-        masterOffset += target * offsetSize;
-
-        if (masterOffset >= fileSize) {
+        const std::string& targetString = query[queryOffset++];
+        CompiledQuery::Step step{-1};
+        CompiledQuery::parseListSegment(targetString, step);
+        if (isPacked(offsetSize) && tableOffset + packedDataSize(offsetSize, count) > fileSize) {
             throw std::runtime_error("EOF: Attempted to read past end of file.");
         }
+        ColumnarList columns;
+        if (isColumnar(offsetSize)) columns = ColumnarList(fileData + tableOffset, fileData + fileSize, count);
 
-        const uint8_t* valueOffsetPtr = readNBytesPtr(offsetSize);
-        long valueOffset = 0;
-        std::memcpy(&valueOffset, valueOffsetPtr, offsetSize);
+        auto elementValue = [&](long index) {
+            if (isPacked(offsetSize)) return packedValue(offsetSize, fileData + tableOffset, index);
+            if (isColumnar(offsetSize)) return decodeRecord(columns, index);
+            masterOffset = tableOffset + index * offsetSize;
+            const uint8_t* valueOffsetPtr = readNBytesPtr(offsetSize);
+            long valueOffset = 0;
+            std::memcpy(&valueOffset, valueOffsetPtr, offsetSize);
 
-        masterOffset = valueOffset + baseOffsetForData;
+            masterOffset = valueOffset + baseOffsetForData;
 
-        if (masterOffset >= fileSize) {
-            throw std::runtime_error("EOF: Attempted to read past end of file.");
+            if (masterOffset >= fileSize) {
+                throw std::runtime_error("EOF: Attempted to read past end of file.");
+            }
+            return decodeValue();
+        };
+
+        if (step.wildcard) {
+            auto [first, length, stride] = step.range(count);
+            long resume = queryOffset;
+            List l;
+            l.elements.reserve(length);
+            for (long k = 0; k < length; ++k) {
+                queryOffset = resume;
+                l.add(elementValue(first + k * stride));
+            }
+            return l.toValue();
         }
 
-        return decodeValue();
+        long target = step.resolveIndex(count);
+        if (target < 0) throw std::runtime_error("List index out of range");
+        return elementValue(target);
     }
 
     Value decodeObject() {
@@ -280,6 +923,22 @@ public:
 
         Object obj;
         long offsetSize = readByte();
+        const std::vector<uint64_t>* shapeKeyIds = nullptr;
+        if (isShaped(offsetSize)) {
+            shapeKeyIds = &shapeKeys(file->shapes, readVarNumber(), count);
+            if (mode == 0) {
+                if (hasImpliedOffsets(offsetSize)) readVarNumber();
+                else masterOffset += shapedOffsetWidth(offsetSize) * count;
+                for (long i = 0; i < count; i++) obj.add(file->dictionary[(*shapeKeyIds)[i]], decodeValue());
+                return obj.toValue();
+            }
+        }
+
+        if (mode == 1 && shapeKeyIds) {
+            List keys_result;
+            for (uint64_t keyIdx : *shapeKeyIds) keys_result.add(Value(file->dictionary[keyIdx]));
+            return keys_result;
+        }
 
         if (mode == 1) {
             List keys_result;
@@ -296,10 +955,10 @@ public:
             for (int i = 0; i < count; i++) {
                 masterOffset = baseOffsetForData + offsets[i];
 
-                long keyIdx = readVarNumber();
-                if (keyIdx >= dictionary.size()) throw std::runtime_error("Invalid key index");
+                uint64_t keyIdx = readVarNumber();
+                if (keyIdx >= file->dictionary.size()) throw std::runtime_error("Invalid key index");
 
-                keys_result.add(Value(dictionary[keyIdx]));
+                keys_result.add(Value(file->dictionary[keyIdx]));
             }
 
             return keys_result;
@@ -314,9 +973,9 @@ public:
 
 
         for (int i = 0; i < count; i++) {
-            long keyIdx = readVarNumber();
-            if (keyIdx >= dictionary.size()) throw std::runtime_error("Invalid key index");
-            obj.add(dictionary[keyIdx], decodeValue());
+            uint64_t keyIdx = readVarNumber();
+            if (keyIdx >= file->dictionary.size()) throw std::runtime_error("Invalid key index");
+            obj.add(file->dictionary[keyIdx], decodeValue());
         }
         return obj.toValue();
     }
@@ -327,9 +986,7 @@ public:
         if (count == 0x7F) count = readVarNumber();
 
         List l;
-        long offsetSize = readByte();
-
-        masterOffset += offsetSize * count;
+        uint8_t offsetSize = readByte();
 
         if(mode == 1){
             throw std::runtime_error("Invalid Keys request to List item");
@@ -338,8 +995,39 @@ public:
         if(mode == 2){
             return Value((int64_t) count);
         }
-        
+
         l.elements.reserve(count);
+        if (isPacked(offsetSize)) {
+            const uint8_t* packed = readNBytesPtr(packedDataSize(offsetSize, count));
+            forEachPacked(offsetSize, packed, count, [&](auto element) { l.add(Value(element)); });
+            return l.toValue();
+        }
+
+        if (isColumnar(offsetSize)) {
+            ColumnarList columns(fileData + masterOffset, fileData + fileSize, count);
+            std::vector<Object> records(count);
+            for (size_t j = 0; j < columns.keys.size(); j++) {
+                if (columns.keys[j] >= file->dictionary.size()) throw std::runtime_error("Invalid key index");
+                const std::string& key = file->dictionary[columns.keys[j]];
+                ColumnarColumn column = columns.column(j);
+                if (column.typed()) {
+                    forEachPackedCell(column, count, [&](uint64_t row, auto element) {
+                        records[row].fields.emplace_back(key, Value(element));
+                    });
+                    continue;
+                }
+                for (long row = 0; row < count; row++) {
+                    if (!column.present(row)) continue;
+                    masterOffset = column.valueAt(row) - fileData;
+                    records[row].fields.emplace_back(key, decodeValue());
+                }
+            }
+            for (auto& record : records) l.elements.emplace_back(std::move(record));
+            return l.toValue();
+        }
+
+        masterOffset += offsetSize * count;
+
         for (int i = 0; i < count; i++) {
             l.add(decodeValue());
         }
@@ -349,12 +1037,12 @@ public:
 
     Value decodeWrapper(long id) {
         size_t savedOffset = masterOffset;
-        masterOffset = entityTable.at(id) + baseOffset;
+        seekEntity(id);
         
         uint8_t peek = fileData[masterOffset];
         Value v;
         
-        if(queryOffset < query.size()){
+        if(queryOffset < static_cast<long>(query.size())){
             v = (peek & 0x80) ? decodeListSelective() : decodeObjectSelective();
         }
         else v = (peek & 0x80) ? decodeList() : decodeObject();
@@ -364,97 +1052,589 @@ public:
     }
 
     void load(const std::string& filename){
-        loadFile(filename);
-        
-        long headerLength = readVarNumber();
-        long entityCount = readVarNumber();
+        attach(ChaosFile::open(filename));
+    }
 
-        uint8_t dictFlag = readByte();
-        std::vector<uint8_t> dictBuffer;
-        if (dictFlag == 0xFF) {
-            long sz = readVarNumber();
-            long og = readVarNumber();
-            const uint8_t* comp_ptr = readNBytesPtr(sz);
-            dictBuffer = uncompressBuffer(comp_ptr, sz, og);
-        } else {
-            const uint8_t* dict_ptr = readNBytesPtr(dictFlag);
-            dictBuffer.assign(dict_ptr, dict_ptr + dictFlag);
+    CompiledQuery compile(const std::vector<std::string>& path) const {
+        CompiledQuery compiled;
+        compiled.owner = file.get();
+        compiled.steps.reserve(path.size());
+        for (const auto& segment : path) {
+            CompiledQuery::Step step{file->resolveKey(segment)};
+            bool listSegment = CompiledQuery::parseListSegment(segment, step);
+            if (step.keyRank < 0 && !listSegment) {
+                throw std::runtime_error("Query key '" + segment + "' does not exist in this file");
+            }
+            compiled.steps.push_back(step);
         }
+        return compiled;
+    }
 
-        size_t dictOffset = 0;
-        while (dictOffset < dictBuffer.size()) {
-            auto [stringLength, bytesConsumed] = readVarNumberFromBuffer(dictBuffer, dictOffset);
-            dictOffset += bytesConsumed;
-            if (dictOffset + stringLength > dictBuffer.size()) {
-                throw std::runtime_error("Invalid dictionary format");
+    // Where a walk over the file has got to. An Entity is a list or object with its own
+    // entity ID; a Primitive is an encoded value at offset. Elements of packed lists have
+    // no type byte of their own, so a Packed location keeps the list's tag, the offset of
+    // its packed data and the element's index. Records of a columnar list are not
+    // entities either: a Record location keeps the list's entity ID and the row.
+    struct Location {
+        enum class Kind { Entity, Primitive, Packed, Record };
+        Kind kind = Kind::Entity;
+        uint64_t id = 0;
+        size_t offset = 0;
+        uint64_t index = 0;
+        uint8_t tag = 0;
+
+        static Location entity(uint64_t id) { return {Kind::Entity, id, 0, 0, 0}; }
+        static Location primitive(size_t offset) { return {Kind::Primitive, 0, offset, 0, 0}; }
+        static Location packed(uint8_t tag, size_t offset, uint64_t index) { return {Kind::Packed, 0, offset, index, tag}; }
+        static Location record(uint64_t listId, uint64_t row) { return {Kind::Record, listId, 0, row, 0}; }
+    };
+
+    Location locatePacked(uint8_t tag, const uint8_t* data, uint64_t index) const {
+        return Location::packed(tag, data - fileData, index);
+    }
+
+    // With masterOffset at an encoded value, locates it: the entity it references, or
+    // the primitive itself.
+    Location locateValue() {
+        size_t valueOffset = masterOffset;
+        uint8_t peek = readByte();
+        if (((peek & 0xE0) >> 5) == 0x04 || ((peek & 0xE0) >> 5) == 0x05) {
+            uint64_t id = peek & 0x1F;
+            if (id == 0x1F) id = readVarNumber();
+            return Location::entity(id);
+        }
+        return Location::primitive(valueOffset);
+    }
+
+    Location locateCell(const ColumnarColumn& column, uint64_t row) {
+        if (column.typed()) return locatePacked(column.type, column.data, row);
+        masterOffset = column.valueAt(row) - fileData;
+        return locateValue();
+    }
+
+    Value cellValue(const ColumnarColumn& column, uint64_t row) {
+        if (column.typed()) return packedValue(column.type, column.data, row);
+        masterOffset = column.valueAt(row) - fileData;
+        return decodeValue();
+    }
+
+    // Decodes row of a columnar list as the object it stands for, or as its keys or field
+    // count in modes 1 and 2. A legacy selective walk that has segments left continues
+    // with the next one as a key instead.
+    Value decodeRecord(const ColumnarList& columns, uint64_t row) {
+        if (row >= columns.rows) throw std::runtime_error("List index out of range");
+        for (uint64_t key : columns.keys) {
+            if (key >= file->dictionary.size()) throw std::runtime_error("Invalid key index");
+        }
+
+        if (queryOffset < static_cast<long>(query.size())) {
+            long target = file->resolveKey(query[queryOffset++]);
+            for (size_t j = 0; j < columns.keys.size(); ++j) {
+                if (file->rankOf(columns.keys[j]) != target) continue;
+                ColumnarColumn column = columns.column(j);
+                if (column.present(row)) return cellValue(column, row);
             }
-            dictionary.emplace_back(reinterpret_cast<const char*>(dictBuffer.data() + dictOffset), stringLength);
-            dictOffset += stringLength;
+            throw std::runtime_error("The Key is not valid");
         }
 
-        uint8_t offsetSize = readByte();
-        entityTable.reserve(entityCount);
-        for (long i = 0; i < entityCount; i++) {
-            const uint8_t* b_ptr = readNBytesPtr(offsetSize);
-            long val = 0;
-            std::memcpy(&val, b_ptr, offsetSize);
-            entityTable.push_back(val);
+        Object obj;
+        List keys;
+        int64_t fields = 0;
+        for (size_t j = 0; j < columns.keys.size(); ++j) {
+            ColumnarColumn column = columns.column(j);
+            if (!column.present(row)) continue;
+            const std::string& key = file->dictionary[columns.keys[j]];
+            fields++;
+            if (mode == 1) keys.add(Value(key));
+            else if (mode == 0) obj.fields.emplace_back(key, cellValue(column, row));
         }
-        
-        baseOffset = masterOffset;
+        if (mode == 1) return keys.toValue();
+        if (mode == 2) return Value(fields);
+        return obj.toValue();
     }
 
-    Value getKeys() {
-        mode = 1;
-        return decodeWrapper(0);
+    Value packedValue(uint8_t tag, const uint8_t* data, uint64_t index) const {
+        switch (packedKind(tag)) {
+            case kPackedInteger: return Value(packedInteger(data, packedWidth(tag), index));
+            case kPackedFloat: return Value(packedFloat(data, packedWidth(tag), index));
+            case kPackedTimestamp: return Value(formatTimestamp(packedTimestamp(data, packedWidth(tag), index)));
+        }
+        return Value(packedBoolean(data, index));
     }
 
-    Value getLen() {
-        mode = 2;
-        return decodeWrapper(0);
+    Value packedValueAt(const Location& at) const {
+        return packedValue(at.tag, fileData + at.offset, at.index);
     }
 
-    Value decode(const std::string& filename) {
-        loadFile(filename);
+    // Follows one step from location at to the value it addresses.
+    void descend(Location& at, const CompiledQuery::Step& step) {
+        if (const char* error = tryDescend(at, step)) throw std::runtime_error(error);
+    }
 
-        mode = 0;
-        
-        long headerLength = readVarNumber();
-        long entityCount = readVarNumber();
+    // descend() without the throw: returns nullptr on success, otherwise the reason the
+    // step does not exist. Wildcard extraction uses it to turn gaps into null rows.
+    const char* tryDescend(Location& at, const CompiledQuery::Step& step) {
+        if (at.kind == Location::Kind::Record) {
+            uint64_t row = at.index;
+            const ColumnarList& columns = columnarList(at.id);
+            long j = step.keyRank < 0 ? -1 : columnOf(step.keyRank);
+            if (j < 0 || row >= columns.rows) return "The Key is not valid";
+            ColumnarColumn column = columns.column(j);
+            if (!column.present(row)) return "The Key is not valid";
+            at = locateCell(column, row);
+            return nullptr;
+        }
+        if (at.kind != Location::Kind::Entity) return "Query descends into a primitive value";
 
-        uint8_t dictFlag = readByte();
-        std::vector<uint8_t> dictBuffer;
-        if (dictFlag == 0xFF) {
-            long sz = readVarNumber();
-            long og = readVarNumber();
-            const uint8_t* comp_ptr = readNBytesPtr(sz);
-            dictBuffer = uncompressBuffer(comp_ptr, sz, og);
+        long entityId = at.id;
+        seekEntity(entityId);
+        uint8_t byte = readByte();
+        bool isList = (byte & 0x80) != 0;
+        long count = byte & 0x7F;
+        if (count == 0x7F) count = readVarNumber();
+        uint8_t offsetSize = readByte();
+        size_t tableOffset = masterOffset;
+        size_t dataOffset = tableOffset + count * offsetSize;
+
+        if (isList && isPacked(offsetSize)) {
+            if (step.wildcard) return "Slice queries must be run with execute or executeColumn";
+            long index = step.resolveIndex(count);
+            if (index < 0) return "List index out of range";
+            if (tableOffset + packedDataSize(offsetSize, count) > fileSize) return "EOF: Attempted to read past end of file.";
+            at = locatePacked(offsetSize, fileData + tableOffset, index);
+            return nullptr;
+        }
+
+        if (isList && isColumnar(offsetSize)) {
+            if (step.wildcard) return "Slice queries must be run with execute or executeColumn";
+            long index = step.resolveIndex(count);
+            if (index < 0) return "List index out of range";
+            at = Location::record(entityId, index);
+            return nullptr;
+        }
+
+        auto elementOffset = [&](long index) {
+            masterOffset = tableOffset + index * offsetSize;
+            const uint8_t* offsetPtr = readNBytesPtr(offsetSize);
+            long elementOffset = 0;
+            std::memcpy(&elementOffset, offsetPtr, offsetSize);
+            return dataOffset + elementOffset;
+        };
+
+        if (isList) {
+            if (step.wildcard) return "Slice queries must be run with execute or executeColumn";
+            long index = step.resolveIndex(count);
+            if (index < 0) return "List index out of range";
+            masterOffset = elementOffset(index);
         } else {
-            const uint8_t* dict_ptr = readNBytesPtr(dictFlag);
-            dictBuffer.assign(dict_ptr, dict_ptr + dictFlag);
+            long target = step.keyRank;
+            if (target < 0) return "The Key is not valid";
+            if (isShaped(offsetSize)) {
+                masterOffset = tableOffset;
+                uint64_t shape = readVarNumber();
+                long field = shapedField(shape, count, target);
+                if (field < 0) return "The Key is not valid";
+                masterOffset = shapedValueOffset(offsetSize, count, field);
+            } else {
+                long low = 0;
+                long high = count - 1;
+                bool found = false;
+                while (low <= high) {
+                    long mid = low + (high - low) / 2;
+                    masterOffset = elementOffset(mid);
+                    long key = file->rankOf(readVarNumber());
+                    if (key == target) {
+                        found = true;
+                        break;
+                    }
+                    if (key < target) low = mid + 1;
+                    else high = mid - 1;
+                }
+                if (!found) return "The Key is not valid";
+            }
         }
 
-        size_t dictOffset = 0;
-        while (dictOffset < dictBuffer.size()) {
-            auto [stringLength, bytesConsumed] = readVarNumberFromBuffer(dictBuffer, dictOffset);
-            dictOffset += bytesConsumed;
-            if (dictOffset + stringLength > dictBuffer.size()) {
-                throw std::runtime_error("Invalid dictionary format");
+        at = locateValue();
+        return nullptr;
+    }
+
+    // Walks a compiled query without decoding anything and returns where the addressed
+    // value lives.
+    Location locate(const CompiledQuery& compiled) {
+        if (compiled.owner != file.get()) throw std::runtime_error("CompiledQuery was compiled against another file");
+        blocks.trim();
+        size_t savedOffset = masterOffset;
+        Location at = Location::entity(0);
+
+        for (const auto& step : compiled.steps) {
+            descend(at, step);
+        }
+
+        masterOffset = savedOffset;
+        return at;
+    }
+
+    Location locateQuery() {
+        return locate(compile(query));
+    }
+
+    // Runs a compiled query and decodes its result; executeKeys / executeLen mirror
+    // getKeys / getLen. A slice segment that meets a list makes the result a List with
+    // one entry per selected element, and only those elements are decoded.
+    Value execute(const CompiledQuery& compiled) { return executeMode(compiled, 0); }
+    Value executeKeys(const CompiledQuery& compiled) { return executeMode(compiled, 1); }
+    Value executeLen(const CompiledQuery& compiled) { return executeMode(compiled, 2); }
+
+    Value executeMode(const CompiledQuery& compiled, int resultMode) {
+        if (compiled.owner != file.get()) throw std::runtime_error("CompiledQuery was compiled against another file");
+        blocks.trim();
+        size_t savedOffset = masterOffset;
+        Value v = select(Location::entity(0), compiled.steps, 0, false, resultMode);
+        masterOffset = savedOffset;
+        return v;
+    }
+
+    // Follows steps[at..] from one value. Below a slice, a path that does not exist in
+    // the selected element yields null for it rather than failing the query.
+    Value select(Location location, const std::vector<CompiledQuery::Step>& steps,
+                 size_t at, bool inSlice, int resultMode) {
+        for (; at < steps.size(); ++at) {
+            const auto& step = steps[at];
+            if (step.wildcard) {
+                long count = listCount(location);
+                if (count >= 0) {
+                    auto [first, length, stride] = step.range(count);
+                    List selected;
+                    selected.elements.reserve(length);
+                    for (long k = 0; k < length; ++k) {
+                        Location element = location;
+                        tryDescend(element, CompiledQuery::Step{-1, first + k * stride, true});
+                        selected.add(select(element, steps, at + 1, true, resultMode));
+                    }
+                    return selected.toValue();
+                }
+            }
+            if (const char* error = tryDescend(location, step)) {
+                if (inSlice) return Value();
+                throw std::runtime_error(error);
             }
-            dictionary.emplace_back(reinterpret_cast<const char*>(dictBuffer.data() + dictOffset), stringLength);
-            dictOffset += stringLength;
         }
+        return decodeAt(location, resultMode);
+    }
 
-        uint8_t offsetSize = readByte();
-        entityTable.reserve(entityCount);
-        for (long i = 0; i < entityCount; i++) {
-            const uint8_t* b_ptr = readNBytesPtr(offsetSize);
-            long val = 0;
-            std::memcpy(&val, b_ptr, offsetSize);
-            entityTable.push_back(val);
+    // Decodes the value a walk ended on.
+    Value decodeAt(const Location& at, int resultMode) {
+        mode = resultMode;
+        queryOffset = query.size();
+        switch (at.kind) {
+            case Location::Kind::Entity:
+                return decodeWrapper(at.id);
+            case Location::Kind::Record:
+                return decodeRecord(columnarList(at.id), at.index);
+            case Location::Kind::Packed:
+                return packedValueAt(at);
+            case Location::Kind::Primitive:
+                break;
         }
-        
-        baseOffset = masterOffset;
+
+        size_t savedOffset = masterOffset;
+        masterOffset = at.offset;
+        Value v = decodeValue();
+        masterOffset = savedOffset;
+        return v;
+    }
+
+    // Runs many compiled queries at once. The paths are merged into a trie so a shared
+    // prefix (say 42/telemetry for 42/telemetry/temp and 42/telemetry/humidity) is walked
+    // once, fanning out where paths diverge. Plans with slices are run on their own.
+    // Results come back in request order.
+    std::vector<Value> executeBatch(const std::vector<CompiledQuery>& plans) {
+        struct TrieNode {
+            CompiledQuery::Step step;
+            std::vector<size_t> children;
+            std::vector<size_t> queries;
+        };
+
+        std::vector<TrieNode> trie(1);
+        std::map<std::tuple<size_t, long, long>, size_t> edges;
+        std::vector<size_t> sliced;
+        for (size_t q = 0; q < plans.size(); ++q) {
+            if (plans[q].owner != file.get()) throw std::runtime_error("CompiledQuery was compiled against another file");
+            const auto& steps = plans[q].steps;
+            if (std::any_of(steps.begin(), steps.end(), [](const auto& step) { return step.wildcard; })) {
+                sliced.push_back(q);
+                continue;
+            }
+            size_t node = 0;
+            for (const auto& step : plans[q].steps) {
+                auto [edge, added] = edges.try_emplace({node, step.keyRank, step.index}, trie.size());
+                if (added) {
+                    trie.push_back({step, {}, {}});
+                    trie[node].children.push_back(edge->second);
+                }
+                node = edge->second;
+            }
+            trie[node].queries.push_back(q);
+        }
+
+        blocks.trim();
+        std::vector<Value> results(plans.size());
+        struct Position {
+            size_t node;
+            Location location;
+        };
+        size_t savedOffset = masterOffset;
+        std::vector<Position> stack{{0, Location::entity(0)}};
+        while (!stack.empty()) {
+            Position at = stack.back();
+            stack.pop_back();
+
+            if (!trie[at.node].queries.empty()) {
+                Value v = decodeAt(at.location, 0);
+                for (size_t i = 1; i < trie[at.node].queries.size(); ++i) results[trie[at.node].queries[i]] = v;
+                results[trie[at.node].queries[0]] = std::move(v);
+            }
+            for (size_t child : trie[at.node].children) {
+                Location location = at.location;
+                descend(location, trie[child].step);
+                stack.push_back({child, location});
+            }
+        }
+        masterOffset = savedOffset;
+        for (size_t q : sliced) results[q] = execute(plans[q]);
+        return results;
+    }
+
+    // Runs a query with "*" or slice segments. Each one expands over the elements it
+    // selects from the list it meets, the rest of the path is followed per element, and
+    // the values reached are gathered into a Column in selection order. The elements of
+    // the first slice are split into contiguous ranges, each walked by its own cursor on
+    // the shared file; threads == 0 uses every hardware thread.
+    Column executeColumn(const CompiledQuery& compiled, unsigned threads = 1) {
+        if (compiled.owner != file.get()) throw std::runtime_error("CompiledQuery was compiled against another file");
+        static constexpr long kMinRowsPerThread = 1024;
+        const auto& steps = compiled.steps;
+        blocks.trim();
+        size_t savedOffset = masterOffset;
+
+        Location location = Location::entity(0);
+        size_t first = 0;
+        for (; first < steps.size(); ++first) {
+            if (steps[first].wildcard && listCount(location) >= 0) break;
+            descend(location, steps[first]);
+        }
+
+        Column column;
+        if (first == steps.size()) {
+            appendResult(location, column);
+            masterOffset = savedOffset;
+            return column;
+        }
+
+        long begin, count, stride;
+        std::tie(begin, count, stride) = steps[first].range(listCount(location));
+        size_t chunks = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        chunks = std::max<size_t>(1, std::min<size_t>(chunks, count / kMinRowsPerThread));
+
+        std::vector<Column> parts(chunks);
+        std::vector<std::exception_ptr> errors(chunks);
+        std::vector<MMapDecoderSelective> cursors;
+        cursors.reserve(chunks - 1);
+        for (size_t c = 1; c < chunks; ++c) {
+            cursors.emplace_back(file);
+            cursors.back().customSizeMap = customSizeMap;
+        }
+        auto run = [&](MMapDecoderSelective& cursor, size_t c) {
+            try {
+                long from = count * c / chunks;
+                long to = count * (c + 1) / chunks;
+                cursor.gatherRange(location.id, begin + from * stride, to - from, stride, steps, first + 1, parts[c]);
+            } catch (...) {
+                errors[c] = std::current_exception();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t c = 1; c < chunks; ++c) workers.emplace_back(run, std::ref(cursors[c - 1]), c);
+        run(*this, 0);
+        for (auto& worker : workers) worker.join();
+        masterOffset = savedOffset;
+
+        for (auto& error : errors) {
+            if (error) std::rethrow_exception(error);
+        }
+        for (auto& part : parts) column.append(part);
+        return column;
+    }
+
+    // Element count of the value at location at if it is a list, otherwise -1.
+    long listCount(const Location& at) {
+        if (at.kind != Location::Kind::Entity) return -1;
+        seekEntity(at.id);
+        uint8_t byte = readByte();
+        if ((byte & 0x80) == 0) return -1;
+        long count = byte & 0x7F;
+        if (count == 0x7F) count = readVarNumber();
+        return count;
+    }
+
+    // Gathers length elements of list listId, from first on and stride apart. When the
+    // path ends at a packed list they are appended to out in bulk. On a columnar list
+    // only the column named by the next step is read, in bulk if it is packed and the
+    // path ends there.
+    void gatherRange(long listId, long first, long length, long stride,
+                     const std::vector<CompiledQuery::Step>& steps, size_t at, Column& out) {
+        seekEntity(listId);
+        long count = readByte() & 0x7F;
+        if (count == 0x7F) count = readVarNumber();
+        uint8_t tag = readByte();
+        if (at == steps.size() && isPacked(tag)) {
+            const uint8_t* packed = readNBytesPtr(packedDataSize(tag, count));
+            return out.appendPacked(tag, packed, first, length, stride);
+        }
+        if (at < steps.size() && isColumnar(tag)) {
+            const ColumnarList& columns = columnarList(listId);
+            long j = steps[at].keyRank < 0 ? -1 : columnOf(steps[at].keyRank);
+            if (j < 0) {
+                for (long k = 0; k < length; ++k) out.appendNull();
+                return;
+            }
+            ColumnarColumn column = columns.column(j);
+            if (column.typed() && !column.presence && at + 1 == steps.size()) {
+                return out.appendPacked(column.type, column.data, first, length, stride);
+            }
+            for (long k = 0; k < length; ++k) {
+                long row = first + k * stride;
+                if (!column.present(row)) {
+                    out.appendNull();
+                    continue;
+                }
+                gather(locateCell(column, row), steps, at + 1, out);
+            }
+            return;
+        }
+        for (long k = 0; k < length; ++k) gatherElement(listId, first + k * stride, steps, at, out);
+    }
+
+    void gatherElement(long listId, long index, const std::vector<CompiledQuery::Step>& steps, size_t at, Column& out) {
+        Location element = Location::entity(listId);
+        if (tryDescend(element, CompiledQuery::Step{-1, index, true})) return out.appendNull();
+        gather(element, steps, at, out);
+    }
+
+    // Follows steps[at..] from one value, expanding nested slices; a path that does not
+    // exist from here becomes a single null row.
+    void gather(Location location, const std::vector<CompiledQuery::Step>& steps, size_t at, Column& out) {
+        for (; at < steps.size(); ++at) {
+            if (steps[at].wildcard) {
+                long count = listCount(location);
+                if (count >= 0) {
+                    auto [first, length, stride] = steps[at].range(count);
+                    return gatherRange(location.id, first, length, stride, steps, at + 1, out);
+                }
+            }
+            if (tryDescend(location, steps[at])) return out.appendNull();
+        }
+        appendResult(location, out);
+    }
+
+    // Adds the value a walk ended on to out. Common scalars go straight from the encoded
+    // bytes into the column's buffers; everything else is decoded as a Value.
+    void appendResult(const Location& at, Column& out) {
+        switch (at.kind) {
+            case Location::Kind::Entity:
+            case Location::Kind::Record:
+                return out.appendValue(decodeAt(at, 0));
+            case Location::Kind::Packed:
+                if (packedKind(at.tag) != kPackedTimestamp) return out.appendValue(packedValueAt(at));
+                return out.appendTimestamp(packedTimestamp(fileData + at.offset, packedWidth(at.tag), at.index));
+            case Location::Kind::Primitive:
+                break;
+        }
+
+        size_t valueOffset = at.offset;
+        masterOffset = valueOffset;
+        uint8_t byte = readByte();
+        if (byte < 0x7F) {
+            const uint8_t* str_ptr = readNBytesPtr(byte);
+            return out.appendString(reinterpret_cast<const char*>(str_ptr), byte);
+        }
+        if (isTimestampAt(fileData + valueOffset)) return out.appendTimestamp(readTimestamp(readNBytesPtr(kTimestampSize - 1)));
+        switch (byte & 0xF0) {
+            case 0xC0: return out.appendInteger(byte & 0x0F);
+            case 0xD0: return out.appendInteger(-int64_t(byte & 0x0F));
+        }
+        switch (byte) {
+            case kValueString: {
+                std::string_view str = file->sections.valueString(readVarNumber());
+                return out.appendString(str.data(), str.size());
+            }
+            case 0xFC: return out.appendNull();
+            case 0xFE: return out.appendBoolean(false);
+            case 0xFF: return out.appendBoolean(true);
+            case 0xF9: {
+                double dval;
+                std::memcpy(&dval, readNBytesPtr(8), sizeof(double));
+                return out.appendFloat(dval);
+            }
+        }
+        masterOffset = valueOffset;
+        out.appendValue(decodeValue());
+    }
+
+    // Decodes the current query's result into an arena-backed Node tree.
+    NodeDocument decodeNodes() {
+        NodeDocument doc;
+        doc.dictionary = file->dictionary;
+        doc.arenas.emplace_back();
+        Location at = locateQuery();
+        NodeBuilder builder(fileData, fileSize, baseOffset, file->entityTable, file->shapes, file->dictionary.size(), file->sections, customSizeMap, doc.arenas.back(), true);
+        if (file->blocked) {
+            builder.enterEntity = [this](long id) {
+                auto [begin, end] = file->entityExtent(id);
+                blocks.ensure(begin, end);
+            };
+        }
+
+        if (at.kind == Location::Kind::Record) {
+            builder.buildRecord(at.id, at.index, doc.root);
+        } else if (at.kind == Location::Kind::Entity) {
+            builder.buildEntity(at.id, doc.root);
+        } else if (at.kind == Location::Kind::Packed) {
+            Value v = packedValueAt(at);
+            if (v.isInteger()) {
+                doc.root.type = ValueType::Integer;
+                doc.root.integer = v.asInteger();
+            } else if (v.isFloat()) {
+                doc.root.type = ValueType::Float;
+                doc.root.real = v.asFloat();
+            } else if (v.isString()) {
+                doc.root.setString(v.asString().data(), v.asString().size(), doc.arenas.back());
+            } else {
+                doc.root.type = ValueType::Boolean;
+                doc.root.boolean = v.asBoolean();
+            }
+        } else {
+            builder.buildValue(at.offset, -1, doc.root);
+        }
+        return doc;
+    }
+
+    Value getKeys() {
+        blocks.trim();
+        mode = 1;
+        return decodeWrapper(0);
+    }
+
+    Value getLen() {
+        blocks.trim();
+        mode = 2;
+        return decodeWrapper(0);
+    }
+
+    Value decode(const std::string& filename) {
+        load(filename);
+        mode = 0;
         return decodeWrapper(0);
     }
 };
\ No newline at end of file
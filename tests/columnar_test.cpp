@@ -0,0 +1,146 @@
+// Columnar lists: records written by Encoder::setColumnar read back the same through
+// the full, selective, view and column decoders, with and without block compression.
+#include "encoder.hpp"
+#include "decoder.cpp"
+#include "selective_decoder.cpp"
+#include "view_decoder.cpp"
+
+#include <cstdio>
+#include <iostream>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (ok) return;
+    std::cerr << "FAIL: " << what << "\n";
+    failures++;
+}
+
+static bool same(const Value& a, const Value& b) {
+    if (a.type() != b.type()) return false;
+    switch (a.type()) {
+        case ValueType::Object: {
+            const auto& x = a.asObject().fields;
+            const auto& y = b.asObject().fields;
+            if (x.size() != y.size()) return false;
+            for (size_t i = 0; i < x.size(); i++) {
+                if (x[i].first != y[i].first || !same(x[i].second, y[i].second)) return false;
+            }
+            return true;
+        }
+        case ValueType::List: {
+            const auto& x = a.asList().elements;
+            const auto& y = b.asList().elements;
+            if (x.size() != y.size()) return false;
+            for (size_t i = 0; i < x.size(); i++) {
+                if (!same(x[i], y[i])) return false;
+            }
+            return true;
+        }
+        case ValueType::String: return a.asString() == b.asString();
+        case ValueType::Integer: return a.asInteger() == b.asInteger();
+        case ValueType::Float: return a.asFloat() == b.asFloat();
+        case ValueType::Boolean: return a.asBoolean() == b.asBoolean();
+        default: return true;
+    }
+}
+
+static Value nodeToValue(const NodeDocument& doc, const Node& n) {
+    switch (n.type) {
+        case ValueType::Object: {
+            Object o;
+            for (uint32_t i = 0; i < n.size; i++) o.add(std::string(doc.key(n.fields[i].key)), nodeToValue(doc, n.fields[i].value));
+            return o.toValue();
+        }
+        case ValueType::List: {
+            List l;
+            for (uint32_t i = 0; i < n.size; i++) l.add(nodeToValue(doc, n.elements[i]));
+            return l.toValue();
+        }
+        case ValueType::String: return Value(std::string(n.asString()));
+        case ValueType::Integer: return Value(n.integer);
+        case ValueType::Float: return Value(n.real);
+        case ValueType::Boolean: return Value(n.boolean);
+        default: return Value();
+    }
+}
+
+// {"records": [...]} with rows records; every fourth one has no "temp".
+static Value makeRecords(size_t rows) {
+    List records;
+    for (size_t i = 0; i < rows; i++) {
+        Object record;
+        record.add("id", Value(static_cast<int64_t>(i)));
+        record.add("name", Value("device-" + std::to_string(i)));
+        record.add("ok", Value(i % 3 == 0));
+        if (i % 4 != 3) record.add("temp", Value(i * 1.5));
+        List tags;
+        for (size_t t = 0; t < i % 3; t++) tags.add(Value("t" + std::to_string(t)));
+        record.add("tags", tags.toValue());
+        records.add(record.toValue());
+    }
+    Object root;
+    root.add("records", records.toValue());
+    return root.toValue();
+}
+
+static void checkFile(const Value& source, size_t rows, size_t blockSize) {
+    const std::string chaosFile = "columnar_test.chaos";
+    const std::string label = blockSize ? " (blocked)" : "";
+    Encoder encoder;
+    encoder.setColumnar(true);
+    encoder.setBlockSize(blockSize);
+    encoder.encode(source, chaosFile);
+    const List& records = source.asObject().fields[0].second.asList();
+
+    MMapDecoder full;
+    check(same(full.decode(chaosFile), source), "full decode round-trips" + label);
+
+    MMapDecoderSelective selective;
+    selective.load(chaosFile);
+    auto at = selective.locate(selective.compile({"records", "5"}));
+    check(at.kind == MMapDecoderSelective::Location::Kind::Record && at.index == 5, "records/5 is a record location" + label);
+    for (size_t i = 0; i < rows; i++) {
+        Value record = selective.execute(selective.compile({"records", std::to_string(i)}));
+        check(same(record, records.elements[i]), "selective records/" + std::to_string(i) + label);
+    }
+    check(selective.execute(selective.compile({"records", "6", "name"})).asString() == "device-6", "selective field of a record" + label);
+    check(selective.executeLen(selective.compile({"records", "3"})).asInteger() == 4, "a record without temp has four fields" + label);
+
+    std::vector<std::string> path = {"records", "7"};
+    selective.setQuery(path);
+    NodeDocument doc = selective.decodeNodes();
+    check(same(nodeToValue(doc, doc.root), records.elements[7]), "decodeNodes of a record" + label);
+
+    MMapDecoderView view;
+    view.load(chaosFile);
+    for (size_t i = 0; i < rows; i++) {
+        ValueView record = view.query({"records", std::to_string(i)});
+        check(record.isObject() && same(record.toValue(), records.elements[i]), "view records/" + std::to_string(i) + label);
+    }
+    check(view.query({"records", "4", "temp"}).asFloat() == 6.0, "view field of a record" + label);
+    check(!view.query({"records", "3"}).find("temp").valid(), "view record without temp" + label);
+
+    Column ids = selective.executeColumn(selective.compile({"records", "*", "id"}));
+    check(ids.kind == Column::Kind::Integer && ids.rows == rows, "id column" + label);
+    for (size_t i = 0; i < ids.rows; i++) check(ids.integers[i] == static_cast<int64_t>(i), "id column row" + label);
+    Column temps = selective.executeColumn(selective.compile({"records", "*", "temp"}));
+    check(temps.kind == Column::Kind::Float && temps.rows == rows, "temp column" + label);
+    for (size_t i = 0; i < temps.rows; i++) {
+        bool missing = i % 4 == 3;
+        check(temps.nulls[i] == missing && (missing || temps.floats[i] == i * 1.5), "temp column row" + label);
+    }
+
+    std::remove(chaosFile.c_str());
+}
+
+int main() {
+    const size_t rows = 12;
+    Value source = makeRecords(rows);
+    checkFile(source, rows, 0);
+    checkFile(source, rows, kDefaultBlockSize);
+
+    if (failures) return 1;
+    std::cout << "columnar_test: OK\n";
+    return 0;
+}
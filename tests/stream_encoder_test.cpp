@@ -0,0 +1,61 @@
+// StreamEncoder duplicate keys: the last occurrence wins, and the values it replaces
+// leave no entities behind.
+#include "encoder.hpp"
+#include "encoder_stream.hpp"
+#include "decoder.cpp"
+#include "selective_decoder.cpp"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    if (ok) return;
+    std::cerr << "FAIL: " << what << "\n";
+    failures++;
+}
+
+struct Encoded {
+    size_t entities = 0;
+    Value root;
+};
+
+static Encoded streamEncode(const std::string& text) {
+    const std::string jsonFile = "stream_encoder_test.json";
+    const std::string chaosFile = "stream_encoder_test.chaos";
+    std::ofstream(jsonFile) << text;
+    StreamEncoder encoder;
+    encoder.encode(jsonFile, chaosFile);
+
+    Encoded out;
+    out.entities = ChaosFile::open(chaosFile)->entityTable.size();
+    MMapDecoder decoder;
+    out.root = decoder.decode(chaosFile);
+    std::remove(jsonFile.c_str());
+    std::remove(chaosFile.c_str());
+    return out;
+}
+
+int main() {
+    {
+        Encoded encoded = streamEncode(R"({"a":{"x":1},"a":2})");
+        check(encoded.entities == 1, "an object replaced by a later duplicate is not written");
+        const Object& root = encoded.root.asObject();
+        check(root.fields.size() == 1 && root.fields[0].first == "a" && root.fields[0].second.asInteger() == 2,
+              "the last duplicate wins");
+    }
+    {
+        Encoded encoded = streamEncode(R"({"b":[1,{"y":[2]}],"a":1,"b":{"z":3},"a":[4]})");
+        check(encoded.entities == 3, "only the surviving values' entities are written");
+        const Object& root = encoded.root.asObject();
+        check(root.fields.size() == 2, "one field per distinct key");
+        check(root.fields[0].first == "a" && root.fields[0].second.asList().elements.size() == 1, "last 'a' wins");
+        check(root.fields[1].first == "b" && root.fields[1].second.asObject().fields[0].first == "z", "last 'b' wins");
+    }
+
+    if (failures) return 1;
+    std::cout << "stream_encoder_test: OK\n";
+    return 0;
+}
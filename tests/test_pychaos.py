@@ -0,0 +1,108 @@
+# pychaos batch and async queries. Build the extension first (make pychaos), then run
+# pytest from the repository root.
+import asyncio
+import json
+import sys
+import threading
+import time
+from pathlib import Path
+
+import pytest
+
+sys.path.insert(0, str(Path(__file__).resolve().parent.parent))
+pychaos = pytest.importorskip("pychaos")
+
+RECORDS = 5000
+QUERIES = [["records", str(i), field] for i in range(0, RECORDS, 3) for field in ("name", "vals")]
+
+
+@pytest.fixture(scope="module")
+def chaos_file(tmp_path_factory):
+    directory = tmp_path_factory.mktemp("pychaos")
+    source = directory / "records.json"
+    records = [{"id": i, "name": f"device-{i}", "vals": [i, i * 2, i * 3]} for i in range(RECORDS)]
+    source.write_text(json.dumps({"records": records}))
+    target = directory / "records.chaos"
+    pychaos.encode(str(source), str(target))
+    return str(target)
+
+
+def test_parallel_query_matches_query(chaos_file):
+    decoder = pychaos.load(chaos_file)
+    sequential, _ = pychaos.query(chaos_file, QUERIES, decoder)
+    parallel, _ = pychaos.parallel_query(chaos_file, QUERIES, decoder, threads=4)
+    assert parallel == sequential
+    assert sequential[0] == "device-0"
+
+
+def test_run_compiled_plans_matches_query(chaos_file):
+    decoder = pychaos.load(chaos_file)
+    results, _ = pychaos.run([pychaos.compile(decoder, q) for q in QUERIES[:10]], decoder)
+    expected, _ = pychaos.query(chaos_file, QUERIES[:10], decoder)
+    assert results == expected
+
+
+def test_query_async_resolves_in_running_loop(chaos_file):
+    async def run():
+        return await asyncio.wait_for(pychaos.query_async(chaos_file, QUERIES[:10]), timeout=30)
+
+    results = asyncio.run(run())
+    expected, _ = pychaos.query(chaos_file, QUERIES[:10], None)
+    assert results == expected
+
+
+def test_query_async_raises_errors(chaos_file):
+    async def run():
+        return await pychaos.query_async(chaos_file, [["no-such-key"]])
+
+    with pytest.raises(RuntimeError):
+        asyncio.run(run())
+
+
+# A future cancelled while its batch runs must be left alone when the batch finishes;
+# setting it would make the loop report an InvalidStateError from the callback.
+def test_query_async_cancelled_future(chaos_file):
+    errors = []
+
+    async def run():
+        asyncio.get_running_loop().set_exception_handler(lambda loop, context: errors.append(context))
+        with pytest.raises(asyncio.TimeoutError):
+            await asyncio.wait_for(pychaos.query_async(chaos_file, QUERIES * 20), timeout=0)
+        # Later batches queue behind the cancelled one, so it has delivered by the time
+        # they have.
+        for _ in range(4):
+            await pychaos.query_async(chaos_file, QUERIES * 20)
+        await asyncio.sleep(0.1)
+
+    asyncio.run(run())
+    assert errors == []
+
+
+# Another thread must keep running while a batch is inside native code. With the GIL
+# held it could only run until the call entered C++, so a tick from the middle of the
+# call shows the GIL was released.
+@pytest.mark.parametrize("call", ["query", "parallel_query"])
+def test_batch_releases_gil(chaos_file, call):
+    decoder = pychaos.load(chaos_file)
+    queries = QUERIES * 100
+    ticks = []
+    stop = threading.Event()
+
+    def ticker():
+        while not stop.is_set():
+            ticks.append(time.perf_counter())
+
+    thread = threading.Thread(target=ticker)
+    thread.start()
+    try:
+        start = time.perf_counter()
+        getattr(pychaos, call)(chaos_file, queries, decoder)
+        end = time.perf_counter()
+    finally:
+        stop.set()
+        thread.join()
+
+    duration = end - start
+    assert duration > 0.02, "batch too short to tell"
+    middle = [t for t in ticks if start + duration / 4 < t < end - duration / 4]
+    assert middle
@@ -0,0 +1,664 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <cstring>
+#include <lz4.h>
+#include "datastruct.hpp"
+#include "chaos_format.hpp"
+
+class MMapDecoderView;
+
+// Borrowed, read-only handle to one encoded value inside a file loaded by MMapDecoderView.
+// Strings are string_views into the mapping and lists/objects are walked through their
+// offset tables on demand; nothing is allocated unless toValue()/toString() is called.
+// A view is only valid while the MMapDecoderView that produced it is alive.
+// Block-compressed files are inflated a block at a time as views reach their entities,
+// and the blocks stay resident until the MMapDecoderView is destroyed, since any view
+// may still point into them.
+class ValueView {
+    friend class MMapDecoderView;
+
+    const MMapDecoderView* file = nullptr;
+    const uint8_t* ptr = nullptr;
+
+    // Lists and objects: parsed entity header.
+    bool isEntity = false;
+    bool entityIsList = false;
+    size_t count = 0;
+    uint8_t offsetSize = 0;
+    const uint8_t* offsets = nullptr;
+    const uint8_t* data = nullptr;
+
+    // Shaped objects: key IDs come from the shape, and fields are stride bytes apart
+    // when the object has no offset table.
+    const uint64_t* fieldKeys = nullptr;
+    size_t stride = 0;
+
+    // Elements of packed lists: ptr is the list's element data, packedTag its tag.
+    uint8_t packedTag = 0;
+    size_t packedIndex = 0;
+
+    // Records of a columnar list: columns is the list's column header (just past its
+    // tag), rows its record count and row this record's position.
+    const uint8_t* columns = nullptr;
+    size_t rows = 0;
+    size_t row = 0;
+
+    const uint8_t* elementPtr(size_t index) const;
+
+    // Calls f(key, column) for each field this record has, until f returns false.
+    template <typename F>
+    void forEachField(F&& f) const;
+    ValueView cell(const ColumnarColumn& column) const;
+
+public:
+    ValueView() = default;
+
+    bool valid() const { return file != nullptr; }
+    ValueType type() const;
+
+    bool isNull() const { return type() == ValueType::Null; }
+    bool isString() const { return type() == ValueType::String; }
+    bool isInteger() const { return type() == ValueType::Integer; }
+    bool isFloat() const { return type() == ValueType::Float; }
+    bool isBoolean() const { return type() == ValueType::Boolean; }
+    bool isByte() const { return type() == ValueType::Byte; }
+    bool isObject() const { return isEntity && !entityIsList; }
+    bool isList() const { return isEntity && entityIsList; }
+    bool isCustom() const { return type() == ValueType::Custom; }
+
+    // LZ4-compressed strings (127+ bytes, or written against the file's shared strings)
+    // and timestamps cannot be borrowed; use toString() for those.
+    bool isCompressedString() const {
+        return isString() && (packedTag || (ptr[0] & 0x7F) == 0x7F || ptr[0] == kSharedString || isTimestampAt(ptr));
+    }
+    std::string_view asString() const;
+    std::string toString() const;
+    // Timestamp strings (see kTimestamp) also read as microseconds since the epoch,
+    // so they compare and range-filter without being formatted.
+    bool isTimestamp() const;
+    int64_t asTimestamp() const;
+    // The string's ID in the file's value dictionary, or -1 if it was written in full.
+    long stringId() const;
+    int64_t asInteger() const;
+    double asFloat() const;
+    bool asBoolean() const;
+    uint8_t asByte() const;
+    std::string_view asCustomData() const;
+
+    size_t size() const;
+    ValueView at(size_t index) const;
+    std::string_view keyAt(size_t index) const;
+    ValueView find(std::string_view key) const;
+
+    Value toValue() const;
+};
+
+class MMapDecoderView {
+    uint8_t* fileData = nullptr;
+    size_t fileSize = 0;
+    size_t baseOffset = 0;
+
+    long entityCount = 0;
+    uint8_t entityOffsetSize = 0;
+    const uint8_t* entityTable = nullptr;
+
+    std::vector<uint8_t> dictStorage;
+    std::vector<std::string_view> dictionary;
+    ShapeList shapes;
+    IndexSections sections;
+    std::unordered_map<std::string_view, uint64_t> valueStringIds;
+    std::unordered_map<uint8_t, size_t> customSizeMap;
+
+    // Entity data: past the index in the mapping, or the block cache's image for
+    // block-compressed files, whose entity start offsets (ascending) bound each entity.
+    const uint8_t* dataBegin = nullptr;
+    size_t dataSize = 0;
+    bool blocked = false;
+    BlockTable blockTable;
+    std::vector<long> entityStarts;
+    mutable BlockCache blocks;
+    mutable std::mutex blocksMutex;
+
+    // Inflates the blocks holding entity data [begin, next entity start).
+    void ensureEntity(long begin) const {
+        auto next = std::upper_bound(entityStarts.begin(), entityStarts.end(), begin);
+        std::lock_guard<std::mutex> lock(blocksMutex);
+        blocks.ensure(begin, next == entityStarts.end() ? blockTable.dataSize : *next);
+    }
+
+public:
+    MMapDecoderView() = default;
+    MMapDecoderView(const MMapDecoderView&) = delete;
+    MMapDecoderView& operator=(const MMapDecoderView&) = delete;
+
+    ~MMapDecoderView() {
+        if (fileData) munmap(fileData, fileSize);
+    }
+
+    void loadFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Cannot open file");
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            throw std::runtime_error("Cannot get file stats");
+        }
+        fileSize = st.st_size;
+
+        if (fileSize > 0) {
+            fileData = (uint8_t*)mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (fileData == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("mmap failed");
+            }
+        }
+        close(fd);
+    }
+
+    void addCustom(uint8_t id, size_t size) {
+        customSizeMap[id] = size;
+    }
+
+    size_t customSize(uint8_t id) const {
+        return customSizeMap.at(id);
+    }
+
+    const uint8_t* checkedPtr(const uint8_t* p, size_t n) const {
+        bool inFile = p >= fileData && p + n <= fileData + fileSize;
+        bool inData = p >= dataBegin && p + n <= dataBegin + dataSize;
+        if (!inFile && !inData) {
+            throw std::runtime_error("EOF: Attempted to read past end of file.");
+        }
+        return p;
+    }
+
+    uint64_t readVarNumber(const uint8_t*& p) const {
+        uint8_t size_byte = *checkedPtr(p, 1);
+        p++;
+        if (size_byte < 128) return static_cast<uint64_t>(size_byte);
+
+        size_t len = size_byte & 0x7F;
+        checkedPtr(p, len);
+        uint64_t result = 0;
+        std::memcpy(&result, p, len > sizeof(uint64_t) ? sizeof(uint64_t) : len);
+        p += len;
+        return result;
+    }
+
+    const uint8_t* end() const { return dataBegin + dataSize; }
+
+    std::string_view key(uint64_t keyIdx) const {
+        if (keyIdx >= dictionary.size()) throw std::runtime_error("Invalid key index");
+        return dictionary[keyIdx];
+    }
+
+    // p is just past the tag byte of a compressed string.
+    std::string_view valueString(uint64_t id) const {
+        return sections.valueString(id);
+    }
+
+    // ID of str in the file's value dictionary, or -1. Values written with that ID
+    // (ValueView::stringId) are equal to str, so equality tests can compare IDs.
+    long valueStringId(std::string_view str) const {
+        auto it = valueStringIds.find(str);
+        return it == valueStringIds.end() ? -1 : static_cast<long>(it->second);
+    }
+
+    std::string uncompressString(const uint8_t* p, bool shared) const {
+        size_t compressedSize = readVarNumber(p);
+        size_t originalSize = readVarNumber(p);
+        checkedPtr(p, compressedSize);
+        std::string output(originalSize, '\0');
+        inflateStored(p, compressedSize, reinterpret_cast<uint8_t*>(output.data()), originalSize,
+                      shared ? std::string_view(sections.sharedStrings) : std::string_view());
+        return output;
+    }
+
+    ValueView entityView(uint64_t id) const {
+        if (id >= static_cast<uint64_t>(entityCount)) throw std::runtime_error("Invalid entity reference");
+        long offset = 0;
+        std::memcpy(&offset, entityTable + id * entityOffsetSize, entityOffsetSize);
+
+        if (blocked) {
+            if (offset < 0 || static_cast<size_t>(offset) >= dataSize) throw std::runtime_error("Invalid entity offset");
+            ensureEntity(offset);
+        }
+
+        ValueView v;
+        v.file = this;
+        v.isEntity = true;
+        v.ptr = checkedPtr(dataBegin + offset, 2);
+
+        const uint8_t* p = v.ptr;
+        uint8_t byte = *p++;
+        v.entityIsList = (byte & 0x80) != 0;
+        v.count = byte & 0x7F;
+        if (v.count == 0x7F) v.count = readVarNumber(p);
+        v.offsetSize = *checkedPtr(p, 1);
+        p++;
+        if (v.entityIsList && isPacked(v.offsetSize)) {
+            v.data = checkedPtr(p, packedDataSize(v.offsetSize, v.count));
+            return v;
+        }
+        if (v.entityIsList && isColumnar(v.offsetSize)) {
+            v.data = p;
+            return v;
+        }
+        if (!v.entityIsList && isShaped(v.offsetSize)) {
+            uint8_t offsetByte = v.offsetSize;
+            v.fieldKeys = shapeKeys(shapes, readVarNumber(p), v.count).data();
+            if (hasImpliedOffsets(offsetByte)) {
+                v.stride = readVarNumber(p);
+                v.offsetSize = 0;
+                v.data = p;
+                return v;
+            }
+            v.offsetSize = shapedOffsetWidth(offsetByte);
+        }
+        v.offsets = checkedPtr(p, v.count * v.offsetSize);
+        v.data = p + v.count * v.offsetSize;
+        return v;
+    }
+
+    ValueView valueView(const uint8_t* p) const {
+        uint8_t byte = *checkedPtr(p, 1);
+        if (((byte & 0xE0) >> 5) == 0x04 || ((byte & 0xE0) >> 5) == 0x05) {
+            p++;
+            uint64_t id = byte & 0x1F;
+            if (id == 0x1F) id = readVarNumber(p);
+            return entityView(id);
+        }
+        ValueView v;
+        v.file = this;
+        v.ptr = p;
+        return v;
+    }
+
+    void load(const std::string& filename) {
+        loadFile(filename);
+
+        size_t indexOffset = 0;
+        bool trailer = findTrailer(fileData, fileSize, indexOffset);
+        const uint8_t* p = fileData + indexOffset;
+        const uint8_t* indexEnd = fileData + fileSize - kTrailerTailSize;
+        if (!trailer) {
+            uint64_t indexSize = readVarNumber(p);
+            if (indexSize > static_cast<uint64_t>(fileData + fileSize - p)) throw std::runtime_error("Invalid index size");
+            indexEnd = p + indexSize;
+        }
+        if (trailer && fileData[0] == kBlockedFormatByte) {
+            blockTable = BlockTable::read(p, indexEnd, indexOffset - kTrailerDataOffset);
+            blocked = true;
+        }
+        entityCount = readVarNumber(p);
+
+        uint8_t dictFlag = *checkedPtr(p, 1);
+        p++;
+        const uint8_t* dict_ptr = p;
+        size_t dictSize = dictFlag;
+        if (dictFlag == 0xFF) {
+            size_t sz = readVarNumber(p);
+            size_t og = readVarNumber(p);
+            checkedPtr(p, sz);
+            dictStorage.resize(og);
+            inflateStored(p, sz, dictStorage.data(), og);
+            dict_ptr = dictStorage.data();
+            dictSize = og;
+            p += sz;
+        } else {
+            checkedPtr(p, dictSize);
+            p += dictSize;
+        }
+
+        size_t dictOffset = 0;
+        while (dictOffset < dictSize) {
+            uint8_t sizeByte = dict_ptr[dictOffset++];
+            uint64_t stringLength = sizeByte;
+            if (sizeByte >= 128) {
+                size_t len = sizeByte & 0x7F;
+                if (dictOffset + len > dictSize) throw std::runtime_error("Buffer underflow for multi-byte number.");
+                stringLength = 0;
+                std::memcpy(&stringLength, dict_ptr + dictOffset, len > sizeof(uint64_t) ? sizeof(uint64_t) : len);
+                dictOffset += len;
+            }
+            if (dictOffset + stringLength > dictSize) {
+                throw std::runtime_error("Invalid dictionary format");
+            }
+            dictionary.emplace_back(reinterpret_cast<const char*>(dict_ptr + dictOffset), stringLength);
+            dictOffset += stringLength;
+        }
+
+        entityOffsetSize = *checkedPtr(p, 1);
+        p++;
+        entityTable = checkedPtr(p, entityCount * entityOffsetSize);
+        p += entityCount * entityOffsetSize;
+        shapes = readShapeTable(p, indexEnd, dictionary.size());
+        sections.read(p, indexEnd);
+        for (size_t id = 0; id < sections.valueStrings.size(); ++id) valueStringIds.emplace(sections.valueStrings[id], id);
+
+        baseOffset = trailer ? kTrailerDataOffset : indexEnd - fileData;
+        if (blocked) {
+            for (long id = 0; id < entityCount; ++id) {
+                long offset = 0;
+                std::memcpy(&offset, entityTable + id * entityOffsetSize, entityOffsetSize);
+                entityStarts.push_back(offset);
+            }
+            std::sort(entityStarts.begin(), entityStarts.end());
+            blocks.attach(&blockTable, fileData + kTrailerDataOffset);
+            dataBegin = blocks.data();
+            dataSize = blockTable.dataSize;
+        } else {
+            dataBegin = fileData + baseOffset;
+            dataSize = fileSize - baseOffset;
+        }
+    }
+
+    ValueView root() const {
+        return entityView(0);
+    }
+
+    // Follows a selective-decoder style path (keys for objects, decimal indices for lists).
+    ValueView query(const std::vector<std::string>& path) const {
+        ValueView v = root();
+        for (const auto& part : path) {
+            if (v.isObject()) {
+                v = v.find(part);
+                if (!v.valid()) throw std::runtime_error("The Key is not valid");
+            } else if (v.isList()) {
+                long index = std::stol(part);
+                if (index < 0 || static_cast<size_t>(index) >= v.size()) throw std::runtime_error("List index out of range");
+                v = v.at(index);
+            } else {
+                throw std::runtime_error("Query descends into a primitive value");
+            }
+        }
+        return v;
+    }
+};
+
+inline ValueType ValueView::type() const {
+    if (!file) return ValueType::Null;
+    if (isEntity) return entityIsList ? ValueType::List : ValueType::Object;
+    if (packedTag) {
+        switch (packedKind(packedTag)) {
+            case kPackedInteger: return ValueType::Integer;
+            case kPackedFloat: return ValueType::Float;
+            case kPackedTimestamp: return ValueType::String;
+        }
+        return ValueType::Boolean;
+    }
+
+    uint8_t byte = ptr[0];
+    if ((byte & 0x80) == 0 || byte == kSharedString || byte == kValueString || isTimestampAt(ptr)) return ValueType::String;
+    switch (byte & 0xF0) {
+        case 0xC0:
+        case 0xD0: return ValueType::Integer;
+        case 0xE0: return ValueType::Custom;
+        case 0xF0: {
+            uint8_t subType = byte & 0x0F;
+            if (subType <= 0x07) return ValueType::Integer;
+            if (subType == 0x08 || subType == 0x09) return ValueType::Float;
+            if (subType == 0x0C) return ValueType::Null;
+            if (subType == 0x0D) return ValueType::Byte;
+            if (subType == 0x0E || subType == 0x0F) return ValueType::Boolean;
+        }
+    }
+    throw std::runtime_error("Unknown type byte");
+}
+
+inline std::string_view ValueView::asString() const {
+    if (!isString()) throw std::runtime_error("Not a String");
+    if (ptr[0] == kValueString) return file->valueString(stringId());
+    size_t strSize = ptr[0] & 0x7F;
+    if (isCompressedString()) throw std::runtime_error("Compressed string cannot be borrowed; use toString()");
+    return std::string_view(reinterpret_cast<const char*>(file->checkedPtr(ptr + 1, strSize)), strSize);
+}
+
+inline long ValueView::stringId() const {
+    if (!isString() || ptr[0] != kValueString) return -1;
+    const uint8_t* p = ptr + 1;
+    return static_cast<long>(file->readVarNumber(p));
+}
+
+inline std::string ValueView::toString() const {
+    if (isTimestamp()) return formatTimestamp(packedTag ? packedTimestamp(ptr, packedWidth(packedTag), packedIndex)
+                                                        : readTimestamp(file->checkedPtr(ptr + 1, kTimestampSize - 1)));
+    if (isCompressedString()) return file->uncompressString(ptr + 1, ptr[0] == kSharedString);
+    return std::string(asString());
+}
+
+inline bool ValueView::isTimestamp() const {
+    if (!isString()) return false;
+    if (packedTag) return true;
+    return isTimestampAt(ptr);
+}
+
+inline int64_t ValueView::asTimestamp() const {
+    if (!isTimestamp()) throw std::runtime_error("Not a Timestamp");
+    if (packedTag) return packedTimestamp(ptr, packedWidth(packedTag), packedIndex).micros;
+    return readTimestamp(file->checkedPtr(ptr + 1, kTimestampSize - 1)).micros;
+}
+
+inline int64_t ValueView::asInteger() const {
+    if (!isInteger()) throw std::runtime_error("Not an Integer");
+    if (packedTag) return packedInteger(ptr, packedWidth(packedTag), packedIndex);
+    uint8_t byte = ptr[0];
+    if ((byte & 0xF0) == 0xC0) return int64_t(byte & 0x0F);
+    if ((byte & 0xF0) == 0xD0) return -int64_t(byte & 0x0F);
+
+    uint8_t subType = byte & 0x0F;
+    size_t len = 1 << (subType & 0x03);
+    int64_t val = 0;
+    std::memcpy(&val, file->checkedPtr(ptr + 1, len), len);
+    if (subType & 0x04) val = -val;
+    return val;
+}
+
+inline double ValueView::asFloat() const {
+    if (!isFloat()) throw std::runtime_error("Not a Float");
+    if (packedTag) return packedFloat(ptr, packedWidth(packedTag), packedIndex);
+    if ((ptr[0] & 0x0F) == 0x08) {
+        float fval;
+        std::memcpy(&fval, file->checkedPtr(ptr + 1, 4), sizeof(float));
+        return fval;
+    }
+    double dval;
+    std::memcpy(&dval, file->checkedPtr(ptr + 1, 8), sizeof(double));
+    return dval;
+}
+
+inline bool ValueView::asBoolean() const {
+    if (!isBoolean()) throw std::runtime_error("Not a Boolean");
+    if (packedTag) return packedBoolean(ptr, packedIndex);
+    return ptr[0] == 0xFF;
+}
+
+inline uint8_t ValueView::asByte() const {
+    if (!isByte()) throw std::runtime_error("Not a Byte");
+    return *file->checkedPtr(ptr + 1, 1);
+}
+
+inline std::string_view ValueView::asCustomData() const {
+    if (!isCustom()) throw std::runtime_error("Not a Custom type");
+    const uint8_t* p = ptr + 1;
+    uint64_t id = ptr[0] & 0x0F;
+    if (id == 0x0F) id = file->readVarNumber(p);
+    size_t sz = file->customSize(id);
+    return std::string_view(reinterpret_cast<const char*>(file->checkedPtr(p, sz)), sz);
+}
+
+inline size_t ValueView::size() const {
+    if (!isEntity) throw std::runtime_error("Not a List or Object");
+    if (columns) {
+        size_t fields = 0;
+        forEachField([&](uint64_t, const ColumnarColumn&) { fields++; return true; });
+        return fields;
+    }
+    return count;
+}
+
+template <typename F>
+inline void ValueView::forEachField(F&& f) const {
+    ColumnarList::forEachColumn(columns, file->end(), rows, [&](uint64_t key, const ColumnarColumn& column) {
+        return !column.present(row) || f(key, column);
+    });
+}
+
+inline ValueView ValueView::cell(const ColumnarColumn& column) const {
+    if (!column.typed()) return file->valueView(column.valueAt(row));
+    ValueView v;
+    v.file = file;
+    v.ptr = column.data;
+    v.packedTag = column.type;
+    v.packedIndex = row;
+    return v;
+}
+
+inline const uint8_t* ValueView::elementPtr(size_t index) const {
+    if (!isEntity) throw std::runtime_error("Not a List or Object");
+    if (index >= count) throw std::runtime_error("Index out of range");
+    if (fieldKeys && offsetSize == 0) return data + index * stride;
+    long offset = 0;
+    std::memcpy(&offset, offsets + index * offsetSize, offsetSize);
+    return data + offset;
+}
+
+inline ValueView ValueView::at(size_t index) const {
+    if (isList() && isPacked(offsetSize)) {
+        if (index >= count) throw std::runtime_error("Index out of range");
+        ValueView v;
+        v.file = file;
+        v.ptr = data;
+        v.packedTag = offsetSize;
+        v.packedIndex = index;
+        return v;
+    }
+    if (isList() && isColumnar(offsetSize)) {
+        if (index >= count) throw std::runtime_error("Index out of range");
+        ValueView v;
+        v.file = file;
+        v.isEntity = true;
+        v.columns = data;
+        v.rows = count;
+        v.row = index;
+        return v;
+    }
+    if (columns) {
+        ValueView v;
+        size_t i = 0;
+        forEachField([&](uint64_t, const ColumnarColumn& column) {
+            if (i++ < index) return true;
+            v = cell(column);
+            return false;
+        });
+        if (!v.valid()) throw std::runtime_error("Index out of range");
+        return v;
+    }
+    const uint8_t* p = elementPtr(index);
+    if (!entityIsList && !fieldKeys) file->readVarNumber(p);
+    return file->valueView(p);
+}
+
+inline std::string_view ValueView::keyAt(size_t index) const {
+    if (!isObject()) throw std::runtime_error("Not an Object");
+    if (columns) {
+        std::string_view name;
+        bool found = false;
+        size_t i = 0;
+        forEachField([&](uint64_t key, const ColumnarColumn&) {
+            if (i++ < index) return true;
+            name = file->key(key);
+            found = true;
+            return false;
+        });
+        if (!found) throw std::runtime_error("Index out of range");
+        return name;
+    }
+    if (fieldKeys) {
+        if (index >= count) throw std::runtime_error("Index out of range");
+        return file->key(fieldKeys[index]);
+    }
+    const uint8_t* p = elementPtr(index);
+    return file->key(file->readVarNumber(p));
+}
+
+// Binary search over the object's (key-sorted) fields; returns an invalid view when absent.
+inline ValueView ValueView::find(std::string_view target) const {
+    if (!isObject()) throw std::runtime_error("Not an Object");
+    if (columns) {
+        ValueView v;
+        forEachField([&](uint64_t key, const ColumnarColumn& column) {
+            int cmp = file->key(key).compare(target);
+            if (cmp == 0) v = cell(column);
+            return cmp < 0;
+        });
+        return v;
+    }
+    long low = 0;
+    long high = static_cast<long>(count) - 1;
+    while (low <= high) {
+        long mid = low + (high - low) / 2;
+        const uint8_t* p = elementPtr(mid);
+        std::string_view key = file->key(fieldKeys ? fieldKeys[mid] : file->readVarNumber(p));
+        int cmp = key.compare(target);
+        if (cmp == 0) return file->valueView(p);
+        if (cmp < 0) low = mid + 1;
+        else high = mid - 1;
+    }
+    return ValueView();
+}
+
+inline Value ValueView::toValue() const {
+    switch (type()) {
+        case ValueType::Null: return Value();
+        case ValueType::String: return Value(toString());
+        case ValueType::Integer: return Value(asInteger());
+        case ValueType::Float: return Value(asFloat());
+        case ValueType::Boolean: return Value(asBoolean());
+        case ValueType::Byte: return Value(asByte());
+        case ValueType::Custom: {
+            uint64_t id = ptr[0] & 0x0F;
+            if (id == 0x0F) {
+                const uint8_t* p = ptr + 1;
+                id = file->readVarNumber(p);
+            }
+            std::string_view d = asCustomData();
+            return Custom(id, std::vector<uint8_t>(d.begin(), d.end())).toValue();
+        }
+        case ValueType::Object: {
+            Object obj;
+            if (columns) {
+                forEachField([&](uint64_t key, const ColumnarColumn& column) {
+                    obj.fields.emplace_back(std::string(file->key(key)), cell(column).toValue());
+                    return true;
+                });
+                return obj.toValue();
+            }
+            obj.fields.reserve(count);
+            for (size_t i = 0; i < count; i++) {
+                obj.fields.emplace_back(std::string(keyAt(i)), at(i).toValue());
+            }
+            return obj.toValue();
+        }
+        case ValueType::List: {
+            List l;
+            l.elements.reserve(count);
+            for (size_t i = 0; i < count; i++) {
+                l.add(at(i).toValue());
+            }
+            return l.toValue();
+        }
+        default:
+            throw std::runtime_error("Unsupported view type");
+    }
+}